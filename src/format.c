@@ -0,0 +1,519 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "format.h"
+#include <kroki/error.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+#define unlikely(expr)  __builtin_expect(!! (expr), 0)
+
+
+#define BUFFER_SIZE  (1 << 20)
+
+
+static const struct
+{
+  const char *name;
+  enum format_type type;
+} formats[] = {
+  { "text", FORMAT_TEXT },
+  { "json", FORMAT_JSON },
+  { "prometheus", FORMAT_PROMETHEUS },
+  { "tsv", FORMAT_TSV },
+  { "columnar", FORMAT_COLUMNAR },
+};
+
+
+int
+format_parse(const char *name, enum format_type *type)
+{
+  for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); ++i)
+    {
+      if (strcmp(name, formats[i].name) == 0)
+        {
+          *type = formats[i].type;
+          return 0;
+        }
+    }
+
+  return -1;
+}
+
+
+void
+format_init(struct formatter *f, int fd, enum format_type type, int by_name)
+{
+  memset(f, 0, sizeof(*f));
+  f->fd = fd;
+  f->type = type;
+  f->by_name = by_name;
+  f->element = -1;
+  f->size = BUFFER_SIZE;
+  f->buf = MEM(malloc(f->size));
+}
+
+
+void
+format_destroy(struct formatter *f)
+{
+  free(f->row);
+  free(f->buf);
+}
+
+
+int
+format_flush(struct formatter *f)
+{
+  size_t done = 0;
+  while (done < f->len)
+    {
+      ssize_t res = write(f->fd, f->buf + done, f->len - done);
+      if (res == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      done += res;
+    }
+  f->len = 0;
+
+  return 0;
+}
+
+
+void
+format_clear(struct formatter *f)
+{
+  f->len = 0;
+}
+
+
+static
+char *
+reserve(struct formatter *f, size_t size)
+{
+  if (unlikely(f->len + size > f->size))
+    {
+      if (f->fd != -1)
+        {
+          if (format_flush(f) == -1)
+            error("write: %m");
+        }
+      while (f->len + size > f->size)
+        {
+          f->size *= 2;
+          f->buf = MEM(realloc(f->buf, f->size));
+        }
+    }
+
+  return f->buf + f->len;
+}
+
+
+static inline
+void
+put_mem(struct formatter *f, const char *s, size_t len)
+{
+  memcpy(reserve(f, len), s, len);
+  f->len += len;
+}
+
+
+static inline
+void
+put_str(struct formatter *f, const char *s)
+{
+  put_mem(f, s, strlen(s));
+}
+
+
+static inline
+void
+put_char(struct formatter *f, char c)
+{
+  *reserve(f, 1) = c;
+  ++f->len;
+}
+
+
+static
+void
+put_long(struct formatter *f, long value)
+{
+  char digits[sizeof(long) * 3 + 1];
+  char *p = digits + sizeof(digits);
+  unsigned long u = (value < 0
+                     ? -(unsigned long) value : (unsigned long) value);
+  do
+    {
+      *--p = '0' + u % 10;
+      u /= 10;
+    }
+  while (u);
+  if (value < 0)
+    *--p = '-';
+
+  put_mem(f, p, digits + sizeof(digits) - p);
+}
+
+
+static
+void
+put_tid(struct formatter *f, long tid)
+{
+  if (tid && f->group)
+    put_str(f, f->group);
+  else if (tid)
+    put_long(f, tid);
+  else
+    put_char(f, '*');
+}
+
+
+static
+void
+put_name(struct formatter *f, const char *name, const char *suffix)
+{
+  put_str(f, name);
+  if (suffix)
+    {
+      put_char(f, '.');
+      put_str(f, suffix);
+    }
+  if (f->element != -1)
+    {
+      put_char(f, '[');
+      put_long(f, f->element);
+      put_char(f, ']');
+    }
+}
+
+
+/*
+  Prometheus metric names may only have [a-zA-Z0-9_:], so everything
+  else (dots in the first place) is replaced with underscores.
+*/
+static
+void
+put_metric_name(struct formatter *f, const char *name, const char *suffix)
+{
+  for (int part = 0; part < 2 && name; ++part)
+    {
+      size_t len = strlen(name);
+      char *p = reserve(f, len + 1);
+      if (part)
+        *p++ = '_';
+      for (size_t i = 0; i < len; ++i)
+        {
+          char c = name[i];
+          if (! ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                 || (c >= '0' && c <= '9') || c == '_' || c == ':'))
+            c = '_';
+          *p++ = c;
+        }
+      f->len = p - f->buf;
+      name = suffix;
+    }
+}
+
+
+static
+int
+new_group(struct formatter *f, long tid, const char *name, const char *suffix)
+{
+  int res;
+  if (! f->in_group)
+    res = 1;
+  else if (f->by_name)
+    /*
+      Names of different stats files are equal strings at different
+      addresses.
+    */
+    res = ((name != f->group_name && strcmp(name, f->group_name) != 0)
+           || suffix != f->group_suffix
+           || f->element != f->group_element);
+  else
+    res = (tid != f->group_tid);
+
+  f->group_tid = tid;
+  f->group_name = name;
+  f->group_suffix = suffix;
+  f->group_element = f->element;
+
+  return res;
+}
+
+
+/*
+  Prometheus TYPE line goes before the first value of every metric.
+  This is not the same as a group: elements of an array are groups of
+  their own but a single metric, and totals output by thread are a
+  single group of many metrics.
+*/
+static
+int
+new_metric(struct formatter *f, const char *name, const char *suffix)
+{
+  int res = (! f->type_name
+             || (name != f->type_name && strcmp(name, f->type_name) != 0)
+             || suffix != f->type_suffix);
+
+  f->type_name = name;
+  f->type_suffix = suffix;
+
+  return res;
+}
+
+
+static
+void
+end_row(struct formatter *f)
+{
+  if (! f->in_group)
+    return;
+
+  put_char(f, '\n');
+  if (! f->header_done)
+    {
+      // The first row was collected aside while its names were output.
+      put_mem(f, f->row, f->row_len);
+      put_char(f, '\n');
+      f->header_done = 1;
+    }
+}
+
+
+/*
+  The first row of columnar format is collected in a side buffer while
+  its names are output as the header.  The side buffer is grown when
+  needed, and never flushed since fd is -1 for it.
+*/
+static
+void
+side_begin(struct formatter *f, struct formatter *side)
+{
+  *side = (struct formatter) {
+    .fd = -1,
+    .buf = f->row,
+    .len = f->row_len,
+    .size = f->row_size,
+    .group = f->group,
+  };
+  if (! side->buf)
+    {
+      side->size = 4096;
+      side->buf = MEM(malloc(side->size));
+    }
+}
+
+
+static
+void
+side_end(struct formatter *f, struct formatter *side)
+{
+  f->row = side->buf;
+  f->row_len = side->len;
+  f->row_size = side->size;
+}
+
+
+void
+format_begin(struct formatter *f)
+{
+  f->in_group = 0;
+  f->type_name = NULL;
+
+  if (f->type == FORMAT_JSON)
+    put_char(f, '{');
+}
+
+
+void
+format_value(struct formatter *f, long tid,
+             const char *name, const char *suffix,
+             enum value_type type, int present, long value)
+{
+  if (! present && f->type != FORMAT_COLUMNAR)
+    return;
+
+  int group = new_group(f, tid, name, suffix);
+
+  switch (f->type)
+    {
+    case FORMAT_TEXT:
+      put_char(f, '[');
+      put_tid(f, tid);
+      put_mem(f, "] ", 2);
+      put_name(f, name, suffix);
+      put_mem(f, ": ", 2);
+      put_long(f, value);
+      put_char(f, '\n');
+      break;
+
+    case FORMAT_TSV:
+      put_tid(f, tid);
+      put_char(f, '\t');
+      put_name(f, name, suffix);
+      put_char(f, '\t');
+      put_long(f, value);
+      put_char(f, '\n');
+      break;
+
+    case FORMAT_PROMETHEUS:
+      if (new_metric(f, name, suffix))
+        {
+          put_str(f, "# TYPE ");
+          put_metric_name(f, name, suffix);
+          put_str(f, (type == VALUE_COUNTER ? " counter\n" : " gauge\n"));
+        }
+      put_metric_name(f, name, suffix);
+      if (tid || f->labels || f->element != -1)
+        {
+          const char *sep = "";
+          put_char(f, '{');
+          if (f->labels)
+            {
+              put_str(f, f->labels);
+              sep = ",";
+            }
+          if (f->element != -1)
+            {
+              put_str(f, sep);
+              put_str(f, "index=\"");
+              put_long(f, f->element);
+              put_char(f, '"');
+              sep = ",";
+            }
+          if (tid)
+            {
+              put_str(f, sep);
+              put_str(f, (f->group ? "group=\"" : "tid=\""));
+              put_tid(f, tid);
+              put_char(f, '"');
+            }
+          put_char(f, '}');
+        }
+      put_char(f, ' ');
+      put_long(f, value);
+      put_char(f, '\n');
+      break;
+
+    case FORMAT_JSON:
+      if (group)
+        {
+          if (f->in_group)
+            put_mem(f, "},", 2);
+          put_char(f, '"');
+          if (f->by_name)
+            put_name(f, name, suffix);
+          else
+            put_tid(f, tid);
+          put_mem(f, "\":{", 3);
+        }
+      else
+        {
+          put_char(f, ',');
+        }
+      put_char(f, '"');
+      if (f->by_name)
+        put_tid(f, tid);
+      else
+        put_name(f, name, suffix);
+      put_mem(f, "\":", 2);
+      put_long(f, value);
+      break;
+
+    case FORMAT_COLUMNAR:
+      if (group)
+        {
+          end_row(f);
+          if (! f->header_done)
+            {
+              put_str(f, (f->group ? "group" : "tid"));
+              f->row_len = 0;
+            }
+        }
+      if (f->header_done)
+        {
+          if (group)
+            put_tid(f, tid);
+          put_char(f, '\t');
+          if (present)
+            put_long(f, value);
+        }
+      else
+        {
+          put_char(f, '\t');
+          put_name(f, name, suffix);
+
+          struct formatter side;
+          side_begin(f, &side);
+          if (group)
+            put_tid(&side, tid);
+          put_char(&side, '\t');
+          if (present)
+            put_long(&side, value);
+          side_end(f, &side);
+        }
+      break;
+    }
+
+  f->in_group = 1;
+}
+
+
+void
+format_end(struct formatter *f)
+{
+  switch (f->type)
+    {
+    case FORMAT_JSON:
+      if (f->in_group)
+        put_char(f, '}');
+      put_mem(f, "}\n", 2);
+      break;
+
+    case FORMAT_COLUMNAR:
+      end_row(f);
+      break;
+
+    default:
+      break;
+    }
+
+  if (f->separate && f->type != FORMAT_JSON)
+    put_char(f, '\n');
+
+  f->in_group = 0;
+}
+
+
+void
+format_reset_header(struct formatter *f)
+{
+  f->header_done = 0;
+}
@@ -0,0 +1,149 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FORMAT_H
+#define FORMAT_H 1
+
+#include <stddef.h>
+
+
+enum format_type
+{
+  FORMAT_TEXT,
+  FORMAT_JSON,
+  FORMAT_PROMETHEUS,
+  FORMAT_TSV,
+  FORMAT_COLUMNAR,
+};
+
+
+enum value_type
+{
+  VALUE_COUNTER,
+  VALUE_GAUGE,
+};
+
+
+/*
+  Formatter writes values into a large buffer without any stdio
+  calls.  When the buffer fills up it is written to 'fd', or, when
+  'fd' is -1, the buffer grows and it is up to the caller to send its
+  contents and call format_clear().
+
+  Values are passed to format_value() as records: thread ID (zero for
+  totals across threads), name, optional name suffix, type and value.
+  Records should be grouped either by thread or by name, as told to
+  format_init().  For FORMAT_COLUMNAR every row (thread) should have
+  the same sequence of names, with absent values passed as
+  'present' = 0 (other formats simply skip them), and the names of the
+  first row are output once as a header.
+
+  When 'separate' is set every sample (from format_begin() to
+  format_end()) is followed by an empty line (JSON sample is always a
+  single line).
+
+  'labels', when set, are added to every Prometheus value as is (for
+  instance 'file="/tmp/app.stats"'), and may be changed between
+  values.
+
+  'element', when not -1, is the index of the value in an array of
+  values with the same name, output as 'name[element]' (or as an
+  'index' label for Prometheus).  It may be changed between values
+  too.
+
+  'group', when set, is output in place of a nonzero thread ID (as a
+  'group' label for Prometheus), for the values of a group of
+  threads, and may be changed between values as well.
+*/
+struct formatter
+{
+  int fd;
+  enum format_type type;
+  int by_name;
+  int separate;
+  const char *labels;
+  long element;
+  const char *group;
+
+  char *buf;
+  size_t len;
+  size_t size;
+
+  // Grouping state.
+  int in_group;
+  long group_tid;
+  const char *group_name;
+  const char *group_suffix;
+  long group_element;
+
+  // Metric of the last Prometheus TYPE line.
+  const char *type_name;
+  const char *type_suffix;
+
+  // Columnar header state.
+  int header_done;
+  char *row;
+  size_t row_len;
+  size_t row_size;
+};
+
+
+int
+format_parse(const char *name, enum format_type *type);
+
+
+void
+format_init(struct formatter *f, int fd, enum format_type type, int by_name);
+
+
+void
+format_destroy(struct formatter *f);
+
+
+void
+format_begin(struct formatter *f);
+
+
+void
+format_value(struct formatter *f, long tid,
+             const char *name, const char *suffix,
+             enum value_type type, int present, long value);
+
+
+void
+format_end(struct formatter *f);
+
+
+/*
+  Make columnar format output the header again (for instance when
+  the set of names changes).
+*/
+void
+format_reset_header(struct formatter *f);
+
+
+int
+format_flush(struct formatter *f);
+
+
+void
+format_clear(struct formatter *f);
+
+
+#endif  /* ! FORMAT_H */
@@ -0,0 +1,600 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "stats_reader.h"
+#include "format.h"
+#include <kroki/error.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+
+#define DEFAULT_LISTEN  "127.0.0.1:9271"
+
+// Clients that don't send a request in time are dropped.
+#define CLIENT_TIMEOUT_SEC  5
+
+
+static struct option options[] = {
+  { .name = "listen", .has_arg = required_argument, .val = 'l' },
+  { .name = "version", .val = 'v' },
+  { .name = "help", .val = 'h' },
+  { .name = NULL },
+};
+
+
+static
+void
+usage(FILE *out)
+{
+  fprintf(out,
+          "Usage: %s [OPTIONS] STATSFILE...\n"
+          "\n"
+          "Serve totals of stats files at http://ADDR/metrics in\n"
+          "Prometheus format.\n"
+          "\n"
+          "Options are:\n"
+          "  --listen=ADDR, -l ADDR  Listen on [HOST:]PORT or unix:PATH\n"
+          "                          (default " DEFAULT_LISTEN ")\n"
+          "  --version, -v           Print package version and copyright\n"
+          "  --help, -h              Print this message\n",
+          program_invocation_short_name);
+}
+
+
+static
+void
+version(FILE *out)
+{
+  fprintf(out,
+          "%s\n"
+          "%s\n"
+          "Report bugs to <%s> or file an issue at\n"
+          "<%s>.\n",
+          PACKAGE_STRING,
+          PACKAGE_COPYRIGHT,
+          PACKAGE_BUGREPORT,
+          PACKAGE_URL);
+}
+
+
+static const char *listen_addr = DEFAULT_LISTEN;
+
+
+/*
+  Every stats file stays mapped between scrapes, and its name table
+  is indexed only when the file is (re)created.
+*/
+struct source
+{
+  struct stats_reader reader;
+  int ready;
+  unsigned int generation;
+  intptr_t *total;
+  intptr_t *next;
+  char *labels;
+};
+
+static struct source *sources;
+static size_t source_count;
+
+
+static
+void
+process_args(int argc, char *argv[])
+{
+  int opt;
+  while ((opt = getopt_long(argc, argv, "l:vh", options, NULL)) != -1)
+    {
+      switch (opt)
+        {
+        case 'l':
+          listen_addr = optarg;
+          break;
+
+        case 'v':
+          version(stdout);
+          exit(EXIT_SUCCESS);
+
+        case 'h':
+          usage(stdout);
+          exit(EXIT_SUCCESS);
+
+        default:
+          usage(stderr);
+          exit(EXIT_FAILURE);
+        }
+    }
+  if (optind == argc)
+    {
+      usage(stderr);
+      exit(EXIT_FAILURE);
+    }
+
+  source_count = argc - optind;
+  sources = MEM(calloc(source_count, sizeof(*sources)));
+  for (size_t s = 0; s < source_count; ++s)
+    {
+      const char *filename = argv[optind + s];
+      stats_reader_init(&sources[s].reader, filename, 1, 1);
+
+      // Values of several files are told apart by 'file' label.
+      if (source_count > 1)
+        {
+          char *p = sources[s].labels =
+            MEM(malloc(sizeof("file=\"\"") + strlen(filename) * 2));
+          p = stpcpy(p, "file=\"");
+          for (const char *c = filename; *c; ++c)
+            {
+              if (*c == '"' || *c == '\\')
+                *p++ = '\\';
+              *p++ = *c;
+            }
+          strcpy(p, "\"");
+        }
+    }
+}
+
+
+/*
+  Output order of values of all files: Prometheus wants all values of
+  a metric together, so values are sorted by name across files.  The
+  index is rebuilt only when some file is (re)indexed or goes away.
+*/
+struct metric
+{
+  uint32_t source;
+  uint32_t index;
+};
+
+static struct metric *metrics;
+static size_t metric_count;
+
+
+static
+int
+same_metric_compare(const struct metric *m1, const struct metric *m2)
+{
+  const struct stats_reader *r1 = &sources[m1->source].reader;
+  const struct stats_reader *r2 = &sources[m2->source].reader;
+
+  int res = strcmp(stats_reader_name(r1, m1->index),
+                   stats_reader_name(r2, m2->index));
+  if (res == 0)
+    res = (int) r1->kinds[m1->index] - (int) r2->kinds[m2->index];
+
+  return res;
+}
+
+
+static
+int
+metric_compare(const void *a, const void *b)
+{
+  const struct metric *m1 = a;
+  const struct metric *m2 = b;
+
+  int res = same_metric_compare(m1, m2);
+  if (res == 0)
+    res = (m1->source > m2->source) - (m1->source < m2->source);
+
+  return res;
+}
+
+
+static
+void
+index_metrics(void)
+{
+  metric_count = 0;
+  for (size_t s = 0; s < source_count; ++s)
+    {
+      if (sources[s].ready)
+        metric_count += sources[s].reader.entry_count;
+    }
+
+  metrics = MEM(realloc(metrics, sizeof(*metrics) * (metric_count + 1)));
+  metric_count = 0;
+  for (size_t s = 0; s < source_count; ++s)
+    {
+      const struct stats_reader *r = &sources[s].reader;
+      if (! sources[s].ready)
+        continue;
+
+      for (uint32_t e = 0; e < r->entry_count; ++e)
+        {
+          uint32_t i = r->entries[e];
+          if (r->column[i] == i)
+            metrics[metric_count++] = (struct metric) { s, i };
+        }
+    }
+
+  qsort(metrics, metric_count, sizeof(*metrics), metric_compare);
+}
+
+
+static struct formatter out;
+
+
+/*
+  Histogram is output as several metrics (count, sum, percentiles),
+  timer as two (count, nsec), and array as several elements, 'part'
+  selects one of them.
+*/
+static
+void
+output_total(struct source *source, uint32_t i, size_t part)
+{
+  const char *name = stats_reader_name(&source->reader, i);
+  uint8_t kind = source->reader.kinds[i];
+  const intptr_t *total = source->total;
+
+  out.labels = source->labels;
+  switch (kind)
+    {
+    case _KROKI_STATS_KIND_SUM:
+      format_value(&out, 0, name, NULL, VALUE_COUNTER, 1, total[i]);
+      break;
+
+    case _KROKI_STATS_KIND_HIST:
+      if (part < 2)
+        {
+          format_value(&out, 0, name, (part == 0 ? "count" : "sum"),
+                       VALUE_COUNTER, 1, total[i + part]);
+        }
+      else
+        {
+          const struct stats_percentile *p = &stats_percentiles[part - 2];
+          format_value(&out, 0, name, p->suffix, VALUE_GAUGE, 1,
+                       stats_hist_percentile(&total[i], p->fraction));
+        }
+      break;
+
+    case _KROKI_STATS_KIND_TIMER:
+      format_value(&out, 0, name, (part == 0 ? "count" : "nsec"),
+                   VALUE_COUNTER, 1,
+                   (part == 0 ? total[i]
+                    : stats_reader_nsec(&source->reader, total[i + 1])));
+      break;
+
+    case _KROKI_STATS_KIND_ARRAY:
+      // Zero elements are skipped.
+      if (part < stats_reader_width(&source->reader, i) && total[i + part])
+        {
+          out.element = part;
+          format_value(&out, 0, name, NULL, VALUE_COUNTER, 1,
+                       total[i + part]);
+          out.element = -1;
+        }
+      break;
+
+    default:
+      format_value(&out, 0, name, NULL, VALUE_GAUGE,
+                   stats_value_is_set(kind, total[i]), total[i]);
+      break;
+    }
+}
+
+
+static
+void
+scrape(void)
+{
+  int reindex = 0;
+  for (size_t s = 0; s < source_count; ++s)
+    {
+      struct source *source = &sources[s];
+      struct stats_reader *r = &source->reader;
+
+      /*
+        Files that are missing or broken are skipped (and reported as
+        not up), the application may be restarted meanwhile.
+      */
+      int ready = (stats_reader_update(r) == 1);
+      if (ready != source->ready
+          || (ready && r->generation != source->generation))
+        reindex = 1;
+      source->ready = ready;
+      if (! ready)
+        continue;
+
+      if (r->generation != source->generation)
+        {
+          source->total = MEM(realloc(source->total,
+                                      sizeof(*source->total) * r->count));
+          source->next = MEM(realloc(source->next,
+                                     sizeof(*source->next) * r->count));
+          source->generation = r->generation;
+        }
+
+      stats_reader_sum(r, &source->total, &source->next);
+      stats_reader_merge(r, source->total);
+    }
+
+  if (reindex)
+    index_metrics();
+
+  format_begin(&out);
+  size_t end;
+  for (size_t m = 0; m < metric_count; m = end)
+    {
+      // Same metric of all files.
+      end = m + 1;
+      while (end < metric_count
+             && same_metric_compare(&metrics[m], &metrics[end]) == 0)
+        ++end;
+
+      const struct source *source = &sources[metrics[m].source];
+      size_t parts = 1;
+      if (source->reader.kinds[metrics[m].index] == _KROKI_STATS_KIND_HIST)
+        parts = 2 + stats_percentile_count;
+      if (source->reader.kinds[metrics[m].index] == _KROKI_STATS_KIND_TIMER)
+        parts = 2;
+      if (source->reader.kinds[metrics[m].index] == _KROKI_STATS_KIND_ARRAY)
+        {
+          // Arrays of different files may differ in size.
+          for (size_t k = m; k < end; ++k)
+            {
+              uint32_t width = stats_reader_width(&sources[metrics[k].source]
+                                                  .reader, metrics[k].index);
+              if (parts < width)
+                parts = width;
+            }
+        }
+
+      for (size_t part = 0; part < parts; ++part)
+        {
+          for (size_t k = m; k < end; ++k)
+            output_total(&sources[metrics[k].source], metrics[k].index,
+                         part);
+        }
+    }
+  for (size_t s = 0; s < source_count; ++s)
+    {
+      out.labels = sources[s].labels;
+      format_value(&out, 0, "kroki_stats_exporter_file_up", NULL,
+                   VALUE_GAUGE, 1, sources[s].ready);
+    }
+  format_end(&out);
+}
+
+
+static
+int
+send_all(int sock, const char *buf, size_t len, int flags)
+{
+  while (len > 0)
+    {
+      ssize_t res = send(sock, buf, len, flags | MSG_NOSIGNAL);
+      if (res == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      buf += res;
+      len -= res;
+    }
+
+  return 0;
+}
+
+
+static
+void
+respond(int sock, const char *status, const char *content_type,
+        const char *body, size_t body_len)
+{
+  char header[256];
+  int len = snprintf(header, sizeof(header),
+                     "HTTP/1.0 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     status, content_type, body_len);
+
+  if (send_all(sock, header, len, MSG_MORE) == 0)
+    send_all(sock, body, body_len, 0);
+}
+
+
+static
+void
+serve(int sock)
+{
+  char request[4096];
+  size_t len = 0;
+
+  // Only the request line matters, but the whole header is consumed.
+  while (1)
+    {
+      if (len == sizeof(request) - 1)
+        break;
+
+      ssize_t res = recv(sock, request + len, sizeof(request) - 1 - len, 0);
+      if (res == -1 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        return;
+
+      len += res;
+      request[len] = '\0';
+      if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+        break;
+    }
+
+  static const char not_found[] = "Not found, try /metrics\n";
+  static const char not_allowed[] = "Method not allowed\n";
+  static const char text_plain[] = "text/plain; charset=utf-8";
+
+  if (strncmp(request, "GET ", 4) != 0)
+    {
+      respond(sock, "405 Method Not Allowed", text_plain,
+              not_allowed, sizeof(not_allowed) - 1);
+      return;
+    }
+
+  const char *path = request + 4;
+  size_t path_len = strcspn(path, " ?\r\n");
+  if (path_len != sizeof("/metrics") - 1
+      || strncmp(path, "/metrics", path_len) != 0)
+    {
+      respond(sock, "404 Not Found", text_plain,
+              not_found, sizeof(not_found) - 1);
+      return;
+    }
+
+  scrape();
+  respond(sock, "200 OK", "text/plain; version=0.0.4; charset=utf-8",
+          out.buf, out.len);
+  format_clear(&out);
+}
+
+
+static
+int
+listen_unix(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("%s: path is too long", path);
+  strcpy(addr.sun_path, path);
+
+  int sock = SYS(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+
+  // Socket left by the previous run.
+  if (unlink(path) == -1 && errno != ENOENT)
+    error("%s: %m", path);
+
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    error("%s: %m", path);
+
+  return sock;
+}
+
+
+static
+int
+listen_inet(const char *spec)
+{
+  char host[256];
+  const char *port = strrchr(spec, ':');
+  if (port)
+    {
+      size_t len = port - spec;
+      ++port;
+      // [::1]:PORT
+      if (len >= 2 && spec[0] == '[' && spec[len - 1] == ']')
+        {
+          ++spec;
+          len -= 2;
+        }
+      if (len >= sizeof(host))
+        error("%s: invalid address", listen_addr);
+      memcpy(host, spec, len);
+      host[len] = '\0';
+    }
+  else
+    {
+      // The exporter is local unless told otherwise.
+      strcpy(host, "localhost");
+      port = spec;
+    }
+
+  struct addrinfo hints = {
+    .ai_flags = AI_PASSIVE | AI_NUMERICSERV,
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *addrs;
+  int res = getaddrinfo((host[0] ? host : NULL), port, &hints, &addrs);
+  if (res != 0)
+    error("%s: %s", listen_addr, gai_strerror(res));
+
+  int sock = -1;
+  for (struct addrinfo *ai = addrs; ai; ai = ai->ai_next)
+    {
+      sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+      if (sock == -1)
+        continue;
+
+      int on = 1;
+      SYS(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)));
+      if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+
+      SYS(close(sock));
+      sock = -1;
+    }
+  freeaddrinfo(addrs);
+
+  if (sock == -1)
+    error("%s: %m", listen_addr);
+
+  return sock;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  process_args(argc, argv);
+
+  int sock;
+  if (strncmp(listen_addr, "unix:", 5) == 0)
+    sock = listen_unix(listen_addr + 5);
+  else
+    sock = listen_inet(listen_addr);
+  SYS(listen(sock, SOMAXCONN));
+
+  format_init(&out, -1, FORMAT_PROMETHEUS, 1);
+
+  while (1)
+    {
+      int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+      if (client == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          error("accept: %m");
+        }
+
+      struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_SEC };
+      SYS(setsockopt(client, SOL_SOCKET, SO_RCVTIMEO,
+                     &timeout, sizeof(timeout)));
+      SYS(setsockopt(client, SOL_SOCKET, SO_SNDTIMEO,
+                     &timeout, sizeof(timeout)));
+
+      serve(client);
+      SYS(close(client));
+    }
+}
@@ -20,20 +20,37 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
-#include "stats_file.h"
+#include "stats_reader.h"
+#include "format.h"
+#include "record.h"
+#include "merge.h"
 #include <kroki/error.h>
-#include <sys/mman.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
+#include <errno.h>
 
 
 static struct option options[] = {
+  { .name = "by-thread", .val = 't' },
+  { .name = "by-name", .val = 'n' },
+  { .name = "by-group", .val = 'g' },
+  { .name = "sum", .val = 's' },
+  { .name = "merge", .val = 'm' },
+  { .name = "interval", .has_arg = required_argument, .val = 'i' },
+  { .name = "rate", .val = 'r' },
+  { .name = "format", .has_arg = required_argument, .val = 'f' },
+  { .name = "layout", .val = 'l' },
+  { .name = "jobs", .has_arg = required_argument, .val = 'j' },
+  { .name = "aggregated", .val = 'a' },
+  { .name = "record", .has_arg = required_argument, .val = 'o' },
+  { .name = "replay", .val = 'p' },
+  { .name = "diff", .has_arg = required_argument, .val = 'd' },
   { .name = "version", .val = 'v' },
   { .name = "help", .val = 'h' },
   { .name = NULL },
@@ -45,11 +62,31 @@ void
 usage(FILE *out)
 {
   fprintf(out,
-          "Usage: %s [OPTIONS] STATSFILE\n"
+          "Usage: %s [OPTIONS] STATSFILE...\n"
           "\n"
           "Options are:\n"
+          "  --by-thread, -t             Group values by thread (default)\n"
+          "  --by-name, -n               Group values by name\n"
+          "  --by-group, -g              Sum up values by thread group\n"
+          "  --sum, -s                   Print totals across threads only\n"
+          "  --merge, -m                 Merge same names of all modules\n"
+          "  --interval=MS, -i MS        Print changes every MS milliseconds\n"
+          "  --rate, -r                  Print changes as per second rates\n"
+          "  --format=FORMAT, -f FORMAT  Output format: text (default),\n"
+          "                              json, prometheus, tsv or columnar\n"
+          "  --layout, -l                Print offsets of values in the\n"
+          "                              block of a thread\n"
+          "  --jobs=N, -j N              Sum up threads with N threads\n"
+          "  --aggregated, -a            Take totals the application\n"
+          "                              publishes when it does\n"
+          "  --record=FILE, -o FILE      Record samples of --interval to FILE\n"
+          "  --replay, -p                Print samples recorded in STATSFILE\n"
+          "  --diff=FROM,TO, -d FROM,TO  Print changes between FROM and TO\n"
+          "                              seconds of the recording in STATSFILE\n"
           "  --version, -v               Print package version and copyright\n"
-          "  --help, -h                  Print this message\n",
+          "  --help, -h                  Print this message\n"
+          "\n"
+          "Several STATSFILEs, or quoted glob patterns, are merged into one.\n",
           program_invocation_short_name);
 }
 
@@ -70,7 +107,30 @@ version(FILE *out)
 }
 
 
+enum output_mode
+{
+  BY_THREAD,
+  BY_NAME,
+  BY_GROUP,
+  SUM,
+};
+
+
 static const char *stats_filename;
+static char *const *merged_files;
+static int merged_count = 0;
+static enum output_mode output_mode = BY_THREAD;
+static int merge = 0;
+static long interval = 0;
+static int rate = 0;
+static enum format_type format = FORMAT_TEXT;
+static int layout = 0;
+static int jobs = 1;
+static int aggregated = 0;
+static const char *record_filename;
+static int replay = 0;
+static double diff_from, diff_to;
+static int diff = 0;
 
 
 static
@@ -78,10 +138,87 @@ void
 process_args(int argc, char *argv[])
 {
   int opt;
-  while ((opt = getopt_long(argc, argv, "vh", options, NULL)) != -1)
+  while ((opt = getopt_long(argc, argv, "tngsmi:rf:lj:ao:pd:vh", options, NULL)) != -1)
     {
       switch (opt)
         {
+        case 't':
+          output_mode = BY_THREAD;
+          break;
+
+        case 'n':
+          output_mode = BY_NAME;
+          break;
+
+        case 'g':
+          output_mode = BY_GROUP;
+          break;
+
+        case 's':
+          output_mode = SUM;
+          break;
+
+        case 'm':
+          merge = 1;
+          break;
+
+        case 'i':
+          {
+            char *end;
+            interval = strtol(optarg, &end, 10);
+            if (*end != '\0' || interval <= 0)
+              error("invalid interval: %s", optarg);
+          }
+          break;
+
+        case 'r':
+          rate = 1;
+          break;
+
+        case 'f':
+          if (format_parse(optarg, &format) == -1)
+            error("invalid format: %s", optarg);
+          break;
+
+        case 'l':
+          layout = 1;
+          break;
+
+        case 'j':
+          {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (*end != '\0' || n <= 0 || n > 1024)
+              error("invalid number of jobs: %s", optarg);
+            jobs = n;
+          }
+          break;
+
+        case 'a':
+          aggregated = 1;
+          break;
+
+        case 'o':
+          record_filename = optarg;
+          break;
+
+        case 'p':
+          replay = 1;
+          break;
+
+        case 'd':
+          {
+            char *end;
+            diff_from = strtod(optarg, &end);
+            if (*end == ',')
+              diff_to = strtod(end + 1, &end);
+            if (*end != '\0' || diff_from < 0 || diff_to < diff_from)
+              error("invalid time range: %s", optarg);
+            replay = 1;
+            diff = 1;
+          }
+          break;
+
         case 'v':
           version(stdout);
           exit(EXIT_SUCCESS);
@@ -95,94 +232,741 @@ process_args(int argc, char *argv[])
           exit(EXIT_FAILURE);
         }
     }
-  if (optind != argc - 1)
+  if (optind >= argc || (rate && ! interval && ! replay)
+      || (record_filename && (! interval || replay))
+      || (optind != argc - 1 && (replay || layout)))
     {
       usage(stderr);
       exit(EXIT_FAILURE);
     }
 
-  stats_filename = argv[optind++];
+  stats_filename = argv[optind];
+  // Several files, or a pattern for the files of several processes.
+  if (optind != argc - 1 || (! replay && strpbrk(stats_filename, "*?[")))
+    {
+      merged_files = argv + optind;
+      merged_count = argc - optind;
+    }
+
+  /*
+    Prometheus wants all values of a metric together and no duplicate
+    metrics, and columnar format has a row per thread.
+  */
+  if (format == FORMAT_PROMETHEUS)
+    {
+      merge = 1;
+      if (output_mode == BY_THREAD)
+        output_mode = BY_NAME;
+    }
+  if (format == FORMAT_COLUMNAR && output_mode == BY_NAME)
+    output_mode = BY_THREAD;
+}
+
+
+static struct stats_reader reader;
+static struct merge merged;
+
+
+/*
+  In --interval mode counters, histograms and timers are output as
+  changes since the previous sample, and with --rate these are
+  divided by the time elapsed.  Gauges are always output as is.
+*/
+static double elapsed;
+
+
+static
+long
+counter_value(intptr_t value)
+{
+  if (! rate)
+    return value;
+
+  double per_second = value / elapsed;
+  return (long) (per_second + (per_second < 0 ? -0.5 : 0.5));
+}
+
+
+static struct formatter out;
+
+
+static
+enum value_type
+counter_type(void)
+{
+  // Changes of a counter are not a counter in Prometheus sense.
+  return (interval ? VALUE_GAUGE : VALUE_COUNTER);
 }
 
 
 static
 void
-output_stats(void)
+output_hist(long tid, const char *name, const intptr_t *hist, int present)
 {
-  int fd = open(stats_filename, O_RDONLY);
-  if (fd == -1)
-    error("%s: %m", stats_filename);
+  format_value(&out, tid, name, "count", counter_type(), present,
+               (present ? counter_value(hist[0]) : 0));
+  format_value(&out, tid, name, "sum", counter_type(), present,
+               (present ? counter_value(hist[1]) : 0));
+  for (size_t i = 0; i < stats_percentile_count; ++i)
+    {
+      const struct stats_percentile *p = &stats_percentiles[i];
+      format_value(&out, tid, name, p->suffix, VALUE_GAUGE, present,
+                   (present ? stats_hist_percentile(hist, p->fraction) : 0));
+    }
+}
 
-  struct stat fstats;
-  SYS(fstat(fd, &fstats));
 
-  if (! S_ISREG(fstats.st_mode))
-    error("%s: not a regular file", stats_filename);
+static
+void
+output_timer(long tid, const char *name, const intptr_t *timer, int present)
+{
+  format_value(&out, tid, name, "count", counter_type(), present,
+               counter_value(timer[0]));
+  format_value(&out, tid, name, "nsec", counter_type(), present,
+               counter_value(stats_reader_nsec(&reader, timer[1])));
+}
+
 
-  if (fstats.st_size == 0)
+/*
+  Zero elements of an array are skipped.
+*/
+static
+void
+output_element(long tid, const intptr_t *values, uint32_t i, uint32_t j,
+               int present)
+{
+  out.element = j;
+  format_value(&out, tid, stats_reader_name(&reader, i), NULL,
+               counter_type(), present && values[i + j] != 0,
+               counter_value(values[i + j]));
+  out.element = -1;
+}
+
+
+static
+void
+output_value(long tid, const intptr_t *values, uint32_t i)
+{
+  const char *name = stats_reader_name(&reader, i);
+  uint8_t kind = reader.kinds[i];
+  switch (kind)
     {
-      SYS(close(fd));
-      return;
+    case _KROKI_STATS_KIND_SUM:
+      format_value(&out, tid, name, NULL, counter_type(), 1,
+                   counter_value(values[i]));
+      break;
+
+    case _KROKI_STATS_KIND_HIST:
+      // Histograms are output only as totals, of all or of a group.
+      output_hist(tid, name, &values[i], output_mode == BY_GROUP);
+      break;
+
+    case _KROKI_STATS_KIND_TIMER:
+      output_timer(tid, name, &values[i], 1);
+      break;
+
+    case _KROKI_STATS_KIND_ARRAY:
+      for (uint32_t j = 0; j < stats_reader_width(&reader, i); ++j)
+        output_element(tid, values, i, j, 1);
+      break;
+
+    default:
+      format_value(&out, tid, name, NULL, VALUE_GAUGE,
+                   stats_value_is_set(kind, values[i]), values[i]);
+      break;
     }
+}
 
-  if ((size_t) fstats.st_size < sizeof(struct stats_file))
-    error("%s: invalid file format", stats_filename);
 
-  struct stats_file *file =
-    CHECK(mmap(NULL, fstats.st_size, PROT_READ, MAP_SHARED, fd, 0),
-          == MAP_FAILED, die, "%m");
+static
+void
+output_total(const intptr_t *total, uint32_t i)
+{
+  const char *name = stats_reader_name(&reader, i);
+  uint8_t kind = reader.kinds[i];
+  switch (kind)
+    {
+    case _KROKI_STATS_KIND_SUM:
+      // Counters are summed up only in --sum mode.
+      format_value(&out, 0, name, NULL, counter_type(),
+                   output_mode == SUM, counter_value(total[i]));
+      break;
 
-  uint32_t count = __atomic_load_n(&file->value_count, __ATOMIC_ACQUIRE);
-  if (count)
+    case _KROKI_STATS_KIND_HIST:
+      output_hist(0, name, &total[i], 1);
+      break;
+
+    case _KROKI_STATS_KIND_TIMER:
+      output_timer(0, name, &total[i], output_mode == SUM);
+      break;
+
+    case _KROKI_STATS_KIND_ARRAY:
+      for (uint32_t j = 0; j < stats_reader_width(&reader, i); ++j)
+        output_element(0, total, i, j, output_mode == SUM);
+      break;
+
+    default:
+      format_value(&out, 0, name, NULL, VALUE_GAUGE,
+                   stats_value_is_set(kind, total[i]), total[i]);
+      break;
+    }
+}
+
+
+// Generation of the reader the buffers below are for.
+static unsigned int generation;
+
+static intptr_t *total;
+static intptr_t *values;
+
+// --by-name needs values of all threads before any output.
+static size_t row_count;
+static size_t row_capacity;
+static long *tids;
+static intptr_t *rows;
+
+/*
+  --by-group reduces the values of the threads of a group (the tag
+  given with stats_set_thread_group(), or else the thread name) into
+  a row, 'groups' are the names of the rows.
+*/
+static char (*groups)[STATS_THREAD_NAME_SIZE];
+
+/*
+  In --interval mode values of every slot from the previous sample
+  are kept.  Slots are matched by TID, so that a slot reused by a new
+  thread is not seen as a counter reset.
+*/
+static size_t prev_slot_count;
+static long *prev_tids;
+static intptr_t *prev_values;
+
+/*
+  Changes of totals are computed from totals rather than summed up
+  from the changes of threads, as values of a thread that exited
+  move to the retired slot.
+*/
+static intptr_t *prev_total;
+
+
+static
+void
+free_buffers(void)
+{
+  free(prev_total);
+  free(values);
+  free(total);
+  prev_total = NULL;
+  values = NULL;
+  total = NULL;
+
+  free(groups);
+  free(rows);
+  free(tids);
+  groups = NULL;
+  rows = NULL;
+  tids = NULL;
+  row_capacity = 0;
+
+  free(prev_values);
+  free(prev_tids);
+  prev_values = NULL;
+  prev_tids = NULL;
+  prev_slot_count = 0;
+}
+
+
+/*
+  Update the mapping of the stats file.  Returns zero if there are no
+  values yet.
+*/
+static
+int
+open_stats(void)
+{
+  if (merged_count)
+    merge_update(&merged);
+
+  int res = stats_reader_update(&reader);
+  if (res == -1)
+    {
+      // Stats file may appear later in --interval mode.
+      if (interval && errno == ENOENT)
+        res = 0;
+      else
+        error("%s: %s", stats_filename, reader.error);
+    }
+  if (res == 0)
+    return 0;
+
+  if (reader.generation != generation)
+    {
+      free_buffers();
+      total = MEM(malloc(sizeof(*total) * reader.count));
+      values = MEM(malloc(sizeof(*values) * reader.count));
+      prev_total = MEM(malloc(sizeof(*prev_total) * reader.count));
+      generation = reader.generation;
+    }
+
+  return 1;
+}
+
+
+/*
+  Replace thread values with their change since the previous sample,
+  and remember them for the next one.
+*/
+static
+void
+diff_slot(size_t index, long tid, intptr_t *values)
+{
+  uint32_t count = reader.count;
+
+  if (index >= prev_slot_count)
     {
-      char *file_end = (char *) file + fstats.st_size;
-      struct thread_slot *slot = (struct thread_slot *)
-        ((char *) file->data + file->slot_offset);
+      size_t new_count = index + 1 + prev_slot_count;
+      prev_tids = MEM(realloc(prev_tids, sizeof(*prev_tids) * new_count));
+      prev_values = MEM(realloc(prev_values,
+                                sizeof(*prev_values) * count * new_count));
+      memset(prev_tids + prev_slot_count, 0,
+             sizeof(*prev_tids) * (new_count - prev_slot_count));
+      prev_slot_count = new_count;
+    }
 
-      if ((file_end - (char *) slot) % file->slot_size != 0)
-        error("%s: invalid file format", stats_filename);
+  intptr_t *prev = prev_values + count * index;
+  int same_thread = (prev_tids[index] == tid);
+  prev_tids[index] = tid;
 
-      intptr_t *values = MEM(malloc(sizeof(*values) * count));
+  if (tid <= 0)
+    return;
 
-      while ((char *) slot < file_end)
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      intptr_t value = values[i];
+      if (reader.kinds[i] == _KROKI_STATS_KIND_SUM
+          || reader.kinds[i] == _KROKI_STATS_KIND_HIST
+          || reader.kinds[i] == _KROKI_STATS_KIND_TIMER
+          || reader.kinds[i] == _KROKI_STATS_KIND_ARRAY)
+        values[i] -= (same_thread ? prev[i] : 0);
+      prev[i] = value;
+    }
+}
+
+
+static
+void
+diff_total(void)
+{
+  for (uint32_t i = 0; i < reader.count; ++i)
+    {
+      intptr_t value = total[i];
+      if (reader.kinds[i] == _KROKI_STATS_KIND_SUM
+          || reader.kinds[i] == _KROKI_STATS_KIND_HIST
+          || reader.kinds[i] == _KROKI_STATS_KIND_TIMER
+          || reader.kinds[i] == _KROKI_STATS_KIND_ARRAY)
+        total[i] -= prev_total[i];
+      prev_total[i] = value;
+    }
+}
+
+
+static
+void
+reserve_row(void)
+{
+  if (row_count < row_capacity)
+    return;
+
+  uint32_t count = reader.count;
+  row_capacity = (row_capacity ? row_capacity * 2 : 64);
+  tids = MEM(realloc(tids, sizeof(*tids) * row_capacity));
+  rows = MEM(realloc(rows, sizeof(*rows) * count * row_capacity));
+  groups = MEM(realloc(groups, sizeof(*groups) * row_capacity));
+}
+
+
+static
+void
+process_slot(long tid)
+{
+  stats_reader_merge(&reader, values);
+
+  if (output_mode == BY_THREAD)
+    {
+      for (uint32_t e = 0; e < reader.entry_count; ++e)
         {
-          /*
-            We avoid processing values while they are being reset when
-            thread slot is about to be reused.  As TIDs aren't reused
-            right away this works very much like sequential lock.
-          */
-          long tid = -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
-          while (tid > 0)
+          uint32_t i = reader.entries[e];
+          if (reader.column[i] == i)
+            output_value(tid, values, i);
+        }
+    }
+  else
+    {
+      uint32_t count = reader.count;
+      reserve_row();
+      tids[row_count] = tid;
+      memcpy(rows + count * row_count, values, sizeof(*values) * count);
+      ++row_count;
+    }
+}
+
+
+/*
+  Group names are output as is, hence only letters, digits, '_', '-'
+  and '.' are kept.  Threads of files without identities are in
+  group '?'.
+*/
+static
+void
+group_name(long index, char *name)
+{
+  struct stats_thread_info info;
+  const char *src = "";
+  if (stats_reader_thread_info(&reader, index, &info) == 0)
+    src = (info.group[0] ? info.group : info.comm);
+
+  size_t len = 0;
+  for (; src[len]; ++len)
+    name[len] = ((isalnum((unsigned char) src[len])
+                  || strchr("_-.", src[len]))
+                 ? src[len] : '_');
+  if (len == 0)
+    name[len++] = '?';
+  name[len] = '\0';
+}
+
+
+static
+void
+group_slot(long index)
+{
+  char name[STATS_THREAD_NAME_SIZE];
+  group_name(index, name);
+
+  // There are few groups.
+  uint32_t count = reader.count;
+  size_t r = 0;
+  while (r < row_count && strcmp(groups[r], name) != 0)
+    ++r;
+  if (r == row_count)
+    {
+      reserve_row();
+      memcpy(groups[r], name, sizeof(name));
+      tids[r] = r + 1;
+      stats_reader_reset_total(&reader, rows + count * r);
+      ++row_count;
+    }
+
+  stats_reader_reduce(&reader, rows + count * r, rows + count * r, values);
+}
+
+
+static
+void
+output_groups(void)
+{
+  for (size_t r = 0; r < row_count; ++r)
+    {
+      out.group = groups[r];
+      for (uint32_t e = 0; e < reader.entry_count; ++e)
+        {
+          uint32_t i = reader.entries[e];
+          if (reader.column[i] == i)
+            output_value(tids[r], rows + reader.count * r, i);
+        }
+    }
+  out.group = NULL;
+}
+
+
+static
+void
+output_stats(int report)
+{
+  // 'values' is a scratch buffer here.
+  stats_reader_sum(&reader, &total, &values);
+  if (interval)
+    diff_total();
+
+  row_count = 0;
+  if (output_mode != SUM)
+    {
+      long index = -1;
+      while ((index = stats_reader_next_slot(&reader, index)) != -1)
+        {
+          long tid = stats_reader_read_slot(&reader, index, values);
+          if (interval)
+            diff_slot(index, tid, values);
+          if (tid > 0 && report)
             {
-              memcpy(values, slot->values, sizeof(intptr_t) * count);
+              if (output_mode == BY_GROUP)
+                group_slot(index);
+              else
+                process_slot(tid);
+            }
+        }
+    }
 
-              // Emit compiler barrier and load-load memory barrier.
-              __atomic_signal_fence(__ATOMIC_ACQ_REL);
-              __atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+  if (! report)
+    return;
 
-              long new_tid = -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
-              if (tid == new_tid)
+  if (output_mode == BY_GROUP)
+    {
+      for (size_t r = 0; r < row_count; ++r)
+        stats_reader_merge(&reader, rows + reader.count * r);
+      // Prometheus wants groups by name.
+      if (! out.by_name)
+        output_groups();
+    }
+
+  stats_reader_merge(&reader, total);
+  for (uint32_t e = 0; e < reader.entry_count; ++e)
+    {
+      uint32_t i = reader.entries[e];
+      if (reader.column[i] != i)
+        continue;
+
+      if (out.by_name
+          && reader.kinds[i] == _KROKI_STATS_KIND_ARRAY)
+        {
+          // Every element is a name of its own.
+          for (uint32_t j = 0; j < stats_reader_width(&reader, i); ++j)
+            {
+              for (size_t r = 0; r < row_count; ++r)
                 {
-                  for (uint32_t i = 0; i < count; ++i)
-                    {
-                      char *name = (char *) file->data + file->data[i];
-                      long value = values[i];
-                      printf("[%ld] %s: %ld\n", tid, name, value);
-                    }
-                  break;
+                  out.group = (output_mode == BY_GROUP ? groups[r] : NULL);
+                  output_element(tids[r], rows + reader.count * r, i, j, 1);
                 }
+              out.group = NULL;
+              output_element(0, total, i, j, 0);
+            }
+          continue;
+        }
 
-              tid = new_tid;
+      if (out.by_name)
+        {
+          for (size_t r = 0; r < row_count; ++r)
+            {
+              out.group = (output_mode == BY_GROUP ? groups[r] : NULL);
+              output_value(tids[r], rows + reader.count * r, i);
             }
+          out.group = NULL;
+        }
+      output_total(total, i);
+    }
+}
+
+
+/*
+  The first sample of a file only establishes the base for the
+  changes.
+*/
+static
+void
+output_sample(int report)
+{
+  if (report)
+    format_begin(&out);
+  output_stats(report);
+  if (report)
+    {
+      format_end(&out);
+      if (format_flush(&out) == -1)
+        error("write: %m");
+    }
+}
+
+
+static struct recorder recorder;
+
+
+static
+void
+watch_stats(void)
+{
+  struct timespec next;
+  SYS(clock_gettime(CLOCK_MONOTONIC, &next));
+  struct timespec prev = next;
+  unsigned int prev_generation = 0;
+  int have_prev = 0;
 
-          slot = (struct thread_slot *) ((char *) slot + file->slot_size);
+  while (1)
+    {
+      if (open_stats())
+        {
+          /*
+            Replaced file (or new values appended by a module loaded
+            with dlopen()) starts with a new base sample.
+          */
+          if (reader.generation != prev_generation)
+            {
+              have_prev = 0;
+              format_reset_header(&out);
+            }
+          prev_generation = reader.generation;
+
+          struct timespec now;
+          SYS(clock_gettime(CLOCK_MONOTONIC, &now));
+          elapsed = ((now.tv_sec - prev.tv_sec)
+                     + (now.tv_nsec - prev.tv_nsec) / 1e9);
+          prev = now;
+
+          if (record_filename)
+            record_sample(&recorder, &reader, &now);
+          else
+            output_sample(have_prev);
+          have_prev = 1;
+        }
+      else
+        {
+          have_prev = 0;
         }
 
-      free(values);
+      next.tv_sec += interval / 1000;
+      next.tv_nsec += interval % 1000 * 1000000;
+      if (next.tv_nsec >= 1000000000)
+        {
+          next.tv_nsec -= 1000000000;
+          ++next.tv_sec;
+        }
+      int res;
+      while ((res = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                    &next, NULL)) == EINTR)
+        ;
+      POSIX(res);
+    }
+}
+
+
+/*
+  Replay outputs every recorded sample as --interval would, or with
+  --diff the changes from the first sample at or after FROM to the
+  first one at or after TO (or the last one).  'reader' reads the
+  image of the recording, so all the output modes work as for a live
+  file.
+*/
+static
+void
+replay_stats(struct replay *p)
+{
+  int have_prev = 0;
+  uint64_t base_nsec = 0;
+  uint64_t from = diff_from * 1e9;
+  uint64_t to = diff_to * 1e9;
+  while (replay_next(p))
+    {
+      if (p->new_names)
+        {
+          if (diff && have_prev)
+            error("%s: names change between %g and %g seconds",
+                  p->source, diff_from, diff_to);
+          have_prev = 0;
+          format_reset_header(&out);
+        }
+      if (! open_stats())
+        continue;
+
+      if (! diff)
+        {
+          elapsed = p->elapsed / 1e9;
+          output_sample(have_prev);
+          have_prev = 1;
+          continue;
+        }
+
+      if (! have_prev)
+        {
+          if (p->nsec >= from)
+            {
+              output_stats(0);
+              base_nsec = p->nsec;
+              have_prev = 1;
+            }
+          continue;
+        }
+
+      if (p->nsec >= to)
+        break;
+    }
+
+  if (diff)
+    {
+      if (! have_prev)
+        error("%s: no samples after %g seconds", p->source, diff_from);
+
+      elapsed = (p->nsec - base_nsec) / 1e9;
+      output_sample(1);
     }
+}
+
+
+static const char *const kind_names[] = {
+  [_KROKI_STATS_KIND_SUM] = "value",
+  [_KROKI_STATS_KIND_HIST] = "hist",
+  [_KROKI_STATS_KIND_MAX] = "max",
+  [_KROKI_STATS_KIND_MIN] = "min",
+  [_KROKI_STATS_KIND_LAST] = "last",
+  [_KROKI_STATS_KIND_ARRAY] = "array",
+  [_KROKI_STATS_KIND_TIMER] = "timer",
+};
+
 
-  SYS(munmap(file, fstats.st_size));
-  SYS(close(fd));
+static
+const char *
+kind_name(uint8_t kind)
+{
+  if (kind < sizeof(kind_names) / sizeof(*kind_names) && kind_names[kind])
+    return kind_names[kind];
+  return "?";
+}
+
+
+/*
+  Offsets of values in the block of a thread (bytes from its start)
+  and the cache lines they are in, in block order, so that one can
+  check which lines a code path touches.
+*/
+static
+void
+output_layout(void)
+{
+  long line_size = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+  if (line_size <= 0)
+    line_size = 64;
+
+  for (uint32_t s = 0; s < reader.segment_count; ++s)
+    {
+      const struct stats_reader_segment *segment = &reader.segments[s];
+      printf("segment %u: %u values, %u bytes per thread\n",
+             s, segment->value_count, segment->block_size);
+
+      uint32_t end = segment->first_value + segment->value_count;
+      uint32_t width;
+      for (uint32_t i = segment->first_value; i < end; i += width)
+        {
+          width = stats_reader_width(&reader, i);
+          const char *name = stats_reader_name(&reader, i);
+          // Values registered at run time that have no name yet.
+          if (! *name)
+            continue;
+
+          size_t offset = (offsetof(struct thread_slot, values)
+                           + sizeof(intptr_t) * (i - segment->first_value));
+          size_t first_line = offset / line_size;
+          size_t last_line = ((offset + sizeof(intptr_t) * width - 1)
+                              / line_size);
+          const char *kind = kind_name(reader.kinds[i]);
+          if (first_line == last_line)
+            printf("  %6zu  line %zu  %s %s", offset, first_line,
+                   kind, name);
+          else
+            printf("  %6zu  lines %zu-%zu  %s %s", offset, first_line,
+                   last_line, kind, name);
+          if (reader.kinds[i] == _KROKI_STATS_KIND_ARRAY)
+            printf("[%u]", width);
+          putchar('\n');
+        }
+    }
 }
 
 
@@ -191,7 +975,62 @@ main(int argc, char *argv[])
 {
   process_args(argc, argv);
 
-  output_stats();
+  struct replay replayed;
+  if (replay)
+    {
+      replay_open(&replayed, stats_filename);
+      stats_filename = replayed.filename;
+      // Replayed samples are output as changes.
+      interval = 1;
+    }
+  else if (merged_count)
+    {
+      merge_open(&merged, merged_files, merged_count, output_mode != SUM);
+      merged.jobs = jobs;
+      merged.aggregated = aggregated;
+      stats_filename = merged.image.filename;
+    }
+
+  stats_reader_init(&reader, stats_filename, merge, output_mode == BY_NAME);
+  reader.jobs = jobs;
+  reader.aggregated = aggregated;
+  format_init(&out, STDOUT_FILENO, format,
+              (output_mode == BY_NAME
+               || (output_mode == BY_GROUP && format == FORMAT_PROMETHEUS)));
+
+  if (layout)
+    {
+      if (open_stats())
+        output_layout();
+    }
+  else if (replay)
+    {
+      out.separate = ! diff;
+      replay_stats(&replayed);
+      replay_close(&replayed);
+    }
+  else if (interval)
+    {
+      out.separate = 1;
+      if (record_filename)
+        record_open(&recorder, record_filename);
+      watch_stats();
+    }
+  else
+    {
+      format_begin(&out);
+      if (open_stats())
+        output_stats(1);
+      format_end(&out);
+      if (format_flush(&out) == -1)
+        error("write: %m");
+    }
+
+  free_buffers();
+  stats_reader_close(&reader);
+  if (merged_count)
+    merge_close(&merged);
+  format_destroy(&out);
 
   return EXIT_SUCCESS;
 }
@@ -23,17 +23,110 @@
 #include <stdint.h>
 
 
+/*
+  Value kinds recorded in _kroki_stats_kinds section, one byte per
+  value.  These are used in assembler strings and thus have to be
+  plain numbers.
+*/
+#define _KROKI_STATS_KIND_SUM  0
+#define _KROKI_STATS_KIND_HIST  1
+#define _KROKI_STATS_KIND_MAX  2
+#define _KROKI_STATS_KIND_MIN  3
+#define _KROKI_STATS_KIND_LAST  4
+#define _KROKI_STATS_KIND_ARRAY  5
+#define _KROKI_STATS_KIND_TIMER  6
+
+
+/*
+  Histogram occupies _KROKI_STATS_HIST_VALUES consecutive values:
+  sample count, sample sum, and then _KROKI_STATS_HIST_BUCKETS
+  buckets.  Values 0-3 have buckets of their own, and every following
+  power of two range is split into four equal sub-buckets (so the
+  relative error is below 25%).  Negative samples are counted in the
+  bucket zero.
+*/
+#define _KROKI_STATS_HIST_BUCKETS  ((__SIZEOF_POINTER__ * 8 - 2) * 4)
+#define _KROKI_STATS_HIST_VALUES  (2 + _KROKI_STATS_HIST_BUCKETS)
+
+
+/*
+  Timer occupies _KROKI_STATS_TIMER_VALUES consecutive values: number
+  of times the scope was run and the ticks spent in it.
+*/
+#define _KROKI_STATS_TIMER_VALUES  2
+
+
+/*
+  Flags of kroki_stats_open_flags().
+*/
+#define KROKI_STATS_PERCPU  0x1
+#define KROKI_STATS_HUGEPAGE  0x2
+
+
+/*
+  Per-CPU updates are done in restartable sequences, which need the
+  rseq area that Glibc 2.35+ registers for every thread.
+*/
+#if defined(__x86_64__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 35)
+#define _KROKI_STATS_RSEQ 1
+#endif
+#endif
+
+
 struct _kroki_stats_module
 {
   struct _kroki_stats_module *next;
   intptr_t *(*thread_offset)(void);
   const char *const *name_refs;
+  char *scratch;                /* Thread offsets are from here, a
+                                   thread without values (offset
+                                   zero) writes to the scratch words
+                                   of the module.  */
+  const uint8_t *kinds;
   uint32_t names_size;
   uint32_t value_count;
+  int32_t segment;              /* In the stats file, -1 if none yet.  */
+  uint32_t value_offset;        /* Of the first value in the segment.  */
+  const intptr_t *cpu_offsets;  /* Per-CPU offsets from name_refs,
+                                   NULL until the module is attached
+                                   to a per-CPU stats file.  */
+  int hot;                      /* Values of stats_hot(), which go
+                                   first in the segment.  */
 };
 
 
-extern struct _kroki_stats_module *_kroki_stats_module_head;
+/*
+  Sequence number in the values of the calling thread, valid while
+  the thread has them.
+*/
+extern __thread __attribute__((__tls_model__("initial-exec")))
+intptr_t *_kroki_stats_batch_seq;
+
+
+/*
+  Thread offset of the values of the names registered at run time,
+  zero while the thread doesn't have them.
+*/
+extern __thread __attribute__((__tls_model__("initial-exec")))
+intptr_t _kroki_stats_dynamic_thread_offset;
+
+
+typedef const struct _kroki_stats_handle *kroki_stats_handle_t;
+
+
+/*
+  Set while the stats file is per-CPU.
+*/
+extern int _kroki_stats_cpu_mode;
+
+
+/*
+  Set when ticks of timers are TSC cycles, otherwise they are
+  nanoseconds of CLOCK_MONOTONIC.  Doesn't change after the library
+  is loaded.
+*/
+extern int _kroki_stats_timer_tsc;
 
 
 #ifdef __cplusplus
@@ -46,16 +139,66 @@ int
 kroki_stats_open(const char *filename);
 
 
+__attribute__((__nothrow__))
+int
+kroki_stats_open_flags(const char *filename, int flags);
+
+
+__attribute__((__nothrow__))
+int
+kroki_stats_aggregate(unsigned int interval_ms);
+
+
 __attribute__((__nothrow__))
 void
 _kroki_stats_thread_slot_create(void);
 
 
+__attribute__((__nothrow__))
+const intptr_t *
+_kroki_stats_cpu_attach(struct _kroki_stats_module *module);
+
+
+__attribute__((__nothrow__))
+void
+_kroki_stats_module_register(struct _kroki_stats_module *module);
+
+
+__attribute__((__nothrow__))
+void
+_kroki_stats_module_unregister(struct _kroki_stats_module *module);
+
+
 __attribute__((__nothrow__))
 void
 kroki_stats_atfork_child(void);
 
 
+__attribute__((__nothrow__))
+kroki_stats_handle_t
+kroki_stats_lookup(const char *name);
+
+
+__attribute__((__nothrow__))
+void
+kroki_stats_thread_init(void);
+
+
+__attribute__((__nothrow__))
+void
+kroki_stats_set_thread_group(const char *group);
+
+
+__attribute__((__nothrow__))
+void
+_kroki_stats_eager_init(void);
+
+
+__attribute__((__nothrow__))
+void
+_kroki_stats_thread_start(void *(*start_routine)(void *));
+
+
 #ifdef __cplusplus
 }      /* extern "C" */
 #endif  /* __cplusplus */
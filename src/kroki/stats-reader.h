@@ -0,0 +1,205 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+
+
+  DESCRIPTION:
+
+  Reader of stats files for in-process collectors, link with
+  -lkroki-stats-reader.  This is what 'kroki-stats' does, without
+  the output:
+
+    struct kroki_stats_reader *r = kroki_stats_reader_open(filename);
+    struct kroki_stats_snapshot prev = { 0 }, next = { 0 }, delta = { 0 };
+    while (...)
+      {
+        if (kroki_stats_reader_update(r) != 1)
+          continue;
+        // Grow the arrays of 'next' and 'delta' if needed.
+        kroki_stats_reader_snapshot(r, &next);
+        if (kroki_stats_snapshot_diff(r, &delta, &prev, &next) == 0)
+          ...
+        // Swap 'prev' and 'next'.
+      }
+
+  The reader keeps the file mapped and the names indexed between
+  updates, and starts over when the file is replaced (that is, when
+  the application is restarted).  The values of a snapshot are in
+  the order of kroki_stats_reader_name(), which stays the same for a
+  given generation.  Histograms, timers and arrays span several
+  values that all have the name of the first one.  Values registered
+  at run time have empty names until they are named and should be
+  skipped.
+
+  A reader may be used by one thread at a time.
+*/
+
+#ifndef KROKI_STATS_READER_H
+#define KROKI_STATS_READER_H 1
+
+#include "bits/stats-module.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+
+struct kroki_stats_reader;
+
+
+/*
+  Values of one moment: 'total' are the totals of all threads
+  (including exited ones), followed by 'value_count' values of every
+  thread in 'values', thread 'i' at 'values + value_count * i' with
+  its ID in 'tids[i]'.
+
+  The arrays are owned by the caller: 'total' of at least
+  kroki_stats_reader_value_count() values, 'tids' of 'slot_capacity'
+  IDs and 'values' of 'slot_capacity' times the value count.
+  'values' and 'tids' may be NULL when only totals are wanted, which
+  are then the ones the aggregator thread of the application
+  publishes, if it runs (see stats_aggregate() in kroki/stats.h).
+  The rest is filled in by kroki_stats_reader_snapshot().
+
+  'ino' and 'file_generation' identify the file the snapshot was
+  taken of, the latter is written by the application when it creates
+  the file (it is the creation time), so that a new file is told
+  from the old one even if it got the same inode number.  'time' is
+  CLOCK_MONOTONIC.
+*/
+struct kroki_stats_snapshot
+{
+  intptr_t *total;
+  long *tids;
+  intptr_t *values;
+  size_t slot_capacity;
+
+  ino_t ino;
+  uint64_t file_generation;
+  unsigned int generation;
+  uint32_t value_count;
+  size_t slot_count;
+  struct timespec time;
+};
+
+
+/*
+  Returns the reader for 'filename', which need not exist yet, or
+  NULL with 'errno' set.
+*/
+struct kroki_stats_reader *
+kroki_stats_reader_open(const char *filename);
+
+
+void
+kroki_stats_reader_close(struct kroki_stats_reader *r);
+
+
+/*
+  Map the file or pick up its changes.  Returns 1 when there are
+  values to read, 0 if there are none yet, or -1 with 'errno' set
+  (EINVAL for a file that is not a stats file).
+*/
+int
+kroki_stats_reader_update(struct kroki_stats_reader *r);
+
+
+/*
+  Changes whenever the names or the number of values change, so that
+  whatever the caller derives from them may be kept until then.
+*/
+unsigned int
+kroki_stats_reader_generation(const struct kroki_stats_reader *r);
+
+
+uint32_t
+kroki_stats_reader_value_count(const struct kroki_stats_reader *r);
+
+
+/*
+  Upper bound of the number of threads in the next snapshot.
+*/
+size_t
+kroki_stats_reader_slot_count(const struct kroki_stats_reader *r);
+
+
+const char *
+kroki_stats_reader_name(const struct kroki_stats_reader *r, uint32_t i);
+
+
+/*
+  _KROKI_STATS_KIND_* of value 'i', see kroki/bits/stats-module.h.
+*/
+int
+kroki_stats_reader_kind(const struct kroki_stats_reader *r, uint32_t i);
+
+
+/*
+  Number of values of the histogram, timer or array that starts with
+  value 'i', one for other kinds.
+*/
+uint32_t
+kroki_stats_reader_width(const struct kroki_stats_reader *r, uint32_t i);
+
+
+/*
+  Timer ticks (the second value of a timer) in nanoseconds.
+*/
+intptr_t
+kroki_stats_reader_nsec(const struct kroki_stats_reader *r, intptr_t ticks);
+
+
+/*
+  Take a snapshot of the values as of the last update.  Values of
+  every thread are consistent with respect to stats_batch.  Returns
+  0, or -1 with 'errno' set to ENOBUFS if there are more threads than
+  'slot_capacity' ('slot_count' is then the number of threads that
+  fit, and the totals are complete), or to another value on other
+  errors.
+*/
+int
+kroki_stats_reader_snapshot(struct kroki_stats_reader *r,
+                            struct kroki_stats_snapshot *s);
+
+
+/*
+  Wait at most 'timeout_ms' for the aggregator thread of the
+  application to publish new totals.  Returns 1 when there may be
+  new totals, 0 on timeout, or -1 with 'errno' set to ENOTSUP if no
+  aggregator thread runs (call kroki_stats_reader_update() first).
+*/
+int
+kroki_stats_reader_wait(struct kroki_stats_reader *r, long timeout_ms);
+
+
+/*
+  Changes from 'prev' to 'next' into 'dst', which may be the same as
+  'next' and must have room for its threads: counters, histograms,
+  timers and arrays become differences, gauges are copied from
+  'next'.  Threads are matched by ID, a thread that is not in 'prev'
+  has all of its values.  Values appended after 'prev' was taken are
+  taken as is.  Returns 0, or -1 with 'errno' set to ESTALE if the
+  snapshots are of different files (or 'prev' was never taken), or
+  to ENOBUFS if 'dst' is too small.
+*/
+int
+kroki_stats_snapshot_diff(const struct kroki_stats_reader *r,
+                          struct kroki_stats_snapshot *dst,
+                          const struct kroki_stats_snapshot *prev,
+                          const struct kroki_stats_snapshot *next);
+
+
+#endif  /* ! KROKI_STATS_READER_H */
@@ -60,6 +60,7 @@
 
     int stats_open(const char *filename) function
     KROKI_STATS_FILE environment variable
+    KROKI_STATS_RECLAIM_SEC environment variable
 
       Internally kroki/stats uses file-backed shared memory region to
       store statistic counters of all threads.  To provide the name
@@ -76,18 +77,89 @@
       first call).  stats_open() itself is not thread-safe and should
       be called in a synchronized way (or simply before any other
       thread is created).  Normally you call stats_open() at most
-      once, stats file has a fixed size so no rotation is required.
+      once, no rotation is required: stats file holds a slot per
+      thread, slots of exited threads are reused, and the storage of
+      slots that stay unused for half a minute (or
+      KROKI_STATS_RECLAIM_SEC seconds set in the environment) is given
+      back (so the file shrinks after a spike in the number of
+      threads).  The file may grow up to 1GB (64MB on 32-bit
+      platforms), or as much as the file system has room for: threads
+      and modules that don't fit get values that only the thread
+      itself sees, the program goes on.
 
       Alternatively to calling stats_open() you may provide stats file
       name with KROKI_STATS_FILE environment variable.  This way the
       file will be created during program startup.  This is convenient
       when kroki/stats is used in a shared library and the main
-      application is not aware of kroki/stats.  Note that using
-      kroki/stats in a shared library requires that the library is
-      available at program startup (via direct or indirect linking or
-      by LD_PRELOAD), loading it later with dlopen() is not supported
-      for performance reasons (however it's possible to LD_PRELOAD the
-      library and later dlopen() it if execution flow requires so).
+      application is not aware of kroki/stats.  Such library may also
+      be loaded with dlopen(): its values are appended to the stats
+      file on the first stats() call, and stay there (with the values
+      of exited threads in the totals) after dlclose().  Modules
+      compiled with KROKI_STATS_EAGER have to be available at program
+      startup though (via direct or indirect linking or by
+      LD_PRELOAD).
+
+
+    int stats_open_flags(const char *filename, int flags) function
+    KROKI_STATS_PERCPU environment variable
+    KROKI_STATS_HUGEPAGE environment variable
+    stats_add(some.stats.name, value) macro
+
+      stats_open_flags() is stats_open() that takes flags.  With
+      KROKI_STATS_PERCPU flag (or KROKI_STATS_PERCPU=1 in the environment
+      along with KROKI_STATS_FILE) the stats file also has a block of
+      values per CPU, and stats_add() adds to the counter of the CPU the
+      thread runs on:
+
+        stats_add(my.app.packets, 1);
+        stats_add(my.app.bytes, len);
+
+      The add is done in a restartable sequence (rseq): the kernel
+      restarts it if the thread is preempted or migrated in the middle,
+      so no atomics are needed.  A thread that only uses stats_add()
+      takes no slot in the stats file, hence with very many threads the
+      size of the file and the cost of reading it depend on the number of
+      CPUs rather than on the number of threads.  stats_add() names the
+      same counter as stats(), and per-CPU values count towards totals
+      only (like the values of exited threads), so use 'kroki-stats
+      --sum' to see them.  Other macros keep per-thread values.  Without
+      the flag, or where rseq is not available (it needs x86-64 and Glibc
+      2.35+ that registers rseq for every thread), stats_add() is
+      stats(name) += value.
+
+      stats_add() is thread-safe and async-cancellation-safe.
+
+      Huge pages save dTLB misses when hot paths touch many values.  A
+      stats file on hugetlbfs (for instance, /dev/hugepages/myapp.stats)
+      is backed by huge pages and grows and shrinks by whole huge pages,
+      which have to be reserved in /proc/sys/vm/nr_hugepages.  With
+      KROKI_STATS_HUGEPAGE flag (or KROKI_STATS_HUGEPAGE=1 in the
+      environment) a file elsewhere grows by whole huge pages and asks for
+      transparent huge pages with madvise(MADV_HUGEPAGE), which tmpfs
+      honours when mounted with huge=within_size (or when shmem_enabled in
+      /sys/kernel/mm/transparent_hugepage allows it).  'kroki-stats' reads
+      such files as usual.
+
+
+    int stats_aggregate(unsigned int interval_ms) function
+    KROKI_STATS_AGGREGATE_MS environment variable
+
+      stats_aggregate() starts a thread that sums up the values of all
+      threads every 'interval_ms' milliseconds and publishes the totals
+      in the stats file (so does KROKI_STATS_AGGREGATE_MS=interval_ms in
+      the environment along with KROKI_STATS_FILE).  'kroki-stats --sum
+      --aggregated' and libkroki-stats-reader then take the totals
+      without scanning the values of every thread, which pays off with
+      many threads and frequent reads, and may wait for new totals on a
+      futex in the file header.  The totals are up to the interval old,
+      and are scanned for as usual when the thread lags behind.  The
+      thread takes no slot and blocks all signals.  It moves to the new
+      file with stats_open(), is not inherited by a forked child, and
+      stats_aggregate(0) stops it.  Returns 0, or -1 with errno set
+      (EBADF when no stats file is open).  If the thread fails later (out
+      of memory) it stops by itself, and the totals are scanned for.
+
+      stats_aggregate() is not thread-safe, like stats_open().
 
 
     stats(some.stats.name) macro
@@ -125,6 +197,221 @@
       stats() macro is thread-safe and also async-cancellation-safe.
 
 
+    stats_thread_init() function
+    KROKI_STATS_EAGER macro
+
+      stats_thread_init() creates the values of the calling thread
+      right away, which is what the first call to stats() in a thread
+      does otherwise.  If the thread already has them, it only adds
+      the values of modules loaded with dlopen() since.
+
+      When KROKI_STATS_EAGER is defined before including
+      kroki/stats.h, stats() doesn't check whether the thread has its
+      values, and compiles to a plain thread-local access.  Such a
+      program should also be linked with -lkroki-stats-eager (or have
+      libkroki-stats-eager.so in LD_PRELOAD), which wraps
+      pthread_create() for the whole program, so that every thread
+      created with pthread_create() (including threads of other
+      libraries) gets its values before its start function is run.
+      stats_open() recreates the values of the calling thread.
+      Threads that exist at the time the first such module is loaded,
+      the main thread in the first place, should call
+      stats_thread_init() before any stats(), and so should the child
+      after stats_atfork_child().  Until then, and in threads that the
+      wrapper didn't start (those of thrd_create() or SIGEV_THREAD
+      notifications, or every thread without the wrapper, as with
+      static linking), stats() counts into a scratch area that is not
+      in the file; stats_batch, stats_h() and stats_thread_init() give
+      such a thread its values.  With the wrapper every thread of the
+      program occupies a slot in the stats file, whether it uses
+      stats() or not.
+
+
+    void stats_set_thread_group(const char *group) function
+
+      Tags the calling thread with 'group' (up to 15 bytes, like
+      "acceptor", "io" or "worker"), for 'kroki-stats --by-group'.
+      Along with the tag the stats file has the process ID and the name
+      of every thread (as set with pthread_setname_np() before the
+      thread got its values), so that tools group threads without
+      looking into /proc.  The tag is kept for the values the thread
+      gets in files opened later.
+
+
+    stats_hist(some.stats.name, value) macro
+
+      Records 'value' as a sample of a distribution, like latency or
+      size distribution.  Histogram names follow the same rules as
+      stats() names but live in a namespace of their own.  Each
+      histogram is a fixed array of log-scale buckets in the values of
+      the thread: values 0-3 are counted exactly, and every following
+      power of two range is split into four sub-buckets, so reported
+      percentiles are within 25% of the exact ones (negative values
+      are counted as zeroes).  Recording a sample takes only a few
+      instructions more than ++stats(), still without any locks or
+      atomics.  'kroki-stats' merges buckets of all threads and
+      reports sample count, sum of samples and 50th, 99th and 99.9th
+      percentiles with '*' in place of a thread ID:
+
+        [*] my.app.latency.count: 10462
+        [*] my.app.latency.sum: 5023671
+        [*] my.app.latency.p50: 447
+        [*] my.app.latency.p99: 1791
+        [*] my.app.latency.p999: 3071
+
+      Each histogram adds about 2KB (1KB for 32-bit CPU) to the values
+      of every thread, so use it for distributions and not for plain
+      counters.
+
+      stats_hist() macro is thread-safe and async-cancellation-safe.
+
+
+    stats_max(some.stats.name, value) macro
+    stats_min(some.stats.name, value) macro
+    stats_set(some.stats.name, value) macro
+
+      Gauges that record a current state rather than count events:
+      stats_max() keeps the largest value seen (like peak RSS),
+      stats_min() keeps the smallest one, and stats_set() simply
+      stores the value (like current queue depth).  Each macro has
+      its own namespace of names, separate from stats() names.  The
+      kind of every value is recorded in the stats file, so
+      'kroki-stats' reduces gauges of all threads properly and
+      reports the result with '*' in place of a thread ID: maximum of
+      per-thread maximums, minimum of per-thread minimums, and the sum
+      of per-thread stats_set() values (so a gauge should either be
+      set by a single thread, or each thread should set its own share
+      of the total).  Per-thread values are also reported, except for
+      maximums and minimums that haven't been updated in a given
+      thread:
+
+        [24629] my.app.queue.peak: 17
+        [24608] my.app.queue.peak: 42
+        [*] my.app.queue.peak: 42
+
+      These macros are thread-safe and async-cancellation-safe.
+
+
+    stats_array(some.stats.name, N)[i] macro
+
+      A family of N counters under one name, indexed at run time:
+
+        ++stats_array(my.app.http.status, 600)[status];
+
+      The counters are adjacent values of the thread, so a switch over
+      many stats() names is not needed and the family stays in adjacent
+      cache lines.  'i' has to be below N, which is not checked.  N has
+      to be an integer constant that the assembler can evaluate (a
+      literal, or a macro that expands to an arithmetic expression of
+      literals), and all uses of a name in an executable or a shared
+      library have to give the same N.  Array names live in a namespace
+      of their own.  'kroki-stats' reports elements as 'name[i]' (or
+      with an 'index' label in Prometheus format), and skips zero
+      elements:
+
+        [24629] my.app.http.status[200]: 1041
+        [24629] my.app.http.status[404]: 3
+
+      stats_array() macro is thread-safe and async-cancellation-safe.
+
+
+    stats_hot(some.stats.name) macro
+
+      Same as stats(), but the value is placed first in the per-thread
+      block of values, together with the stats_hot() values of all other
+      modules, so that the counters updated on the hottest paths share
+      the first cache lines of the block rather than being spread across
+      it in link order:
+
+        ++stats_hot(my.app.packets);
+
+      stats_hot() names are distinct from stats() names: using the same
+      name with both gives two values, which '--merge' combines.
+      'kroki-stats --layout' shows where each value ended up.
+
+      stats_hot() is thread-safe and async-cancellation-safe.
+
+
+    stats_handle_t stats_lookup(const char *name) function
+    stats_h(handle) macro
+
+      Counters whose names are only known at run time (say, from a
+      configuration) are registered with stats_lookup().  It returns a
+      handle, which stats_h() turns into the counter lvalue at the same
+      cost as stats(), so look a name up once and keep the handle:
+
+        stats_handle_t requests = stats_lookup(backend_name);
+        ...
+        ++stats_h(requests);
+
+      Looking up the same name again returns the same handle.  Names
+      are made of printable ASCII characters other than space, '"' and
+      '\', up to 255 of them.  'kroki-stats' reports them next to the
+      names given to stats(), and '--merge' combines equal ones.  A
+      process may register up to 256 names.  Every thread gets values
+      for all of them once the first one is registered.  On error NULL
+      is returned and 'errno' is set: EINVAL for an invalid name,
+      ENAMETOOLONG for a name that is too long, ENOSPC when there is no
+      room for more names, or ENOMEM.
+
+      stats_lookup() and stats_h() are thread-safe, stats_h() is also
+      async-cancellation-safe.
+
+
+    stats_batch { ... } statement
+
+      Updates made by a thread in a stats_batch scope are seen by
+      'kroki-stats' all at once or not at all, so that ratios of
+      related values don't jitter:
+
+        stats_batch
+          {
+            ++stats(my.app.requests);
+            if (failed)
+              ++stats(my.app.errors);
+          }
+
+      The batch bumps a sequence number of the thread values before
+      and after the updates, and the reader retries the copy of the
+      values until the number is even and unchanged.  Updates outside
+      of batches cost nothing extra.  Batches may be nested (the
+      outermost one counts) and may be left with break, return or
+      goto.  Keep them short: the reader waits for a batch in
+      progress, and gives up after a while if the thread is
+      preempted in the middle of it.  stats_open() and
+      stats_atfork_child() must not be called in a batch.
+
+      stats_batch is thread-safe.
+
+
+    stats_timer(some.stats.name) { ... } statement
+
+      Counts the runs of the scope and the time spent in it:
+
+        stats_timer(my.app.parse)
+          {
+            parse(packet);
+          }
+
+      On x86 the time is taken with RDTSC at the start and RDTSCP at the
+      end of the scope (a few dozen cycles together), provided the kernel
+      uses TSC as its clock source; otherwise clock_gettime() with
+      CLOCK_MONOTONIC is used, which goes through the vDSO.  Ticks are
+      stored as is, and the library measures their frequency once when it
+      initializes the stats file (waiting until a millisecond has passed
+      since it was loaded, if needed) and stores it in the file, so that
+      'kroki-stats' reports the time in nanoseconds:
+
+        [24629] my.app.parse.count: 1041
+        [24629] my.app.parse.nsec: 2841003
+
+      Like counters, timers are summed up only with '--sum'.  The scope
+      may be left with break, return or goto.  Timer names live in a
+      namespace of their own.
+
+      stats_timer is thread-safe.
+
+
     /usr/bin/kroki-stats command-line utility
 
       'kroki-stats' utility takes the stats file name as an argument
@@ -146,6 +433,92 @@
       threads).  But normally the output is further processed and/or
       send to monitoring/graphing software.
 
+      By default values are grouped by thread.  With '--by-name' ('-n')
+      they are grouped by name instead, and with '--sum' ('-s') only
+      totals across all threads are output, one line per name
+      (counters are summed up, gauges and histograms are reduced as
+      described above).  Totals include the values of threads that
+      have exited (but for stats_set() values), so they never
+      decrease and there is no need to poll often to catch
+      short-lived threads.  '--sum' makes for a lot less output when
+      there are many threads:
+
+        $ kroki-stats --sum /dev/shm/myapp.stats
+        [*] my.app.iterations: 7
+        [*] my.app.updates: 2
+        [*] my.app.nsec: 1855833049
+
+      '--by-group' ('-g') sums up the values of the threads of every
+      group (the tag given with stats_set_thread_group(), or else the
+      thread name) and outputs them in place of the values of the
+      threads, with the group instead of the thread ID:
+
+        $ kroki-stats --by-group /dev/shm/myapp.stats
+        [io] my.app.iterations: 5
+        [worker] my.app.iterations: 2
+
+      Equal names from different executables or shared libraries are
+      reported separately unless '--merge' ('-m') is given, in which
+      case their values are combined.
+
+      Several STATSFILEs, or glob patterns (quoted, so that in
+      '--interval' mode they are expanded anew for every sample and pick
+      up the files of new processes), are merged into one: values of
+      equal name and kind are combined across the files as with
+      '--merge', timers in nanoseconds, and threads keep their IDs.  A
+      pattern adds only the files it matches, while a STATSFILE with no
+      wildcards is read once it exists.  The names of files of the same
+      executable are looked up only once, so merging the files of many
+      worker processes costs about as much as summing them up one by
+      one:
+
+        $ kroki-stats --sum '/dev/shm/myapp.*.stats'
+        [*] my.app.iterations: 70
+
+      With '--interval=MS' ('-i MS') 'kroki-stats' keeps the file open
+      and every MS milliseconds outputs how counters and histograms
+      have changed since the previous sample (gauges are output as
+      is), with an empty line after each sample.  '--rate' ('-r')
+      divides the changes by the time elapsed, giving per second
+      rates.  Thread slots are matched by thread ID, so that a slot
+      reused by a new thread is not reported as a counter reset.  If
+      the file is replaced (i.e. the application is restarted), the
+      new file is picked up automatically.
+
+      '--record=FILE' ('-o FILE') with '--interval' writes the samples
+      to FILE instead, in a compact binary form: the names once, and
+      then only the values that changed since the previous sample.
+      '--replay' ('-p') outputs the samples of the recording given in
+      place of STATSFILE as '--interval' would have, and
+      '--diff=FROM,TO' ('-d FROM,TO') outputs the changes between the
+      first samples at or after FROM and TO seconds of the recording.
+      Both take the other options ('--rate', '--sum', '--format' and
+      so on) as usual.
+
+      '--format=FORMAT' ('-f FORMAT') selects the output format:
+      'text' (the default shown above), 'tsv' (thread ID, name and
+      value separated by tabs), 'json' (an object per sample, keyed by
+      thread ID and then by name, or the other way around with
+      '--by-name'), 'prometheus' (text exposition format, implies
+      '--by-name' and '--merge', thread ID becomes a label), or
+      'columnar' (a header line with all the names followed by a line
+      of values per thread, which is much more compact when there are
+      many threads).  '*' stands for totals in all formats.
+
+      '--jobs=N' ('-j N') computes the totals with N threads, each
+      summing up a range of thread slots, which speeds up '--sum' on
+      files of many threads and many values.  The totals are the same
+      as with a single job.  'make benchmark' in 'test/' measures the
+      scan rate on a synthetic file with 1, 2, 4... jobs.
+
+      '--aggregated' ('-a') takes the totals that the aggregator
+      thread of the application publishes (see stats_aggregate()), when
+      it runs and keeps up, instead of summing up the thread slots.
+
+      '--layout' ('-l') outputs the offset and the cache line of
+      every value in the per-thread block instead of the values, to
+      check that the values updated together share cache lines.
+
       'kroki-stats' reads the values asynchronously with respect to
       the application that updates the counters.  While each
       individual value is read atomically, no two values a
@@ -155,7 +528,31 @@
         ++stats(my.stat2);
 
       'kroki-stats' may see _any_ increment before the other (subject
-      to compiler and CPU reordering).
+      to compiler and CPU reordering), unless the updates are made in
+      a stats_batch scope described above.
+
+      For continuous collection there is 'kroki-stats-exporter':
+
+        kroki-stats-exporter [--listen=ADDR] STATSFILE...
+
+      It keeps the files mapped and serves the totals across threads
+      (as with '--sum --merge --format=prometheus') at
+      http://ADDR/metrics, where ADDR is '[HOST:]PORT' or 'unix:PATH'
+      (127.0.0.1:9271 by default), for instance
+
+        $ curl --unix-socket /run/app.sock http://localhost/metrics
+
+      With several files every value gets a 'file' label, and
+      'kroki_stats_exporter_file_up' tells which files could be read.
+      Missing files are skipped, and restarted applications are picked
+      up on the next scrape.
+
+      In-process collectors may read stats files with the
+      libkroki-stats-reader library (kroki/stats-reader.h) rather than
+      run 'kroki-stats' and parse its output: it takes snapshots of the
+      totals and of the values of every thread into arrays owned by the
+      caller, lists the names, and computes the changes between two
+      snapshots.
 
 
     void stats_atfork_child(void) function
@@ -184,9 +581,10 @@
 
   Implementation requires Linux kernel, GCC 4.7.3+, GNU ld, Glibc.
 
-  kroki/stats cannot be used in object module intended to be loaded
-  with dlopen() (unless it is preloaded with LD_PRELOAD beforehand,
-  see the description of stats_open() above).
+  Modules loaded with dlopen() rely on Glibc reserving some static
+  TLS for them (every module takes a single thread-local word).
+  A module compiled with KROKI_STATS_EAGER cannot be loaded with
+  dlopen().
 
   IA-64 architecture is not supported (this is _not_ x86-64, which is
   supported).
@@ -195,8 +593,25 @@
 #ifndef KROKI_STATS_NOPOLLUTE
 
 #define stats_open(filename)  kroki_stats_open(filename)
+#define stats_open_flags(filename, flags)  \
+  kroki_stats_open_flags(filename, flags)
+#define stats_aggregate(interval_ms)  kroki_stats_aggregate(interval_ms)
 #define stats(name)  kroki_stats(name)
+#define stats_hot(name)  kroki_stats_hot(name)
+#define stats_add(name, value)  kroki_stats_add(name, value)
+#define stats_hist(name, value)  kroki_stats_hist(name, value)
+#define stats_max(name, value)  kroki_stats_max(name, value)
+#define stats_min(name, value)  kroki_stats_min(name, value)
+#define stats_set(name, value)  kroki_stats_set(name, value)
+#define stats_array(name, count)  kroki_stats_array(name, count)
 #define stats_atfork_child()  kroki_stats_atfork_child()
+#define stats_thread_init()  kroki_stats_thread_init()
+#define stats_set_thread_group(group)  kroki_stats_set_thread_group(group)
+#define stats_batch  kroki_stats_batch
+#define stats_timer(name)  kroki_stats_timer(name)
+#define stats_handle_t  kroki_stats_handle_t
+#define stats_lookup(name)  kroki_stats_lookup(name)
+#define stats_h(handle)  kroki_stats_h(handle)
 
 #endif  /* ! KROKI_STATS_NOPOLLUTE */
 
@@ -205,46 +620,222 @@
 #define KROKI_STATS_H 1
 
 #include "bits/stats-module.h"
+#include <stddef.h>
+#include <time.h>
+#ifdef _KROKI_STATS_RSEQ
+#include <sys/rseq.h>
+#endif
+
+
+#define kroki_stats(name)                                               \
+  (*_kroki_stats_eval(#name, __COUNTER__, "value",                      \
+                      _KROKI_STATS_KIND_SUM, 1))
+
+
+#define kroki_stats_hot(name)                                           \
+  (*_kroki_stats_hot_eval(#name, __COUNTER__))
+#define _kroki_stats_hot_eval(name, unique)                             \
+  _kroki_stats_hot_impl(name, unique)
+#define _kroki_stats_hot_impl(name, unique)                             \
+  ({                                                                    \
+    const char *r##unique =                                             \
+      _kroki_stats_section_ref("_hot_", name, unique, "hot",            \
+                               _KROKI_STATS_KIND_SUM, 1);               \
+                                                                        \
+    _KROKI_STATS_THREAD_SLOT_OF(_kroki_stats_hot_thread_offset);        \
+                                                                        \
+    (intptr_t *)                                                        \
+      __builtin_assume_aligned(r##unique                                \
+                               + _kroki_stats_hot_thread_offset,        \
+                               __SIZEOF_POINTER__);                     \
+  })
+
+
+#define kroki_stats_add(name, value)                                    \
+  _kroki_stats_add(_kroki_stats_eval_ref(#name, __COUNTER__, "value",   \
+                                         _KROKI_STATS_KIND_SUM, 1),     \
+                   (value))
+
+
+#define kroki_stats_hist(name, value)                                   \
+  _kroki_stats_hist_record(                                             \
+    _kroki_stats_eval(#name, __COUNTER__, "hist",                       \
+                      _KROKI_STATS_KIND_HIST,                           \
+                      _KROKI_STATS_HIST_VALUES),                        \
+    (value))
+
 
+#define kroki_stats_max(name, value)                                    \
+  _kroki_stats_max_record(                                              \
+    _kroki_stats_eval(#name, __COUNTER__, "max",                        \
+                      _KROKI_STATS_KIND_MAX, 1),                        \
+    (value))
 
-#define kroki_stats(name)  _kroki_stats_eval(#name, __COUNTER__)
-#define _kroki_stats_eval(name, unique)  _kroki_stats_impl(name, unique)
-#define _kroki_stats_impl(name, unique)                                 \
-  (*({                                                                  \
+
+#define kroki_stats_min(name, value)                                    \
+  _kroki_stats_min_record(                                              \
+    _kroki_stats_eval(#name, __COUNTER__, "min",                        \
+                      _KROKI_STATS_KIND_MIN, 1),                        \
+    (value))
+
+
+#define kroki_stats_set(name, value)                                    \
+  ((void) (*_kroki_stats_eval(#name, __COUNTER__, "last",               \
+                              _KROKI_STATS_KIND_LAST, 1) = (value)))
+
+
+#define kroki_stats_array(name, count)                                  \
+  _kroki_stats_array_eval(#name, __COUNTER__, count)
+#define _kroki_stats_array_eval(name, unique, count)                    \
+  _kroki_stats_array_impl(name, unique, count)
+#define _kroki_stats_array_impl(name, unique, count)                    \
+  ({                                                                    \
+    __asm__(                                                            \
+      ".ifndef ._kroki_stats_array_count_" name "\n"                    \
+      "  .set ._kroki_stats_array_count_" name ", "                     \
+             _KROKI_STATS_STR(count) "\n"                               \
+      ".elseif ._kroki_stats_array_count_" name                         \
+             " - (" _KROKI_STATS_STR(count) ")\n"                       \
+      "  .error \"stats_array(" name ") with another count\"\n"         \
+      ".endif\n"                                                        \
+    );                                                                  \
+    _kroki_stats_impl(name, unique, "array", _KROKI_STATS_KIND_ARRAY,   \
+                      count);                                           \
+  })
+
+
+#define kroki_stats_batch                                               \
+  _kroki_stats_batch_eval(__COUNTER__)
+#define _kroki_stats_batch_eval(unique)                                 \
+  _kroki_stats_batch_impl(unique)
+#define _kroki_stats_batch_impl(unique)                                 \
+  for (struct _kroki_stats_batch _kroki_stats_batch##unique             \
+         __attribute__((__cleanup__(_kroki_stats_batch_end)))           \
+         = _kroki_stats_batch_begin();                                  \
+       _kroki_stats_batch##unique.once;                                 \
+       _kroki_stats_batch##unique.once = 0)
+
+
+#define kroki_stats_timer(name)                                         \
+  _kroki_stats_timer_eval(#name, __COUNTER__)
+#define _kroki_stats_timer_eval(name, unique)                           \
+  _kroki_stats_timer_impl(name, unique)
+#define _kroki_stats_timer_impl(name, unique)                           \
+  for (struct _kroki_stats_timer _kroki_stats_timer##unique             \
+         __attribute__((__cleanup__(_kroki_stats_timer_end)))           \
+         = _kroki_stats_timer_begin(                                    \
+             _kroki_stats_impl(name, unique, "timer",                   \
+                               _KROKI_STATS_KIND_TIMER,                 \
+                               _KROKI_STATS_TIMER_VALUES));             \
+       _kroki_stats_timer##unique.once;                                 \
+       _kroki_stats_timer##unique.once = 0)
+
+
+#define kroki_stats_h(handle)                                           \
+  (*_kroki_stats_h(handle))
+
+
+#define _kroki_stats_eval(name, unique, tag, kind, count)               \
+  _kroki_stats_impl(name, unique, tag, kind, count)
+#define _kroki_stats_eval_ref(name, unique, tag, kind, count)           \
+  _kroki_stats_ref(name, unique, tag, kind, count)
+#define _kroki_stats_impl(name, unique, tag, kind, count)               \
+  ({                                                                    \
+    const char *r##unique = _kroki_stats_ref(name, unique, tag, kind,   \
+                                             count);                    \
+                                                                        \
+    _KROKI_STATS_THREAD_SLOT();                                         \
+                                                                        \
+    (intptr_t *)                                                        \
+      __builtin_assume_aligned(r##unique                                \
+                               + _kroki_stats_module_thread_offset,     \
+                               __SIZEOF_POINTER__);                     \
+  })
+
+
+/*
+  Address of the scratch word of the first value, the values of the
+  calling thread are at a fixed offset from it.  Scratch words
+  parallel the name references, and are what a thread without values
+  (a zero offset) writes to.  Values of stats_hot() are in sections
+  of their own (sect is "_hot_"), which make another module.
+*/
+#define _kroki_stats_ref(name, unique, tag, kind, count)                \
+  _kroki_stats_section_ref("_", name, unique, tag, kind, count)
+#define _kroki_stats_section_ref(sect, name, unique, tag, kind, count)  \
+  ({                                                                    \
     extern __attribute__((__visibility__("hidden")))                    \
-      const char *const n##unique __asm__("._kroki_stats_value_" name); \
-    intptr_t *pvalue;                                                   \
+      char n##unique                                                    \
+      __asm__("._kroki_stats_" tag "_" name);                           \
                                                                         \
     __asm__(                                                            \
-      ".ifndef ._kroki_stats_value_" name "\n"                          \
+      ".ifndef ._kroki_stats_" tag "_" name "\n"                        \
                                                                         \
-      "  .pushsection _kroki_stats_names\n"                             \
+      "  .pushsection _kroki_stats" sect "names\n"                     \
       "   0:\n"                                                         \
       "    .string \"" name "\"\n"                                      \
       "  .popsection\n"                                                 \
                                                                         \
-      "  .pushsection _kroki_stats_name_refs\n"                         \
-      "   ._kroki_stats_value_" name ":\n"                              \
+      "  .pushsection _kroki_stats" sect "name_refs\n"                 \
+      "    .rept " _KROKI_STATS_STR(count) "\n"                         \
       "    " _KROKI_STATS_ASM_PTR " 0b\n"                               \
+      "    .endr\n"                                                     \
+      "  .popsection\n"                                                 \
+                                                                        \
+      "  .pushsection _kroki_stats" sect "scratch\n"                   \
+      "    .balign " _KROKI_STATS_STR(__SIZEOF_POINTER__) "\n"          \
+      "   ._kroki_stats_" tag "_" name ":\n"                            \
+      "    .skip " _KROKI_STATS_STR(count) " * "                        \
+                   _KROKI_STATS_STR(__SIZEOF_POINTER__) "\n"            \
+      "  .popsection\n"                                                 \
+                                                                        \
+      "  .pushsection _kroki_stats" sect "kinds\n"                     \
+      "    .fill " _KROKI_STATS_STR(count) ", 1, "                      \
+                   _KROKI_STATS_STR(kind) "\n"                          \
       "  .popsection\n"                                                 \
                                                                         \
       ".endif\n"                                                        \
     );                                                                  \
                                                                         \
-    if (__builtin_expect(! _kroki_stats_module_thread_offset, 0))       \
-      _kroki_stats_thread_slot_create();                                \
-    /*                                                                  \
-      Tell GCC that _kroki_stats_module_thread_offset is defined now.   \
-    */                                                                  \
-    if (! _kroki_stats_module_thread_offset)                            \
-      __builtin_unreachable();                                          \
-                                                                        \
-    pvalue = (intptr_t *)                                               \
-      __builtin_assume_aligned((char *) &n##unique                      \
-                               + _kroki_stats_module_thread_offset,     \
-                               __SIZEOF_POINTER__);                     \
-    pvalue;                                                             \
-  }))
+    (const char *) &n##unique;                                          \
+  })
+
+
+#ifndef KROKI_STATS_EAGER
+
+#define _KROKI_STATS_THREAD_SLOT()                                      \
+  _KROKI_STATS_THREAD_SLOT_OF(_kroki_stats_module_thread_offset)
+#define _KROKI_STATS_THREAD_SLOT_OF(offset)                             \
+  do                                                                    \
+    {                                                                   \
+      if (__builtin_expect(! (offset), 0))                              \
+        _kroki_stats_thread_slot_create();                              \
+      /*                                                                \
+        Tell GCC that the offset is defined now.                        \
+      */                                                                \
+      if (! (offset))                                                   \
+        __builtin_unreachable();                                        \
+    }                                                                   \
+  while (0)
+
+#else  /* KROKI_STATS_EAGER */
+
+/* Every thread has its slot by the time it runs any stats().  */
+#define _KROKI_STATS_THREAD_SLOT()  ((void) 0)
+#define _KROKI_STATS_THREAD_SLOT_OF(offset)  ((void) 0)
+
+static __attribute__((__constructor__))
+void
+_kroki_stats_eager_register(void)
+{
+  _kroki_stats_eager_init();
+}
+
+#endif  /* KROKI_STATS_EAGER */
+
+
+#define _KROKI_STATS_STR(s)  _KROKI_STATS_STR_IMPL(s)
+#define _KROKI_STATS_STR_IMPL(s)  #s
 
 
 #if (__SIZEOF_POINTER__ == 8)
@@ -260,9 +851,58 @@
 __asm__(
   ".section _kroki_stats_names, \"aS\", @progbits; .previous\n"
   ".section _kroki_stats_name_refs, \"a\", @progbits; .previous\n"
+  ".section _kroki_stats_kinds, \"a\", @progbits; .previous\n"
+  ".section _kroki_stats_hot_names, \"aS\", @progbits; .previous\n"
+  ".section _kroki_stats_hot_name_refs, \"a\", @progbits; .previous\n"
+  ".section _kroki_stats_hot_kinds, \"a\", @progbits; .previous\n"
+  ".section _kroki_stats_scratch, \"aw\", @nobits; .previous\n"
+  ".section _kroki_stats_hot_scratch, \"aw\", @nobits; .previous\n"
 );
 
 
+static inline __attribute__((__always_inline__))
+void
+_kroki_stats_hist_record(intptr_t *hist, intptr_t value)
+{
+  unsigned int bucket;
+  if (value < 4)
+    {
+      /* Negative values are counted as zeroes.  */
+      if (value < 0)
+        value = 0;
+      bucket = value;
+    }
+  else
+    {
+      /* Index of the highest bit set, at least 2.  */
+      unsigned int exp = __SIZEOF_POINTER__ * 8 - 1 - __builtin_clzl(value);
+      bucket = (exp - 1) * 4 + ((value >> (exp - 2)) & 3);
+    }
+
+  ++hist[0];
+  hist[1] += value;
+  ++hist[2 + bucket];
+}
+
+
+static inline __attribute__((__always_inline__))
+void
+_kroki_stats_max_record(intptr_t *pvalue, intptr_t value)
+{
+  if (*pvalue < value)
+    *pvalue = value;
+}
+
+
+static inline __attribute__((__always_inline__))
+void
+_kroki_stats_min_record(intptr_t *pvalue, intptr_t value)
+{
+  if (*pvalue > value)
+    *pvalue = value;
+}
+
+
 static __thread __attribute__((__section__(".gnu.linkonce.tb._kroki_stats"),
                                __tls_model__("initial-exec")))
 intptr_t _kroki_stats_module_thread_offset = 0;
@@ -277,9 +917,226 @@ _kroki_stats_get_module_thread_offset(void)
 }
 
 
+static __thread __attribute__((__section__(".gnu.linkonce.tb._kroki_stats_hot"),
+                               __tls_model__("initial-exec")))
+intptr_t _kroki_stats_hot_thread_offset = 0;
+
+
+__attribute__((__section__(".gnu.linkonce"),
+               __visibility__("hidden")))
+intptr_t *
+_kroki_stats_get_hot_thread_offset(void)
+{
+  return &_kroki_stats_hot_thread_offset;
+}
+
+
+struct _kroki_stats_batch
+{
+  intptr_t *seq;                /* NULL in a nested batch.  */
+  int once;
+};
+
+
+/*
+  Sequence number of the thread values is odd while a batch is in
+  progress.  Only the owning thread writes it, so plain loads are
+  fine here.
+*/
+static inline __attribute__((__always_inline__))
+struct _kroki_stats_batch
+_kroki_stats_batch_begin(void)
+{
+  struct _kroki_stats_batch batch = { 0, 1 };
+
+  _KROKI_STATS_THREAD_SLOT();
+
+  intptr_t *seq = _kroki_stats_batch_seq;
+#ifdef KROKI_STATS_EAGER
+  /*
+    Threads that were not started with pthread_create() (like those
+    of thrd_create() or SIGEV_THREAD) get their values here.
+  */
+  if (__builtin_expect(! seq, 0))
+    {
+      _kroki_stats_thread_slot_create();
+      seq = _kroki_stats_batch_seq;
+    }
+#endif
+  intptr_t value = *seq;
+  if (! (value & 1))
+    {
+      __atomic_store_n(seq, value + 1, __ATOMIC_RELAXED);
+      /* Order the store above before the updates in the batch.  */
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      batch.seq = seq;
+    }
+
+  return batch;
+}
+
+
+static inline __attribute__((__always_inline__))
+void
+_kroki_stats_batch_end(struct _kroki_stats_batch *batch)
+{
+  if (batch->seq)
+    __atomic_store_n(batch->seq, *batch->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+  'end' is set for the tick at the end of a timed scope: RDTSCP waits
+  for the instructions of the scope to complete, while RDTSC at the
+  start costs less.
+*/
+static inline __attribute__((__always_inline__))
+uint64_t
+_kroki_stats_ticks(int end)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_expect(_kroki_stats_timer_tsc, 1))
+    {
+      unsigned int aux;
+      return (end ? __builtin_ia32_rdtscp(&aux) : __builtin_ia32_rdtsc());
+    }
+#else
+  (void) end;
+#endif
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+struct _kroki_stats_timer
+{
+  intptr_t *timer;
+  uint64_t start;
+  int once;
+};
+
+
+static inline __attribute__((__always_inline__))
+struct _kroki_stats_timer
+_kroki_stats_timer_begin(intptr_t *timer)
+{
+  struct _kroki_stats_timer t = { timer, _kroki_stats_ticks(0), 1 };
+  return t;
+}
+
+
+static inline __attribute__((__always_inline__))
+void
+_kroki_stats_timer_end(struct _kroki_stats_timer *t)
+{
+  ++t->timer[0];
+  t->timer[1] += _kroki_stats_ticks(1) - t->start;
+}
+
+
+/*
+  Names registered at run time may appear after the thread got its
+  values, so the check is done even with KROKI_STATS_EAGER.
+*/
+static inline __attribute__((__always_inline__))
+intptr_t *
+_kroki_stats_h(kroki_stats_handle_t handle)
+{
+  if (__builtin_expect(! _kroki_stats_dynamic_thread_offset, 0))
+    _kroki_stats_thread_slot_create();
+
+  return (intptr_t *)
+    __builtin_assume_aligned((const char *) handle
+                             + _kroki_stats_dynamic_thread_offset,
+                             __SIZEOF_POINTER__);
+}
+
+
 static __attribute__((__section__(".gnu.linkonce.b._kroki_stats")))
 struct _kroki_stats_module _kroki_stats_module;
 
+static __attribute__((__section__(".gnu.linkonce.b._kroki_stats_hot")))
+struct _kroki_stats_module _kroki_stats_hot_module;
+
+
+#ifdef _KROKI_STATS_RSEQ
+
+/*
+  Add to the value of the CPU the thread runs on.  The kernel
+  restarts the sequence (from label 5) when the thread is preempted,
+  migrated or gets a signal after label 0 but before the add is done,
+  so the add is done on the CPU whose id was read, and without
+  atomics.  The signature in front of the abort handler is checked by
+  the kernel.
+*/
+static inline __attribute__((__always_inline__))
+void
+_kroki_stats_cpu_add(const char *ref, const intptr_t *offsets,
+                     intptr_t value)
+{
+  uintptr_t tmp;
+  __asm__ __volatile__(
+    ".pushsection __rseq_cs, \"aw\"\n"
+    "  .balign 32\n"
+    " 3:\n"
+    "  .long 0, 0\n"
+    "  .quad 0f, 2f - 0f, 4f\n"
+    ".popsection\n"
+    ".pushsection __rseq_failure, \"ax\"\n"
+    "  .byte 0x0f, 0xb9, 0x3d\n"
+    "  .long 0x53053053\n"
+    " 4:\n"
+    "  jmp 5f\n"
+    ".popsection\n"
+    " 5:\n"
+    "  leaq 3b(%%rip), %[tmp]\n"
+    "  movq %[tmp], %%fs:8(%[rseq])\n"
+    " 0:\n"
+    "  movl %%fs:4(%[rseq]), %k[tmp]\n"
+    "  movq (%[offsets], %[tmp], 8), %[tmp]\n"
+    "  addq %[value], (%[ref], %[tmp])\n"
+    " 2:\n"
+    : [tmp] "=&r" (tmp)
+    : [rseq] "r" (__rseq_offset), [offsets] "r" (offsets),
+      [ref] "r" (ref), [value] "er" (value)
+    : "memory", "cc");
+}
+
+#endif  /* _KROKI_STATS_RSEQ */
+
+
+/*
+  In a per-CPU stats file the value is updated in the block of the
+  current CPU, otherwise in the block of the calling thread.
+*/
+static inline __attribute__((__always_inline__))
+void
+_kroki_stats_add(const char *ref, intptr_t value)
+{
+#ifdef _KROKI_STATS_RSEQ
+  if (__builtin_expect(_kroki_stats_cpu_mode, 0))
+    {
+      const intptr_t *offsets =
+        __atomic_load_n(&_kroki_stats_module.cpu_offsets, __ATOMIC_ACQUIRE);
+      if (__builtin_expect(! offsets, 0))
+        offsets = _kroki_stats_cpu_attach(&_kroki_stats_module);
+      if (__builtin_expect(offsets != NULL, 1))
+        {
+          _kroki_stats_cpu_add(ref, offsets, value);
+          return;
+        }
+    }
+#endif
+
+  _KROKI_STATS_THREAD_SLOT();
+
+  *(intptr_t *) __builtin_assume_aligned(ref
+                                         + _kroki_stats_module_thread_offset,
+                                         __SIZEOF_POINTER__) += value;
+}
+
 
 __attribute__((__section__(".gnu.linkonce"),
                __visibility__("hidden"),
@@ -294,6 +1151,22 @@ _kroki_stats_init(void)
     const char *const __start__kroki_stats_name_refs,
                *const __stop__kroki_stats_name_refs;
 
+  extern __attribute__((__visibility__("hidden")))
+    const uint8_t __start__kroki_stats_kinds;
+
+  extern __attribute__((__visibility__("hidden")))
+    const char __start__kroki_stats_hot_names, __stop__kroki_stats_hot_names;
+
+  extern __attribute__((__visibility__("hidden")))
+    const char *const __start__kroki_stats_hot_name_refs,
+               *const __stop__kroki_stats_hot_name_refs;
+
+  extern __attribute__((__visibility__("hidden")))
+    const uint8_t __start__kroki_stats_hot_kinds;
+
+  extern __attribute__((__visibility__("hidden")))
+    char __start__kroki_stats_scratch, __start__kroki_stats_hot_scratch;
+
   static __attribute__((__section__(".gnu.linkonce.b._kroki_stats")))
     int called = 0;
   if (called++)
@@ -301,13 +1174,48 @@ _kroki_stats_init(void)
 
   _kroki_stats_module.thread_offset = _kroki_stats_get_module_thread_offset;
   _kroki_stats_module.name_refs = &__start__kroki_stats_name_refs;
+  _kroki_stats_module.scratch = &__start__kroki_stats_scratch;
+  _kroki_stats_module.kinds = &__start__kroki_stats_kinds;
   _kroki_stats_module.names_size =
     &__stop__kroki_stats_names - &__start__kroki_stats_names;
   _kroki_stats_module.value_count =
     &__stop__kroki_stats_name_refs - &__start__kroki_stats_name_refs;
 
-  _kroki_stats_module.next = _kroki_stats_module_head;
-  _kroki_stats_module_head = &_kroki_stats_module;
+  _kroki_stats_module_register(&_kroki_stats_module);
+
+  _kroki_stats_hot_module.thread_offset = _kroki_stats_get_hot_thread_offset;
+  _kroki_stats_hot_module.name_refs = &__start__kroki_stats_hot_name_refs;
+  _kroki_stats_hot_module.scratch = &__start__kroki_stats_hot_scratch;
+  _kroki_stats_hot_module.kinds = &__start__kroki_stats_hot_kinds;
+  _kroki_stats_hot_module.names_size =
+    &__stop__kroki_stats_hot_names - &__start__kroki_stats_hot_names;
+  _kroki_stats_hot_module.value_count =
+    &__stop__kroki_stats_hot_name_refs - &__start__kroki_stats_hot_name_refs;
+  _kroki_stats_hot_module.hot = 1;
+
+  if (_kroki_stats_hot_module.value_count)
+    _kroki_stats_module_register(&_kroki_stats_hot_module);
+}
+
+
+/*
+  Values of the module outlive it in the stats file, but a module
+  unloaded with dlclose() has to be unregistered.
+*/
+__attribute__((__section__(".gnu.linkonce"),
+               __visibility__("hidden"),
+               __destructor__))
+void
+_kroki_stats_fini(void)
+{
+  static __attribute__((__section__(".gnu.linkonce.b._kroki_stats")))
+    int called = 0;
+  if (called++)
+    return;
+
+  _kroki_stats_module_unregister(&_kroki_stats_module);
+  if (_kroki_stats_hot_module.value_count)
+    _kroki_stats_module_unregister(&_kroki_stats_hot_module);
 }
 
 
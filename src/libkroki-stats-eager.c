@@ -0,0 +1,100 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Linked into a program (or put into LD_PRELOAD) this library wraps
+  pthread_create() of the whole program, so that in eager mode every
+  thread it starts gets its values before its start function is run.
+  It is only built shared, as there is no next pthread_create() to
+  find with dlsym() in a static program.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "kroki/bits/stats-module.h"
+#include <pthread.h>
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+typedef int (*pthread_create_func)(pthread_t *, const pthread_attr_t *,
+                                   void *(*)(void *), void *);
+
+
+struct thread_start
+{
+  void *(*start_routine)(void *);
+  void *arg;
+};
+
+
+static
+void *
+thread_start(void *arg)
+{
+  struct thread_start start = *(struct thread_start *) arg;
+  free(arg);
+
+  _kroki_stats_thread_start(start.start_routine);
+
+  return start.start_routine(start.arg);
+}
+
+
+/*
+  pthread_create() that this library wraps, or NULL.
+*/
+static
+pthread_create_func
+next_pthread_create(void)
+{
+  static pthread_create_func next = NULL;
+  pthread_create_func create = __atomic_load_n(&next, __ATOMIC_RELAXED);
+  if (__builtin_expect(! create, 0))
+    {
+      create = (pthread_create_func) dlsym(RTLD_NEXT, "pthread_create");
+      __atomic_store_n(&next, create, __ATOMIC_RELAXED);
+    }
+
+  return create;
+}
+
+
+int
+pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+               void *(*start_routine)(void *), void *arg)
+{
+  pthread_create_func create = next_pthread_create();
+  if (! create)
+    return EAGAIN;
+
+  struct thread_start *start = malloc(sizeof(*start));
+  if (! start)
+    return EAGAIN;
+  start->start_routine = start_routine;
+  start->arg = arg;
+
+  int res = create(thread, attr, thread_start, start);
+  if (res != 0)
+    free(start);
+
+  return res;
+}
@@ -0,0 +1,309 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "kroki/stats-reader.h"
+#include "stats_reader.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+/*
+  Public reader is the reader of 'kroki-stats' without merging and
+  sorting, plus the scratch buffer of stats_reader_sum().
+*/
+struct kroki_stats_reader
+{
+  struct stats_reader reader;
+  char *filename;
+  intptr_t *scratch;
+  uint32_t scratch_count;
+};
+
+
+struct kroki_stats_reader *
+kroki_stats_reader_open(const char *filename)
+{
+  struct kroki_stats_reader *r = malloc(sizeof(*r));
+  if (! r)
+    return NULL;
+
+  r->filename = strdup(filename);
+  if (! r->filename)
+    {
+      free(r);
+      return NULL;
+    }
+
+  stats_reader_init(&r->reader, r->filename, 0, 0);
+  r->scratch = NULL;
+  r->scratch_count = 0;
+
+  return r;
+}
+
+
+void
+kroki_stats_reader_close(struct kroki_stats_reader *r)
+{
+  stats_reader_close(&r->reader);
+  free(r->scratch);
+  free(r->filename);
+  free(r);
+}
+
+
+int
+kroki_stats_reader_update(struct kroki_stats_reader *r)
+{
+  return stats_reader_update(&r->reader);
+}
+
+
+unsigned int
+kroki_stats_reader_generation(const struct kroki_stats_reader *r)
+{
+  return r->reader.generation;
+}
+
+
+uint32_t
+kroki_stats_reader_value_count(const struct kroki_stats_reader *r)
+{
+  return r->reader.count;
+}
+
+
+size_t
+kroki_stats_reader_slot_count(const struct kroki_stats_reader *r)
+{
+  if (! r->reader.file)
+    return 0;
+
+  return __atomic_load_n(&r->reader.file->slot_count, __ATOMIC_ACQUIRE);
+}
+
+
+const char *
+kroki_stats_reader_name(const struct kroki_stats_reader *r, uint32_t i)
+{
+  return stats_reader_name(&r->reader, i);
+}
+
+
+int
+kroki_stats_reader_kind(const struct kroki_stats_reader *r, uint32_t i)
+{
+  return r->reader.kinds[i];
+}
+
+
+uint32_t
+kroki_stats_reader_width(const struct kroki_stats_reader *r, uint32_t i)
+{
+  return stats_reader_width(&r->reader, i);
+}
+
+
+intptr_t
+kroki_stats_reader_nsec(const struct kroki_stats_reader *r, intptr_t ticks)
+{
+  return stats_reader_nsec(&r->reader, ticks);
+}
+
+
+int
+kroki_stats_reader_snapshot(struct kroki_stats_reader *r,
+                            struct kroki_stats_snapshot *s)
+{
+  struct stats_reader *reader = &r->reader;
+  uint32_t count = reader->count;
+
+  s->ino = reader->ino;
+  s->file_generation = (reader->file ? reader->file->generation : 0);
+  s->generation = reader->generation;
+  s->value_count = count;
+  s->slot_count = 0;
+  if (clock_gettime(CLOCK_MONOTONIC, &s->time) == -1)
+    return -1;
+
+  if (! count)
+    return 0;
+
+  if (r->scratch_count < count)
+    {
+      intptr_t *scratch = realloc(r->scratch, sizeof(*scratch) * count);
+      if (! scratch)
+        return -1;
+      r->scratch = scratch;
+      r->scratch_count = count;
+    }
+
+  // Published totals would not match the values of the threads.
+  reader->aggregated = (! s->values || ! s->tids);
+
+  // stats_reader_sum() swaps the buffers as it goes.
+  intptr_t *total = s->total;
+  intptr_t *next = r->scratch;
+  stats_reader_sum(reader, &total, &next);
+  if (total != s->total)
+    memcpy(s->total, total, sizeof(*total) * count);
+
+  if (! s->values || ! s->tids)
+    return 0;
+
+  long index = -1;
+  while ((index = stats_reader_next_slot(reader, index)) != -1)
+    {
+      // A free slot doesn't need room, read the last one aside.
+      int full = (s->slot_count == s->slot_capacity);
+      intptr_t *values = (full ? r->scratch
+                          : s->values + (size_t) count * s->slot_count);
+      long tid = stats_reader_read_slot(reader, index, values);
+      if (tid <= 0)
+        continue;
+
+      if (full)
+        {
+          errno = ENOBUFS;
+          return -1;
+        }
+      s->tids[s->slot_count++] = tid;
+    }
+
+  return 0;
+}
+
+
+int
+kroki_stats_reader_wait(struct kroki_stats_reader *r, long timeout_ms)
+{
+  return stats_reader_wait_totals(&r->reader, timeout_ms);
+}
+
+
+static
+int
+is_counter(uint8_t kind)
+{
+  switch (kind)
+    {
+    case _KROKI_STATS_KIND_SUM:
+    case _KROKI_STATS_KIND_HIST:
+    case _KROKI_STATS_KIND_TIMER:
+    case _KROKI_STATS_KIND_ARRAY:
+      return 1;
+
+    default:
+      return 0;
+    }
+}
+
+
+static
+void
+diff_values(const struct stats_reader *r, uint32_t count, intptr_t *dst,
+            const intptr_t *prev, uint32_t prev_count, const intptr_t *next)
+{
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      if (prev && i < prev_count && is_counter(r->kinds[i]))
+        dst[i] = next[i] - prev[i];
+      else
+        dst[i] = next[i];
+    }
+}
+
+
+/*
+  Values of thread 'tid' in 's', or NULL.  Threads keep their slots,
+  so they are mostly in the same order in consecutive snapshots, and
+  the search starts after the previous match.
+*/
+static
+const intptr_t *
+find_thread(const struct kroki_stats_snapshot *s, long tid, size_t *hint)
+{
+  for (size_t n = 0; n < s->slot_count; ++n)
+    {
+      size_t k = (*hint + n) % s->slot_count;
+      if (s->tids[k] == tid)
+        {
+          *hint = k + 1;
+          return s->values + (size_t) s->value_count * k;
+        }
+    }
+
+  return NULL;
+}
+
+
+int
+kroki_stats_snapshot_diff(const struct kroki_stats_reader *r,
+                          struct kroki_stats_snapshot *dst,
+                          const struct kroki_stats_snapshot *prev,
+                          const struct kroki_stats_snapshot *next)
+{
+  const struct stats_reader *reader = &r->reader;
+  uint32_t count = next->value_count;
+
+  if (prev->ino != next->ino
+      || prev->file_generation != next->file_generation
+      || prev->value_count > count
+      || next->generation != reader->generation
+      || ! prev->total)
+    {
+      errno = ESTALE;
+      return -1;
+    }
+
+  int threads = (next->values && next->tids && dst->values && dst->tids);
+  if (threads && dst->slot_capacity < next->slot_count)
+    {
+      errno = ENOBUFS;
+      return -1;
+    }
+
+  diff_values(reader, count, dst->total, prev->total, prev->value_count,
+              next->total);
+
+  size_t hint = 0;
+  for (size_t j = 0; threads && j < next->slot_count; ++j)
+    {
+      const intptr_t *prev_values = NULL;
+      if (prev->values && prev->tids)
+        prev_values = find_thread(prev, next->tids[j], &hint);
+      dst->tids[j] = next->tids[j];
+      diff_values(reader, count, dst->values + (size_t) count * j,
+                  prev_values, prev->value_count,
+                  next->values + (size_t) count * j);
+    }
+
+  dst->ino = next->ino;
+  dst->file_generation = next->file_generation;
+  dst->generation = next->generation;
+  dst->value_count = count;
+  dst->slot_count = (threads ? next->slot_count : 0);
+  dst->time = next->time;
+
+  return 0;
+}
@@ -22,14 +22,26 @@
 #endif
 #include "kroki/bits/stats-module.h"
 #include "stats_file.h"
+#include "stats_reader.h"
 #include "pthread_weak.h"
 #include "syscall.h"
 #include <kroki/error.h>
+#ifdef _KROKI_STATS_RSEQ
+#include <sys/rseq.h>
+#endif
 #include <sys/file.h>
+#include <sys/prctl.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include <sys/mman.h>
+#include <linux/futex.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -38,310 +50,2102 @@
 #include <errno.h>
 
 
-#define unlikely(expr)  __builtin_expect(!! (expr), 0)
+#define unlikely(expr)  __builtin_expect(!! (expr), 0)
+
+
+static struct _kroki_stats_module *_kroki_stats_module_head = NULL;
+
+__thread __attribute__((__tls_model__("initial-exec")))
+intptr_t *_kroki_stats_batch_seq = NULL;
+
+__thread __attribute__((__tls_model__("initial-exec")))
+intptr_t _kroki_stats_dynamic_thread_offset = 0;
+
+int _kroki_stats_timer_tsc = 0;
+
+int _kroki_stats_cpu_mode = 0;
+
+static long page_mask;
+static long cache_line_mask;
+static size_t hugepage_size;
+
+/*
+  TSC is calibrated against CLOCK_MONOTONIC_RAW over at least
+  TIMER_CALIBRATION_NSEC since the library was loaded.  Usually that
+  much has passed by the first stats() call, so the wait is free.
+*/
+#define TIMER_CALIBRATION_NSEC  1000000
+
+static uint64_t timer_base_ticks;
+static uint64_t timer_base_nsec;
+
+
+/*
+  The stats file is accessed through a single window that maps the
+  start of the file, so that creating a thread costs neither mmap()
+  nor a new VMA, and records may be walked directly.  The file may
+  not grow beyond the window (nor could it grow beyond 4GB, as
+  offsets in the file are 32-bit): threads and modules that don't
+  fit get private values instead, as do those that don't fit on the
+  file system.
+*/
+#define WINDOW_SIZE  ((size_t) 1 << (sizeof(void *) == 8 ? 30 : 26))
+
+
+/*
+  Storage of thread indices that stay free for over reclaim_idle_sec
+  is given back with FALLOC_FL_PUNCH_HOLE, and free chunks at the end
+  of the file are cut off.  This is checked at most once in a third
+  of that time when some thread starts or exits.  The file is
+  truncated on the first check at least TRUNCATE_DELAY_SEC after the
+  chunks were cut off, however short the idle time is, so that
+  readers that have seen the old slot count (the aggregator thread
+  among them) are done with them and don't get SIGBUS.
+  KROKI_STATS_RECLAIM_SEC in the environment sets the idle time.
+*/
+#define RECLAIM_IDLE_SEC  30
+#define TRUNCATE_DELAY_SEC  5
+
+static long reclaim_idle_sec = RECLAIM_IDLE_SEC;
+
+
+/*
+  File layout is protected by 'lock', as slot creation and
+  destruction are not on a fast path anyway.  Forked processes share
+  the state, so the lock is a robust process-shared mutex: a process
+  that dies holding it doesn't hang the others (see state_lock()).
+  'records_end' and 'slot_count' are published in the file header
+  once the records they cover are complete.
+*/
+struct file_state
+{
+  pthread_mutex_t lock;
+  int fd;
+  uint32_t records_end;
+  uint32_t slot_count;
+  uint32_t segment_count;
+  size_t alloc_size;            /* Allocated size of the file.  */
+  size_t truncate_size;         /* Truncate to on a later reclaim.  */
+  long cut_at;                  /* When truncate_size was set.  */
+  uint32_t cut_count;           /* Times chunks were cut off.  */
+  intptr_t head_free;           /* Index + 1 of the first free run.  */
+  long last_reclaim;
+  uint32_t cpu_count;           /* Per-CPU blocks of every segment.  */
+  size_t page_mask;             /* Page size of the file - 1.  */
+  int hugetlb;                  /* The file is on hugetlbfs.  */
+  int hugepage;                 /* Ask for transparent huge pages.  */
+};
+
+static struct file_state *state = NULL;
+
+static char *window = NULL;
+
+/*
+  Incremented every time a new stats file is opened, threads that
+  got their index in an older file keep using it, but modules they
+  use for the first time get private values.
+*/
+static unsigned int file_generation = 0;
+
+/*
+  Protects the list of modules (which may change with dlopen() and
+  dlclose() at any time) and their segment assignment.  Taken before
+  state lock.
+*/
+static int modules_lock = 0;
+
+static pthread_key_t thread_slot_key;
+
+
+/*
+  Index + 1 of the thread in the stats file, or -1 if the thread has
+  private values only.
+*/
+static __thread __attribute__((__tls_model__("initial-exec")))
+intptr_t slot_index = 0;
+
+static __thread __attribute__((__tls_model__("initial-exec")))
+unsigned int slot_generation;
+
+// Set with stats_set_thread_group(), kept for the slots of new files.
+static __thread __attribute__((__tls_model__("initial-exec")))
+char thread_group[STATS_THREAD_NAME_SIZE];
+
+
+/*
+  Values of modules that can't be put into the stats file (when none
+  is open) are kept in private mappings.
+*/
+struct private_block
+{
+  struct private_block *next;
+  size_t size;
+};
+
+static __thread __attribute__((__tls_model__("initial-exec")))
+struct private_block *private_blocks = NULL;
+
+
+static
+void
+spin_lock(int *lock)
+{
+  while (unlikely(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)))
+    {
+      while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+        sched_yield();
+    }
+}
+
+
+static
+void
+spin_unlock(int *lock)
+{
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+  Allocate the file up to 'end'.  Returns -1 with errno set when the
+  file can't grow that much.
+*/
+static
+int
+extend_file(size_t end)
+{
+  if (end <= state->alloc_size)
+    return 0;
+
+  if (end > WINDOW_SIZE)
+    {
+      errno = EFBIG;
+      return -1;
+    }
+
+  /*
+    Round upward to the next page boundary, in order to avoid
+    invalidation of existing mappings.
+  */
+  size_t total = (end + state->page_mask) & ~state->page_mask;
+  int res = posix_fallocate(state->fd, state->alloc_size,
+                            total - state->alloc_size);
+  if (res != 0)
+    {
+      errno = res;
+      return -1;
+    }
+  state->alloc_size = total;
+  state->truncate_size = 0;
+
+  return 0;
+}
+
+
+static
+char *
+window_map(void)
+{
+  char *map = __atomic_load_n(&window, __ATOMIC_ACQUIRE);
+  if (map)
+    return map;
+
+  /*
+    Mapping beyond the end of file is fine as long as only allocated
+    part is accessed.  Huge pages of hugetlbfs are allocated with the
+    file, and are not reserved for the whole window.  The kernel
+    aligns the window to huge page size by itself when the file may
+    have huge pages.
+  */
+  map = CHECK(mmap(NULL, WINDOW_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | (state->hugetlb ? MAP_NORESERVE : 0),
+                   state->fd, 0),
+              == MAP_FAILED, die, "%m");
+  SYS(madvise(map, WINDOW_SIZE, MADV_DONTFORK));
+  // Transparent huge pages are only a hint, there may be none.
+  if (state->hugepage)
+    (void) madvise(map, WINDOW_SIZE, MADV_HUGEPAGE);
+
+  char *expected = NULL;
+  if (unlikely(! __atomic_compare_exchange_n(&window, &expected, map, 0,
+                                             __ATOMIC_RELEASE,
+                                             __ATOMIC_ACQUIRE)))
+    {
+      // Another thread was first.
+      SYS(munmap(map, WINDOW_SIZE));
+      map = expected;
+    }
+  else if (state->hugetlb)
+    {
+      // Writable mapping of a hugetlbfs file extends it to the window.
+      SYS(ftruncate(state->fd, state->alloc_size));
+    }
+
+  return map;
+}
+
+
+static inline
+struct stats_file *
+file_header(void)
+{
+  return (struct stats_file *) window_map();
+}
+
+
+static inline
+struct stats_record *
+record_at(size_t offset)
+{
+  return (struct stats_record *) (window_map() + offset);
+}
+
+
+static inline
+const uint8_t *
+segment_kinds(const struct stats_segment *segment)
+{
+  return (const uint8_t *) (segment->data + segment->value_count);
+}
+
+
+static inline
+struct thread_slot *
+chunk_block(struct stats_chunk *chunk, uint32_t block_size, uint32_t index)
+{
+  return (struct thread_slot *)
+    ((char *) chunk + chunk->block_offset
+     + (size_t) block_size * (index - chunk->first_index));
+}
+
+
+static inline
+struct stats_thread_info *
+chunk_info(struct stats_chunk *chunk, uint32_t index)
+{
+  return ((struct stats_thread_info *) (chunk + 1)
+          + (index - chunk->first_index));
+}
+
+
+static
+void
+thread_slot_reset(struct thread_slot *slot,
+                  const struct stats_segment *segment)
+{
+  const uint8_t *kinds = segment_kinds(segment);
+  slot->batch_seq = 0;
+  for (uint32_t i = 0; i < segment->value_count; ++i)
+    slot->values[i] = stats_kind_initial_value(kinds[i]);
+}
+
+
+static
+uint64_t
+now_raw_nsec(void)
+{
+  struct timespec ts;
+  SYS(clock_gettime(CLOCK_MONOTONIC_RAW, &ts));
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static inline
+uint64_t
+read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+
+static
+void
+timer_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  /*
+    Use TSC only when the kernel trusts it for its own clock: then it
+    runs at a constant rate and is synchronized across CPUs.
+  */
+  FILE *fp =
+    fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource",
+          "r");
+  if (! fp)
+    return;
+
+  char clocksource[16];
+  if (fgets(clocksource, sizeof(clocksource), fp)
+      && strcmp(clocksource, "tsc\n") == 0)
+    {
+      timer_base_nsec = now_raw_nsec();
+      timer_base_ticks = read_tsc();
+      _kroki_stats_timer_tsc = 1;
+    }
+
+  SYS(fclose(fp));
+#endif
+}
+
+
+static
+uint64_t
+timer_frequency(void)
+{
+  if (! _kroki_stats_timer_tsc)
+    return 1000000000;
+
+  uint64_t nsec, ticks;
+  do
+    {
+      nsec = now_raw_nsec() - timer_base_nsec;
+      ticks = read_tsc() - timer_base_ticks;
+    }
+  while (nsec < TIMER_CALIBRATION_NSEC);
+
+  return (double) ticks * 1000000000 / nsec + 0.5;
+}
+
+
+static
+size_t
+file_header_size(void)
+{
+  return ((sizeof(struct stats_file) + cache_line_mask) & ~cache_line_mask);
+}
+
+
+/*
+  The header is allocated when the file is opened, so this doesn't
+  fail.  Called under state lock.
+*/
+static
+void
+init_file(void)
+{
+  size_t header_size = file_header_size();
+  file_header()->magic = STATS_FILE_MAGIC;
+  file_header()->version = STATS_FILE_VERSION;
+  file_header()->record_offset = header_size;
+  file_header()->timer_frequency = timer_frequency();
+  struct timespec now;
+  SYS(clock_gettime(CLOCK_REALTIME, &now));
+  file_header()->generation = ((uint64_t) now.tv_sec * 1000000000
+                               + now.tv_nsec);
+  file_header()->cpu_count = state->cpu_count;
+  state->records_end = header_size;
+}
+
+
+/*
+  Make appended records and new thread indices visible to readers.
+  Called under state lock.
+*/
+static
+void
+publish(void)
+{
+  struct stats_file *file = file_header();
+  // Synchronize with ACQUIRE in stats_reader.c.
+  __atomic_store_n(&file->records_end, state->records_end, __ATOMIC_RELEASE);
+  __atomic_store_n(&file->slot_count, state->slot_count, __ATOMIC_RELEASE);
+}
+
+
+/*
+  Returns NULL with errno set when the file can't grow.  Called under
+  state lock.
+*/
+static
+struct stats_record *
+append_record(uint32_t type, size_t size)
+{
+  size_t offset = state->records_end;
+  if (extend_file(offset + size) == -1)
+    return NULL;
+  state->records_end = offset + size;
+
+  struct stats_record *record = record_at(offset);
+  record->type = type;
+  record->size = size;
+
+  return record;
+}
+
+
+/*
+  Names registered at run time with stats_lookup() are the values of
+  a module of the library itself, so that stats_h() is the same
+  thread-local offset add as stats().  The module is registered on
+  the first lookup and has room for DYNAMIC_VALUES counters, the
+  values start with empty names that name records fill in.  A handle
+  is the address of the name reference of its value.
+*/
+#define DYNAMIC_VALUES  256
+#define DYNAMIC_NAME_MAX  255
+
+static const char dynamic_empty_name[] = "";
+
+static const char *const dynamic_name_refs[DYNAMIC_VALUES] = {
+  [0 ... DYNAMIC_VALUES - 1] = dynamic_empty_name
+};
+
+static const uint8_t dynamic_kinds[DYNAMIC_VALUES];
+
+// Protected by modules lock.
+static char *dynamic_names[DYNAMIC_VALUES];
+static uint32_t dynamic_count = 0;
+
+
+static
+intptr_t *
+dynamic_thread_offset(void)
+{
+  return &_kroki_stats_dynamic_thread_offset;
+}
+
+
+static struct _kroki_stats_module dynamic_module = {
+  .thread_offset = dynamic_thread_offset,
+  .name_refs = dynamic_name_refs,
+  // Handles are the name references, the offset is checked for zero.
+  .scratch = (char *) dynamic_name_refs,
+  .kinds = dynamic_kinds,
+  .names_size = sizeof(dynamic_empty_name),
+  .value_count = DYNAMIC_VALUES
+};
+
+
+static
+size_t
+name_record_size(uint32_t value)
+{
+  return ((offsetof(struct stats_name, name) + strlen(dynamic_names[value]) + 1
+           + cache_line_mask) & ~cache_line_mask);
+}
+
+
+/*
+  Returns -1 with errno set when the file can't grow.  Called under
+  modules lock and state lock.
+*/
+static
+int
+append_name(uint32_t value)
+{
+  const char *name = dynamic_names[value];
+  struct stats_name *record = (struct stats_name *)
+    append_record(STATS_RECORD_NAME, name_record_size(value));
+  if (! record)
+    return -1;
+  record->segment = dynamic_module.segment;
+  record->value = dynamic_module.value_offset + value;
+  memcpy(record->name, name, strlen(name) + 1);
+
+  return 0;
+}
+
+
+/*
+  Append a segment for the modules that don't have one in the file
+  yet.  Returns -1 with errno set when the file can't grow, then the
+  modules stay without a segment.  Called under modules lock and
+  state lock.
+*/
+static
+int
+append_segment(void)
+{
+  size_t names_size = 0;
+  uint32_t count = 0;
+  int unassigned = 0;
+  struct _kroki_stats_module *module = _kroki_stats_module_head;
+  while (module)
+    {
+      if (module->segment == -1)
+        {
+          names_size += module->names_size;
+          count += module->value_count;
+          unassigned = 1;
+        }
+      module = module->next;
+    }
+  if (! unassigned)
+    return 0;
+
+  // Modules without values don't need a segment unless it's the first.
+  if (count == 0 && state->segment_count > 0)
+    {
+      for (module = _kroki_stats_module_head; module; module = module->next)
+        {
+          if (module->segment == -1)
+            {
+              module->segment = 0;
+              module->value_offset = 0;
+            }
+        }
+      return 0;
+    }
+
+  size_t header_size = ((offsetof(struct stats_segment, data)
+                         + (sizeof(uint32_t) + sizeof(uint8_t)) * count
+                         + names_size + cache_line_mask) & ~cache_line_mask);
+  uint32_t block_size = ((sizeof(struct thread_slot) + sizeof(intptr_t) * count
+                          + cache_line_mask) & ~cache_line_mask);
+
+  size_t segment_size = (header_size
+                         + (size_t) block_size * (1 + state->cpu_count
+                                                  + STATS_TOTALS_BLOCKS));
+
+  // Names of the dynamic module follow its segment right away.
+  size_t names_end = state->records_end + segment_size;
+  if (dynamic_module.segment == -1)
+    {
+      for (uint32_t i = 0; i < dynamic_count; ++i)
+        names_end += name_record_size(i);
+    }
+  if (extend_file(names_end) == -1)
+    return -1;
+
+  struct stats_segment *segment = (struct stats_segment *)
+    append_record(STATS_RECORD_SEGMENT, segment_size);
+
+  /*
+    Values of stats_hot() of all modules go first, so that they share
+    the first cache lines of the block.
+  */
+  uint32_t *name_ref = segment->data;
+  uint8_t *kind = (uint8_t *) (name_ref + count);
+  char *name = (char *) (kind + count);
+  size_t offset = name - (char *) segment->data;
+  uint32_t value_offset = 0;
+  for (int hot = 1; hot >= 0; --hot)
+    {
+      for (module = _kroki_stats_module_head; module; module = module->next)
+        {
+          if (module->segment != -1 || module->hot != hot)
+            continue;
+
+          module->segment = state->segment_count;
+          module->value_offset = value_offset;
+          if (! module->value_count)
+            continue;
+
+          memcpy(name, module->name_refs[0], module->names_size);
+          for (uint32_t i = 0; i < module->value_count; ++i)
+            *name_ref++ = (offset
+                           + (module->name_refs[i] - module->name_refs[0]));
+          memcpy(kind, module->kinds, module->value_count);
+          kind += module->value_count;
+          name += module->names_size;
+          offset += module->names_size;
+          value_offset += module->value_count;
+        }
+    }
+
+  segment->value_count = count;
+  segment->block_size = block_size;
+  segment->retired_offset = header_size;
+  for (uint32_t i = 0; i <= state->cpu_count; ++i)
+    thread_slot_reset((struct thread_slot *)
+                      ((char *) segment + header_size
+                       + (size_t) block_size * i),
+                      segment);
+
+  if (dynamic_module.segment == (int32_t) state->segment_count)
+    {
+      for (uint32_t i = 0; i < dynamic_count; ++i)
+        (void) append_name(i);
+    }
+
+  ++state->segment_count;
+
+  return 0;
+}
+
+
+/*
+  Offsets of the segment records and of their chunks by first_index /
+  STATS_CHUNK_SLOTS (0 when there's none), like the reader keeps
+  them, so that finding a block doesn't walk all the records.  Forked
+  processes share the file state, so the index is per-process and
+  every process picks up the records that others appended when it
+  looks for a block.  Accessed under state lock.
+*/
+struct index_segment
+{
+  uint32_t offset;
+  uint32_t chunk_count;
+  uint32_t *chunks;
+};
+
+struct record_index
+{
+  unsigned int generation;      /* file_generation it is for.  */
+  uint32_t cut_count;           /* state->cut_count it is for.  */
+  uint32_t records_end;         /* Records before it are indexed.  */
+  uint32_t segment_count;
+  uint32_t segment_alloc;       /* Entries that have 'chunks'.  */
+  struct index_segment *segments;
+};
+
+static struct record_index record_index;
+
+
+static
+int
+index_segment_add(uint32_t offset)
+{
+  uint32_t s = record_index.segment_count;
+  if (s == record_index.segment_alloc)
+    {
+      struct index_segment *segments =
+        realloc(record_index.segments, sizeof(*segments) * (s + 1));
+      if (! segments)
+        return -1;
+      segments[s] = (struct index_segment) { 0 };
+      record_index.segments = segments;
+      ++record_index.segment_alloc;
+    }
+  record_index.segments[s].offset = offset;
+  ++record_index.segment_count;
+
+  return 0;
+}
+
+
+static
+int
+index_chunk_add(uint32_t offset)
+{
+  const struct stats_chunk *chunk = (const struct stats_chunk *)
+    record_at(offset);
+  struct index_segment *segment = &record_index.segments[chunk->segment];
+  uint32_t c = chunk->first_index / STATS_CHUNK_SLOTS;
+  if (c >= segment->chunk_count)
+    {
+      uint32_t chunk_count = (c + 1) * 2;
+      uint32_t *chunks = realloc(segment->chunks,
+                                 sizeof(*chunks) * chunk_count);
+      if (! chunks)
+        return -1;
+      memset(chunks + segment->chunk_count, 0,
+             sizeof(*chunks) * (chunk_count - segment->chunk_count));
+      segment->chunks = chunks;
+      segment->chunk_count = chunk_count;
+    }
+  segment->chunks[c] = offset;
+
+  return 0;
+}
+
+
+/*
+  Index the records appended since the last call, or all of them anew
+  when chunks were cut off.  Returns -1 with errno set when out of
+  memory, then the records that follow stay unindexed.  Called under
+  state lock.
+*/
+static
+int
+index_records(void)
+{
+  if (record_index.generation != file_generation)
+    {
+      for (uint32_t s = 0; s < record_index.segment_alloc; ++s)
+        free(record_index.segments[s].chunks);
+      free(record_index.segments);
+      record_index = (struct record_index) {
+        .generation = file_generation,
+        .cut_count = state->cut_count
+      };
+    }
+  else if (record_index.cut_count != state->cut_count)
+    {
+      // Offsets of the chunks that were cut off may be reused.
+      for (uint32_t s = 0; s < record_index.segment_alloc; ++s)
+        {
+          struct index_segment *segment = &record_index.segments[s];
+          memset(segment->chunks, 0,
+                 sizeof(*segment->chunks) * segment->chunk_count);
+        }
+      record_index.cut_count = state->cut_count;
+      record_index.records_end = 0;
+      record_index.segment_count = 0;
+    }
+
+  if (! record_index.records_end)
+    record_index.records_end = file_header()->record_offset;
+
+  while (record_index.records_end < state->records_end)
+    {
+      uint32_t offset = record_index.records_end;
+      const struct stats_record *record = record_at(offset);
+      if (record->type == STATS_RECORD_SEGMENT)
+        {
+          if (index_segment_add(offset) == -1)
+            return -1;
+        }
+      else if (record->type == STATS_RECORD_CHUNK)
+        {
+          if (index_chunk_add(offset) == -1)
+            return -1;
+        }
+      record_index.records_end = offset + record->size;
+    }
+
+  return 0;
+}
+
+
+/*
+  Segment record 'segment_index', NULL if it's not indexed.  Called
+  under state lock.
+*/
+static
+struct stats_segment *
+segment_at(uint32_t segment_index)
+{
+  (void) index_records();
+  if (segment_index >= record_index.segment_count)
+    return NULL;
+
+  return (struct stats_segment *)
+    record_at(record_index.segments[segment_index].offset);
+}
+
+
+/*
+  Indexed chunk of thread 'index' in a given segment, NULL if there's
+  none.  Called under state lock after index_records().
+*/
+static
+struct stats_chunk *
+chunk_at(uint32_t segment_index, uint32_t index)
+{
+  if (segment_index >= record_index.segment_count)
+    return NULL;
+
+  const struct index_segment *segment =
+    &record_index.segments[segment_index];
+  uint32_t c = index / STATS_CHUNK_SLOTS;
+  if (c >= segment->chunk_count || ! segment->chunks[c])
+    return NULL;
+
+  return (struct stats_chunk *) record_at(segment->chunks[c]);
+}
+
+
+/*
+  Chunk of thread 'index' in a given segment.  When the segment has
+  no chunk for the index yet a new chunk is appended if 'create' is
+  set, otherwise NULL is returned (as it is when the file can't grow
+  or the chunk can't be indexed).  Called under state lock.
+*/
+static
+struct stats_chunk *
+segment_chunk(uint32_t segment_index, uint32_t index, int create,
+              struct stats_segment **psegment)
+{
+  uint32_t first_index = index - index % STATS_CHUNK_SLOTS;
+  struct stats_segment *segment = segment_at(segment_index);
+  struct stats_chunk *chunk = chunk_at(segment_index, index);
+
+  if (psegment)
+    *psegment = segment;
+
+  if (! chunk)
+    {
+      // A chunk that isn't indexed may be in the file already.
+      if (! create || ! segment
+          || record_index.records_end != state->records_end)
+        return NULL;
+
+      size_t info_size = (segment_index == 0
+                          ? sizeof(struct stats_thread_info) * STATS_CHUNK_SLOTS
+                          : 0);
+      size_t block_offset = ((sizeof(struct stats_chunk) + info_size
+                              + cache_line_mask) & ~cache_line_mask);
+      chunk = (struct stats_chunk *)
+        append_record(STATS_RECORD_CHUNK,
+                      (block_offset
+                       + (size_t) segment->block_size * STATS_CHUNK_SLOTS));
+      if (! chunk)
+        return NULL;
+      chunk->segment = segment_index;
+      chunk->first_index = first_index;
+      chunk->block_offset = block_offset;
+    }
+
+  return chunk;
+}
+
+
+/*
+  Block of thread 'index' in a given segment, as with segment_chunk().
+  Called under state lock.
+*/
+static
+struct thread_slot *
+segment_block(uint32_t segment_index, uint32_t index, int create,
+              struct stats_segment **psegment)
+{
+  struct stats_segment *segment;
+  struct stats_chunk *chunk = segment_chunk(segment_index, index, create,
+                                            &segment);
+  if (psegment)
+    *psegment = segment;
+  if (! chunk)
+    return NULL;
+
+  return chunk_block(chunk, segment->block_size, index);
+}
+
+
+/*
+  Identity of the calling thread that got 'index'.  Called under
+  state lock.
+*/
+static
+void
+thread_info_write(uint32_t index)
+{
+  struct stats_thread_info *info =
+    chunk_info(segment_chunk(0, index, 0, NULL), index);
+  info->pid = getpid();
+  char comm[STATS_THREAD_NAME_SIZE] = "";
+  (void) prctl(PR_GET_NAME, comm);
+  memcpy(info->comm, comm, sizeof(info->comm));
+  memcpy(info->group, thread_group, sizeof(info->group));
+}
+
+
+/*
+  Free thread indices are kept in a list of runs of adjacent indices.
+  The block of the first index of a run in the first segment holds
+  the link, the time the run was freed and the number of indices in
+  the run, the rest of an idle run is a hole.
+*/
+struct free_run
+{
+  intptr_t next_free;           /* Overlays thread_slot.  */
+  intptr_t freed_at;
+  intptr_t slot_count;
+};
+
+
+static
+long
+now_sec(void)
+{
+  struct timespec ts;
+  SYS(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts));
+  return ts.tv_sec;
+}
+
+
+// Called under state lock.
+static
+void
+free_list_push(struct thread_slot *slot, uint32_t index)
+{
+  struct free_run *run = (struct free_run *) slot;
+  __atomic_store_n(&run->next_free, state->head_free, __ATOMIC_RELEASE);
+  run->freed_at = now_sec();
+  run->slot_count = 1;
+  state->head_free = index + 1;
+}
+
+
+// Called under state lock.
+static
+struct thread_slot *
+free_list_pop(uint32_t *index)
+{
+  if (! state->head_free)
+    return NULL;
+
+  *index = state->head_free - 1;
+  struct thread_slot *slot = segment_block(0, *index, 0, NULL);
+  // Runs this process can't index are left for the others.
+  if (! slot)
+    return NULL;
+  struct free_run *run = (struct free_run *) slot;
+  if (run->slot_count > 1)
+    {
+      // The rest of the run starts with the next index.
+      struct free_run *next = (struct free_run *)
+        segment_block(0, *index + 1, 0, NULL);
+      if (! next)
+        return NULL;
+      next->next_free = run->next_free;
+      next->freed_at = run->freed_at;
+      next->slot_count = run->slot_count - 1;
+      state->head_free = *index + 2;
+    }
+  else
+    {
+      state->head_free = run->next_free;
+    }
+
+  return slot;
+}
+
+
+static
+void
+punch_hole(size_t start, size_t end)
+{
+  start = (start + state->page_mask) & ~state->page_mask;
+  end &= ~state->page_mask;
+  if (start >= end)
+    return;
+
+  // On error the storage is simply not given back.
+  (void) fallocate(state->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   start, end - start);
+}
+
+
+/*
+  Give back the storage of the blocks of a run of free indices in all
+  segments, but for the run header when 'keep_header' is set.  Called
+  under state lock.
+*/
+static
+void
+punch_run(uint32_t first, uint32_t count, int keep_header)
+{
+  (void) index_records();
+  for (uint32_t s = 0; s < record_index.segment_count; ++s)
+    {
+      uint32_t block_size = segment_at(s)->block_size;
+      uint32_t first_index = first - first % STATS_CHUNK_SLOTS;
+      for (; first_index < first + count; first_index += STATS_CHUNK_SLOTS)
+        {
+          struct stats_chunk *chunk = chunk_at(s, first_index);
+          if (! chunk)
+            continue;
+
+          uint32_t lo = first_index;
+          uint32_t hi = first_index + STATS_CHUNK_SLOTS;
+          if (lo < first)
+            lo = first;
+          if (hi > first + count)
+            hi = first + count;
+
+          size_t start = (char *) chunk_block(chunk, block_size, lo) - window;
+          size_t end = (char *) chunk_block(chunk, block_size, hi) - window;
+          if (keep_header && s == 0 && lo == first)
+            start += sizeof(struct free_run);
+          punch_hole(start, end);
+        }
+    }
+}
+
+
+/*
+  Cut off chunks at the end of the file that hold only indices from
+  'slot_count' on.  Called under state lock.
+*/
+static
+void
+cut_records(void)
+{
+  struct stats_file *file = file_header();
+  size_t records_end = state->records_end;
+  while (1)
+    {
+      size_t last = 0;
+      size_t offset = file->record_offset;
+      while (offset < records_end)
+        {
+          last = offset;
+          offset += record_at(offset)->size;
+        }
+
+      struct stats_chunk *chunk = (struct stats_chunk *) record_at(last);
+      if (! last
+          || chunk->record.type != STATS_RECORD_CHUNK
+          || chunk->first_index < state->slot_count)
+        break;
+
+      records_end = last;
+    }
+  if (records_end == state->records_end)
+    return;
+
+  state->records_end = records_end;
+  ++state->cut_count;
+  __atomic_store_n(&file->records_end, records_end, __ATOMIC_RELEASE);
+  // Synchronize with ACQUIRE in stats_reader.c.
+  __atomic_store_n(&file->cut_count, file->cut_count + 1, __ATOMIC_RELEASE);
+
+  // Appended records expect zeroes.
+  size_t end = (records_end + state->page_mask) & ~state->page_mask;
+  memset(window_map() + records_end, 0, end - records_end);
+  if (end < state->alloc_size)
+    {
+      punch_hole(end, state->alloc_size);
+      state->alloc_size = end;
+      state->truncate_size = end;
+      state->cut_at = now_sec();
+    }
+}
+
+
+/*
+  The owner of the state lock died in the middle of a change.  Records
+  and indices it didn't publish are dropped, and so is the free list,
+  which it may have left half-linked (free indices are never reused
+  then).  Values of a thread it was folding may be counted in part.
+  Called under state lock.
+*/
+static
+void
+state_recover(void)
+{
+  struct stats_file *file = file_header();
+  uint32_t records_end = __atomic_load_n(&file->records_end,
+                                         __ATOMIC_RELAXED);
+  if (records_end && records_end < state->records_end)
+    {
+      // Appended records expect zeroes.
+      memset(window_map() + records_end, 0,
+             state->records_end - records_end);
+    }
+  state->records_end = records_end;
+  state->slot_count = __atomic_load_n(&file->slot_count, __ATOMIC_RELAXED);
+  state->head_free = 0;
+
+  // Every process indexes the records anew.
+  ++state->cut_count;
+  if (index_records() == 0)
+    state->segment_count = record_index.segment_count;
+
+  intptr_t seq = __atomic_load_n(&file->retired_seq, __ATOMIC_RELAXED);
+  if (seq & 1)
+    __atomic_store_n(&file->retired_seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+
+static
+void
+state_lock(void)
+{
+  int res = pthread_mutex_lock(&state->lock);
+  if (unlikely(res == EOWNERDEAD))
+    {
+      state_recover();
+      POSIX(pthread_mutex_consistent(&state->lock));
+    }
+  else
+    {
+      POSIX(res);
+    }
+}
+
+
+static
+void
+state_unlock(void)
+{
+  POSIX(pthread_mutex_unlock(&state->lock));
+}
+
+
+struct run
+{
+  uint32_t index;
+  uint32_t slot_count;
+  long freed_at;
+};
+
+
+static
+int
+run_compare(const void *a, const void *b)
+{
+  const struct run *r1 = a;
+  const struct run *r2 = b;
+  return (r1->index > r2->index) - (r1->index < r2->index);
+}
+
+
+/*
+  Coalesce idle free indices into runs and give back their storage,
+  cut off the runs at the end.  Called under state lock.
+*/
+static
+void
+reclaim(void)
+{
+  long now = now_sec();
+  if (now - state->last_reclaim < reclaim_idle_sec / 3)
+    return;
+  state->last_reclaim = now;
+
+  if (state->truncate_size && now - state->cut_at >= TRUNCATE_DELAY_SEC)
+    {
+      // On error the storage is simply not given back.
+      (void) ftruncate(state->fd, state->truncate_size);
+      state->truncate_size = 0;
+    }
+
+  size_t count = 0;
+  intptr_t next = state->head_free;
+  while (next)
+    {
+      const struct free_run *run = (const struct free_run *)
+        segment_block(0, next - 1, 0, NULL);
+      if (! run)
+        return;
+      next = run->next_free;
+      ++count;
+    }
+  if (! count)
+    return;
+
+  struct run *runs = malloc(sizeof(*runs) * count);
+  if (! runs)
+    return;
+
+  next = state->head_free;
+  for (size_t i = 0; i < count; ++i)
+    {
+      const struct free_run *run = (const struct free_run *)
+        segment_block(0, next - 1, 0, NULL);
+      runs[i] = (struct run) {
+        .index = next - 1,
+        .slot_count = run->slot_count,
+        .freed_at = run->freed_at
+      };
+      next = run->next_free;
+    }
+
+  qsort(runs, count, sizeof(*runs), run_compare);
+
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i)
+    {
+      struct run *prev = (n > 0 ? &runs[n - 1] : NULL);
+      if (prev
+          && now - prev->freed_at >= reclaim_idle_sec
+          && now - runs[i].freed_at >= reclaim_idle_sec
+          && prev->index + prev->slot_count == runs[i].index)
+        {
+          prev->slot_count += runs[i].slot_count;
+          if (prev->freed_at < runs[i].freed_at)
+            prev->freed_at = runs[i].freed_at;
+        }
+      else
+        {
+          runs[n++] = runs[i];
+        }
+    }
+
+  struct run *last = &runs[n - 1];
+  if (now - last->freed_at >= reclaim_idle_sec
+      && last->index + last->slot_count == state->slot_count)
+    {
+      /*
+        Readers stop at the new slot count right away, the chunks are
+        cut off next, and the file is truncated on the next reclaim.
+      */
+      if (! state->hugetlb)
+        punch_run(last->index, last->slot_count, 0);
+      state->slot_count = last->index;
+      __atomic_store_n(&file_header()->slot_count, state->slot_count,
+                       __ATOMIC_RELEASE);
+      cut_records();
+      --n;
+    }
+
+  /*
+    Hugetlbfs doesn't report holes, so the reader would fault huge
+    pages back in when it checks free indices.  Only the chunks at the
+    end are cut off there.
+  */
+  next = 0;
+  for (size_t i = n; i-- > 0; )
+    {
+      if (now - runs[i].freed_at >= reclaim_idle_sec && ! state->hugetlb)
+        punch_run(runs[i].index, runs[i].slot_count, 1);
+
+      // Lower indices are reused first.
+      struct free_run *run = (struct free_run *)
+        segment_block(0, runs[i].index, 0, NULL);
+      run->next_free = next;
+      run->freed_at = runs[i].freed_at;
+      run->slot_count = runs[i].slot_count;
+      next = runs[i].index + 1;
+    }
+  state->head_free = next;
+
+  free(runs);
+}
+
+
+static
+void
+thread_slot_fold(struct thread_slot *retired, const struct thread_slot *slot,
+                 const struct stats_segment *segment)
+{
+  const uint8_t *kinds = segment_kinds(segment);
+  for (uint32_t i = 0; i < segment->value_count; ++i)
+    {
+      intptr_t value = slot->values[i];
+      intptr_t *dst = &retired->values[i];
+      intptr_t total = __atomic_load_n(dst, __ATOMIC_RELAXED);
+      switch (kinds[i])
+        {
+        case _KROKI_STATS_KIND_MAX:
+          if (total < value)
+            __atomic_store_n(dst, value, __ATOMIC_RELAXED);
+          break;
+
+        case _KROKI_STATS_KIND_MIN:
+          if (total > value)
+            __atomic_store_n(dst, value, __ATOMIC_RELAXED);
+          break;
+
+        case _KROKI_STATS_KIND_LAST:
+          // Last value set by a thread that is gone means nothing.
+          break;
+
+        default:
+          __atomic_store_n(dst, total + value, __ATOMIC_RELAXED);
+          break;
+        }
+    }
+}
+
+
+/*
+  Fold values of the exiting thread into the retired blocks and free
+  its index.  Both are done under retired_seq, so that the reader
+  never sees the values twice or not at all.  The state lock
+  serializes the writers of retired_seq.
+*/
+static
+void
+thread_slot_retire(uint32_t index)
+{
+  struct stats_file *file = file_header();
+
+  state_lock();
+
+  intptr_t seq = __atomic_load_n(&file->retired_seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&file->retired_seq, seq + 1, __ATOMIC_RELAXED);
+  // Order the store of odd sequence before the stores below.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  intptr_t tid_neg = -gettid();
+  struct thread_slot *first = NULL;
+  // Chunks of the thread were indexed when it got them.
+  (void) index_records();
+  for (uint32_t s = 0; s < record_index.segment_count; ++s)
+    {
+      struct stats_chunk *chunk = chunk_at(s, index);
+      if (! chunk)
+        continue;
+
+      struct stats_segment *segment = segment_at(s);
+      struct thread_slot *slot = chunk_block(chunk, segment->block_size,
+                                             index);
+      if (slot->tid_neg != tid_neg)
+        continue;
+
+      thread_slot_fold((struct thread_slot *)
+                       ((char *) segment + segment->retired_offset),
+                       slot, segment);
+      if (s == 0)
+        first = slot;
+      else
+        __atomic_store_n(&slot->tid_neg, 0, __ATOMIC_RELAXED);
+    }
+
+  if (first)
+    free_list_push(first, index);
+  reclaim();
+
+  __atomic_store_n(&file->retired_seq, seq + 2, __ATOMIC_RELEASE);
+
+  state_unlock();
+}
+
+
+static
+void
+thread_slot_destroy(void *arg)
+{
+  (void) arg;
+
+  if (slot_index > 0 && slot_generation == file_generation)
+    thread_slot_retire(slot_index - 1);
+
+  while (private_blocks)
+    {
+      struct private_block *block = private_blocks;
+      private_blocks = block->next;
+      SYS(munmap(block, block->size));
+    }
+}
+
+
+/*
+  Attach the modules that the calling thread doesn't use yet to the
+  stats file.  Returns -1 if some of them were left unattached
+  because the file can't grow.  Called under modules lock.
+*/
+static
+int
+attach_file(void)
+{
+  intptr_t tid_neg = -gettid();
+  int res = 0;
+
+  state_lock();
+
+  if (unlikely(! state->records_end))
+    init_file();
+
+  if (append_segment() == -1)
+    res = -1;
+
+  reclaim();
+
+  if (! slot_index)
+    {
+      struct stats_segment *segment;
+      uint32_t index;
+      struct thread_slot *slot = free_list_pop(&index);
+      if (slot)
+        {
+          segment_block(0, index, 0, &segment);
+        }
+      else if (state->segment_count > 0)
+        {
+          index = state->slot_count;
+          slot = segment_block(0, index, 1, &segment);
+          if (slot)
+            ++state->slot_count;
+        }
+
+      if (! slot)
+        {
+          publish();
+          state_unlock();
+          return -1;
+        }
+
+      thread_slot_reset(slot, segment);
+      thread_info_write(index);
+      // Synchronize with ACQUIRE in stats_reader.c.
+      __atomic_store_n(&slot->tid_neg, tid_neg, __ATOMIC_RELEASE);
+
+      slot_index = index + 1;
+      slot_generation = file_generation;
+      _kroki_stats_batch_seq = &slot->batch_seq;
+    }
+
+  uint32_t index = slot_index - 1;
+  const struct _kroki_stats_module *module = _kroki_stats_module_head;
+  for (; module; module = module->next)
+    {
+      if (*module->thread_offset())
+        continue;
+
+      struct stats_segment *segment;
+      struct thread_slot *slot = (module->segment == -1
+                                  ? NULL
+                                  : segment_block(module->segment, index, 1,
+                                                  &segment));
+      if (! slot)
+        {
+          res = -1;
+          continue;
+        }
+      if (slot->tid_neg != tid_neg)
+        {
+          thread_slot_reset(slot, segment);
+          __atomic_store_n(&slot->tid_neg, tid_neg, __ATOMIC_RELEASE);
+        }
+
+      *module->thread_offset() =
+        ((char *) &slot->values[module->value_offset]
+         - module->scratch);
+    }
+
+  publish();
+
+  state_unlock();
+
+  return res;
+}
+
+
+/*
+  Give private values to the modules that the calling thread doesn't
+  use yet.  Called under modules lock.
+*/
+static
+void
+attach_private(void)
+{
+  uint32_t count = 0;
+  const struct _kroki_stats_module *module = _kroki_stats_module_head;
+  for (; module; module = module->next)
+    {
+      if (! *module->thread_offset())
+        count += module->value_count;
+    }
+
+  size_t size = (sizeof(struct private_block) + sizeof(struct thread_slot)
+                 + sizeof(intptr_t) * count);
+  struct private_block *block =
+    CHECK(mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+          == MAP_FAILED, die, "%m");
+  SYS(madvise(block, size, MADV_DONTFORK));
+  block->size = size;
+  block->next = private_blocks;
+  private_blocks = block;
+
+  struct thread_slot *slot = (struct thread_slot *) (block + 1);
+  intptr_t *value = slot->values;
+  for (module = _kroki_stats_module_head; module; module = module->next)
+    {
+      if (*module->thread_offset())
+        continue;
+
+      for (uint32_t i = 0; i < module->value_count; ++i)
+        value[i] = stats_kind_initial_value(module->kinds[i]);
+      *module->thread_offset() = (char *) value - module->scratch;
+      value += module->value_count;
+    }
+
+  if (! _kroki_stats_batch_seq)
+    _kroki_stats_batch_seq = &slot->batch_seq;
+  if (! slot_index)
+    slot_index = -1;
+}
+
+
+void
+_kroki_stats_thread_slot_create(void)
+{
+  int save_cancelstate;
+  POSIX(pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &save_cancelstate));
+
+  spin_lock(&modules_lock);
+
+  // Modules that don't fit into the file get private values.
+  if (! state
+      || (slot_index != 0
+          && (slot_index < 0 || slot_generation != file_generation))
+      || attach_file() == -1)
+    attach_private();
+
+  spin_unlock(&modules_lock);
+
+  /*
+    Despite the use of __thread we still need pthread_setspecific() to
+    arrange the call to thread_slot_destroy() on thread termination.
+  */
+  POSIX(pthread_setspecific(thread_slot_key, &slot_index));
+
+  // Glibc allows NULL for 'oldstate'.
+  POSIX(pthread_setcancelstate(save_cancelstate, NULL));
+}
+
+
+void
+kroki_stats_set_thread_group(const char *group)
+{
+  // The last byte stays NUL.
+  strncpy(thread_group, group, sizeof(thread_group) - 1);
+
+  if (slot_index > 0 && slot_generation == file_generation)
+    {
+      uint32_t index = slot_index - 1;
+      state_lock();
+      struct stats_chunk *chunk = segment_chunk(0, index, 0, NULL);
+      if (chunk)
+        memcpy(chunk_info(chunk, index)->group, thread_group,
+               sizeof(thread_group));
+      state_unlock();
+    }
+}
+
+
+/*
+  Number of CPUs that may ever be online, so that any CPU id the
+  kernel reports is below it.
+*/
+static
+uint32_t
+possible_cpus(void)
+{
+  uint32_t count = 0;
+  FILE *fp = fopen("/sys/devices/system/cpu/possible", "r");
+  if (fp)
+    {
+      // A list of ranges like "0-3,8-11", the last number is the highest.
+      unsigned int cpu;
+      while (fscanf(fp, "%u", &cpu) == 1)
+        {
+          count = cpu + 1;
+          if (fgetc(fp) == EOF)
+            break;
+        }
+      SYS(fclose(fp));
+    }
+  if (! count)
+    count = SYS(sysconf(_SC_NPROCESSORS_CONF));
+
+  return count;
+}
+
+
+/*
+  Offsets of the per-CPU blocks of the module.  Returns -1 if the
+  module has no segment because the file can't grow (or the segment
+  can't be indexed).  Called under modules lock.
+*/
+static
+int
+cpu_offsets_fill(const struct _kroki_stats_module *module, intptr_t *offsets)
+{
+  state_lock();
+
+  if (unlikely(! state->records_end))
+    init_file();
+
+  struct stats_segment *segment = NULL;
+  if (append_segment() == 0 && module->segment != -1)
+    segment = segment_at(module->segment);
+  if (! segment)
+    {
+      publish();
+      state_unlock();
+      return -1;
+    }
 
+  for (uint32_t i = 0; i < state->cpu_count; ++i)
+    {
+      struct thread_slot *block = (struct thread_slot *)
+        ((char *) segment + segment->retired_offset
+         + (size_t) segment->block_size * (1 + i));
+      offsets[i] = ((char *) &block->values[module->value_offset]
+                    - module->scratch);
+    }
 
-struct _kroki_stats_module *_kroki_stats_module_head = NULL;
+  publish();
 
-static long page_mask;
-static long cache_line_mask;
+  state_unlock();
 
-static uint32_t slot_size;
-static uint32_t value_count;
+  return 0;
+}
 
 
-struct file_state
+/*
+  Returns NULL when the module can't have per-CPU blocks, then its
+  values are updated in the block of the thread.
+*/
+const intptr_t *
+_kroki_stats_cpu_attach(struct _kroki_stats_module *module)
 {
-  int fd;
-  size_t file_size;
-  intptr_t head_free_offset;
-};
+  int save_cancelstate;
+  POSIX(pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &save_cancelstate));
 
-static struct file_state *state = NULL;
+  spin_lock(&modules_lock);
 
-static pthread_key_t thread_slot_key;
+  if (state && state->cpu_count && ! module->cpu_offsets)
+    {
+      intptr_t *offsets = malloc(sizeof(*offsets) * state->cpu_count);
+      if (offsets && cpu_offsets_fill(module, offsets) == 0)
+        __atomic_store_n(&module->cpu_offsets, offsets, __ATOMIC_RELEASE);
+      else
+        free(offsets);
+    }
+
+  const intptr_t *offsets = module->cpu_offsets;
+
+  spin_unlock(&modules_lock);
+
+  POSIX(pthread_setcancelstate(save_cancelstate, NULL));
+
+  return offsets;
+}
 
 
 static
-void
-extend_file(size_t offset, size_t size)
+int
+valid_dynamic_name(const char *name, size_t len)
 {
-  /*
-    Extend the file to at least 'offset + size' bytes rounded upward
-    to the next page boundary (in order to avoid invalidation of
-    existing mappings).
-  */
-  size_t total = (offset + size + page_mask) & ~page_mask;
-  POSIX(posix_fallocate(state->fd, offset, total - offset));
+  if (len == 0)
+    return 0;
+
+  // Names are output as is, some formats would need quoting otherwise.
+  for (size_t i = 0; i < len; ++i)
+    {
+      char c = name[i];
+      if (c <= ' ' || c > '~' || c == '"' || c == '\\')
+        return 0;
+    }
+
+  return 1;
 }
 
 
-static
-struct thread_slot *
-thread_slot_map(size_t offset)
+kroki_stats_handle_t
+kroki_stats_lookup(const char *name)
 {
-  size_t map_size = (offset & page_mask) + slot_size;
-  char *map = CHECK(mmap(NULL, map_size, PROT_READ | PROT_WRITE,
-                         MAP_SHARED, state->fd, (offset & ~page_mask)),
-                    == MAP_FAILED, die, "%m");
-  SYS(madvise(map, map_size, MADV_DONTFORK));
-  return (struct thread_slot *) (map + (offset & page_mask));
+  size_t len = strlen(name);
+  if (len > DYNAMIC_NAME_MAX)
+    {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+  if (! valid_dynamic_name(name, len))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  spin_lock(&modules_lock);
+
+  uint32_t i = 0;
+  while (i < dynamic_count && strcmp(dynamic_names[i], name) != 0)
+    ++i;
+
+  if (i == dynamic_count)
+    {
+      if (i == DYNAMIC_VALUES)
+        {
+          spin_unlock(&modules_lock);
+          errno = ENOSPC;
+          return NULL;
+        }
+
+      char *copy = strdup(name);
+      if (! copy)
+        {
+          spin_unlock(&modules_lock);
+          return NULL;
+        }
+      dynamic_names[i] = copy;
+      ++dynamic_count;
+
+      if (i == 0)
+        {
+          dynamic_module.segment = -1;
+          dynamic_module.next = _kroki_stats_module_head;
+          _kroki_stats_module_head = &dynamic_module;
+        }
+      else if (state && dynamic_module.segment != -1)
+        {
+          state_lock();
+          int res = append_name(i);
+          publish();
+          state_unlock();
+
+          if (res == -1)
+            {
+              int save_errno = errno;
+              free(copy);
+              --dynamic_count;
+              spin_unlock(&modules_lock);
+              errno = save_errno;
+              return NULL;
+            }
+        }
+    }
+
+  spin_unlock(&modules_lock);
+
+  return (kroki_stats_handle_t) &dynamic_name_refs[i];
 }
 
 
-static
 void
-thread_slot_unmap(struct thread_slot *slot)
+_kroki_stats_module_register(struct _kroki_stats_module *module)
 {
-  char *map_end = (char *) slot + slot_size;
-  char *map = (char *) ((intptr_t) slot & ~page_mask);
-  SYS(munmap(map, map_end - map));
+  spin_lock(&modules_lock);
+  module->segment = -1;
+  module->next = _kroki_stats_module_head;
+  _kroki_stats_module_head = module;
+  spin_unlock(&modules_lock);
 }
 
 
-static __attribute__((__noinline__))
+/*
+  Values of the module stay in the stats file (and its segment stays
+  there too), but the module itself is gone.
+*/
 void
-init_file(void)
+_kroki_stats_module_unregister(struct _kroki_stats_module *module)
 {
-  size_t names_size = 0;
-  size_t count = 0;
-  const struct _kroki_stats_module *module = _kroki_stats_module_head;
-  while (module)
-    {
-      names_size += module->names_size;
-      count += module->value_count;
-      module = module->next;
-    }
-  size_t header_size = (sizeof(struct stats_file) + sizeof(uint32_t) * count
-                        + names_size + cache_line_mask) & ~cache_line_mask;
+  spin_lock(&modules_lock);
+  struct _kroki_stats_module **pnext = &_kroki_stats_module_head;
+  while (*pnext != module)
+    pnext = &(*pnext)->next;
+  *pnext = module->next;
+  free((intptr_t *) module->cpu_offsets);
+  module->cpu_offsets = NULL;
+  spin_unlock(&modules_lock);
+}
 
-  // Several threads may store the same values here.
-  slot_size = ((sizeof(struct thread_slot) + sizeof(intptr_t) * count
-                + cache_line_mask) & ~cache_line_mask);
-  value_count = count;
 
-  size_t zero = 0;
-  if (unlikely(! __atomic_compare_exchange_n(&state->file_size,
-                                             &zero, header_size, 0,
-                                             __ATOMIC_RELEASE,
-                                             __ATOMIC_ACQUIRE)))
-    return;
+/*
+  In eager mode (when some module is compiled with KROKI_STATS_EAGER)
+  stats() doesn't check whether the calling thread has a slot, so
+  with libkroki-stats-eager every thread created with
+  pthread_create() gets one before its start routine is run.  Other
+  threads write to the scratch words of the modules until
+  stats_batch, stats_h() or stats_thread_init() creates their slot.
+*/
+static int eager = 0;
 
-  // Only a single thread will reach here.
 
-  extend_file(0, header_size);
+void
+_kroki_stats_eager_init(void)
+{
+  eager = 1;
+}
 
-  struct stats_file *file =
-    CHECK(mmap(NULL, header_size, PROT_READ | PROT_WRITE,
-               MAP_SHARED, state->fd, 0),
-          == MAP_FAILED, die, "%m");
 
-  uint32_t *name_ref = file->data;
-  char *name = (char *) (name_ref + value_count);
-  size_t offset = name - (char *) file->data;
-  module = _kroki_stats_module_head;
-  while (module)
-    {
-      memcpy(name, module->name_refs[0], module->names_size);
-      for (uint32_t i = 0; i < module->value_count; ++i)
-        *name_ref++ = offset + (module->name_refs[i] - module->name_refs[0]);
-      name += module->names_size;
-      offset += module->names_size;
-      module = module->next;
-    }
+/*
+  A thread that has its values still has to attach the modules
+  registered since (loaded with dlopen()).
+*/
+void
+kroki_stats_thread_init(void)
+{
+  int attached = (slot_index != 0);
 
-  file->slot_offset = header_size - offsetof(struct stats_file, data);
-  file->slot_size = slot_size;
-  // Synchronize with ACQUIRE in kroki-stats.c.
-  __atomic_store_n(&file->value_count, value_count, __ATOMIC_RELEASE);
+  spin_lock(&modules_lock);
+  const struct _kroki_stats_module *module = _kroki_stats_module_head;
+  for (; module && attached; module = module->next)
+    attached = (*module->thread_offset() != 0);
+  spin_unlock(&modules_lock);
 
-  SYS(munmap(file, header_size));
+  if (! attached)
+    _kroki_stats_thread_slot_create();
 }
 
 
-static __thread __attribute__((__tls_model__("initial-exec")))
-intptr_t slot_offset = 0;
+/*
+  Aggregator thread sums up the values of all threads every
+  'aggregate_interval' milliseconds with the reader of 'kroki-stats',
+  and publishes the totals in the totals blocks of the segments
+  (see stats_file.h), so that readers get them without scanning the
+  slots.  It has no slot of its own, reads the file it was started
+  for, and is stopped when another file is opened.
+*/
+static unsigned int aggregate_interval = 0;
+
+static pthread_t aggregator;
 
+// Futex that the aggregator thread sleeps on between the sums.
+static int aggregator_stop;
 
+
+// Returns -1 with errno set if the clock can't be read.
 static
-void
-thread_slot_destroy(void *arg)
+int
+publish_totals(const struct stats_reader *reader, const intptr_t *total)
 {
-  struct thread_slot *slot = arg;
+  struct stats_file *file = file_header();
+  uint32_t seq = file->totals_seq + 1;
 
-  if (slot_offset != -1)
+  for (uint32_t s = 0; s < reader->segment_count; ++s)
     {
-      intptr_t offset = slot_offset;
-      intptr_t free_head = __atomic_load_n(&state->head_free_offset,
-                                           __ATOMIC_RELAXED);
-      do
-        slot->next_free_offset = free_head;
-      while (unlikely(! __atomic_compare_exchange_n(&state->head_free_offset,
-                                                    &free_head, offset, 1,
-                                                    __ATOMIC_RELEASE,
-                                                    __ATOMIC_RELAXED)));
+      const struct stats_reader_segment *segment = &reader->segments[s];
+      if (! segment->totals)
+        continue;
 
-      thread_slot_unmap(slot);
-    }
-  else
-    {
-      SYS(munmap(slot, sizeof(*slot)));
+      /*
+        Readers may still copy the totals of two publishes ago from
+        this block, they tell by 'tid_neg' that it changed under them.
+      */
+      struct thread_slot *block = (struct thread_slot *)
+        (window_map() + segment->totals
+         + (size_t) segment->block_size * (seq % STATS_TOTALS_BLOCKS));
+      __atomic_store_n(&block->tid_neg, 0, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      memcpy(block->values, total + segment->first_value,
+             sizeof(*total) * segment->value_count);
+      __atomic_store_n(&block->tid_neg, seq, __ATOMIC_RELEASE);
     }
+
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    return -1;
+  __atomic_store_n(&file->totals_nsec,
+                   (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec,
+                   __ATOMIC_RELAXED);
+  // Synchronize with ACQUIRE in stats_reader.c.
+  __atomic_store_n(&file->totals_seq, seq, __ATOMIC_RELEASE);
+  // Readers are other processes, the futex is not private.
+  syscall(SYS_futex, &file->totals_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+  return 0;
 }
 
 
-void
-_kroki_stats_thread_slot_create(void)
+static
+void *
+aggregator_run(void *arg)
 {
-  int save_cancelstate;
-  POSIX(pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &save_cancelstate));
+  (void) arg;
+
+  // The file may have been unlinked, so it is read by descriptor.
+  char filename[32];
+  snprintf(filename, sizeof(filename), "/proc/self/fd/%d", state->fd);
+  struct stats_reader reader;
+  stats_reader_init(&reader, filename, 0, 0);
+  intptr_t *total = NULL;
+  intptr_t *next = NULL;
+  uint32_t count = 0;
 
-  struct thread_slot *slot = NULL;
-  if (state)
+  struct timespec timeout = {
+    .tv_sec = aggregate_interval / 1000,
+    .tv_nsec = aggregate_interval % 1000 * 1000000
+  };
+  while (! __atomic_load_n(&aggregator_stop, __ATOMIC_ACQUIRE))
     {
-      if (unlikely(! __atomic_load_n(&state->file_size, __ATOMIC_ACQUIRE)))
-        init_file();
-
-      intptr_t offset = __atomic_load_n(&state->head_free_offset,
-                                        __ATOMIC_ACQUIRE);
-      if (offset)
+      int res = stats_reader_update(&reader);
+      if (res == 1 && count < reader.count)
         {
-          intptr_t free_next;
-          do
+          intptr_t *grown = realloc(total, sizeof(*total) * reader.count);
+          if (grown)
             {
-              if (slot)
-                thread_slot_unmap(slot);
-
-              slot = thread_slot_map(offset);
-
-              free_next = slot->next_free_offset;
+              total = grown;
+              grown = realloc(next, sizeof(*next) * reader.count);
+            }
+          if (grown)
+            {
+              next = grown;
+              count = reader.count;
             }
-          while (unlikely(
-                   ! __atomic_compare_exchange_n(&state->head_free_offset,
-                                                 &offset, free_next, 1,
-                                                 __ATOMIC_RELEASE,
-                                                 __ATOMIC_ACQUIRE))
-                 && offset);
-
-          if (offset)
-            memset(slot->values, 0, sizeof(intptr_t) * value_count);
           else
-            thread_slot_unmap(slot);
+            {
+              res = -1;
+            }
         }
-      if (! offset)
+      if (res == 1)
         {
-          offset = __atomic_fetch_add(&state->file_size, slot_size,
-                                      __ATOMIC_RELAXED);
-
-          extend_file(offset, slot_size);
+          stats_reader_sum(&reader, &total, &next);
+          res = publish_totals(&reader, total);
+        }
 
-          slot = thread_slot_map(offset);
+      /*
+        The thread doesn't take the application down with it: it
+        stops, and readers scan the values themselves once they see
+        no interval.
+      */
+      if (res == -1)
+        {
+          __atomic_store_n(&file_header()->totals_interval, 0,
+                           __ATOMIC_RELAXED);
+          break;
         }
 
-      // Synchronize with ACQUIRE in kroki-stats.c.
-      __atomic_store_n(&slot->tid_neg, -gettid(), __ATOMIC_RELEASE);
-      slot_offset = offset;
+      syscall(SYS_futex, &aggregator_stop, FUTEX_WAIT_PRIVATE, 0, &timeout,
+              NULL, 0);
     }
-  else
+
+  free(next);
+  free(total);
+  stats_reader_close(&reader);
+
+  return NULL;
+}
+
+
+static
+void
+aggregator_join(void)
+{
+  if (! aggregate_interval)
+    return;
+
+  __atomic_store_n(&aggregator_stop, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &aggregator_stop, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  POSIX(pthread_join(aggregator, NULL));
+
+  __atomic_store_n(&file_header()->totals_interval, 0, __ATOMIC_RELAXED);
+  aggregate_interval = 0;
+}
+
+
+int
+kroki_stats_aggregate(unsigned int interval_ms)
+{
+  aggregator_join();
+
+  if (! interval_ms)
+    return 0;
+
+  if (! state)
     {
-      slot = CHECK(mmap(NULL, sizeof(*slot), PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
-                   == MAP_FAILED, die, "%m");
-      SYS(madvise(slot, sizeof(*slot), MADV_DONTFORK));
-      slot_offset = -1;
+      errno = EBADF;
+      return -1;
     }
 
-  uint32_t count = 0;
+  // Readers see the header of a file that has nothing else yet.
+  state_lock();
+  if (unlikely(! state->records_end))
+    {
+      init_file();
+      publish();
+    }
+  state_unlock();
+
+  aggregator_stop = 0;
+  aggregate_interval = interval_ms;
+
+  // Signals of the application are not for the aggregator thread.
+  sigset_t all, old;
+  SYS(sigfillset(&all));
+  POSIX(pthread_sigmask(SIG_SETMASK, &all, &old));
+  int res = pthread_create(&aggregator, NULL, aggregator_run, NULL);
+  POSIX(pthread_sigmask(SIG_SETMASK, &old, NULL));
+  if (res != 0)
+    {
+      aggregate_interval = 0;
+      errno = res;
+      return -1;
+    }
+
+  __atomic_store_n(&file_header()->totals_interval, interval_ms,
+                   __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+
+/*
+  Called by the pthread_create() wrapper of libkroki-stats-eager in
+  the threads it starts, before their start routine.  The aggregator
+  thread has no stats() and goes without a slot.
+*/
+void
+_kroki_stats_thread_start(void *(*start_routine)(void *))
+{
+  if (eager && start_routine != aggregator_run)
+    kroki_stats_thread_init();
+}
+
+
+/*
+  Make the calling thread have no values, without giving back its
+  index.
+*/
+static
+void
+thread_slot_forget(void)
+{
   const struct _kroki_stats_module *module = _kroki_stats_module_head;
   while (module)
     {
-      *module->thread_offset() =
-        (char *) &slot->values[count] - (char *) module->name_refs;
-      count += module->value_count;
+      *module->thread_offset() = 0;
       module = module->next;
     }
+  _kroki_stats_batch_seq = NULL;
+  private_blocks = NULL;
 
   /*
-    Despite the use of __thread we still need pthread_setspecific() to
-    arrange the call to thread_slot_destroy() on thread termination.
+    Also prevent the call to thread_slot_destroy() for parent values
+    (that do not exist in child) when child exits.  Not
+    async-signal-safe per POSIX, but OK with Glibc when value is NULL.
   */
-  POSIX(pthread_setspecific(thread_slot_key, slot));
+  POSIX(pthread_setspecific(thread_slot_key, NULL));
 
-  // Glibc allows NULL for 'oldstate'.
-  POSIX(pthread_setcancelstate(save_cancelstate, NULL));
+  slot_index = 0;
 }
 
 
 void
 kroki_stats_atfork_child(void)
 {
-  if (slot_offset)
-    {
-      /*
-        Because of MADV_DONTFORK no slot mapping is cloned into the
-        child(*).  However forked thread in the child still has
-        pointers to the place where mapping existed in the parent, so
-        we reset them here.
-
-        (*): there is a small race window between the calls to mmap()
-        and madvise() hence in multi-threaded case some slot mappings
-        of threads other than the one that called fork() may leak.
-        However in multi-threaded program only async-signal-safe
-        (i.e. re-entrant) calls are allowed in the child after the
-        fork() before it calls exec*(), because fork() asynchronously
-        interrupts other threads (thus multi-threading is incompatible
-        with multitasking that uses fork() without exec*()).  Any
-        leaks before exec*() are not an issue.  OTOH in
-        single-threaded program where fork() may be used without
-        following exec*() we are guaranteed to unmap parent slot in
-        the child so below we only reset references to it.
-      */
-      const struct _kroki_stats_module *module = _kroki_stats_module_head;
-      while (module)
-        {
-          *module->thread_offset() = 0;
-          module = module->next;
-        }
+  /*
+    Because of MADV_DONTFORK neither the window nor private values
+    are cloned into the child(*).  However forked thread in the child
+    still has pointers to the place where mappings existed in the
+    parent, so we reset them here.
+
+    (*): there is a small race window between the calls to mmap() and
+    madvise() hence in multi-threaded case some mappings may leak.
+    However in multi-threaded program only async-signal-safe
+    (i.e. re-entrant) calls are allowed in the child after the fork()
+    before it calls exec*(), because fork() asynchronously interrupts
+    other threads (thus multi-threading is incompatible with
+    multitasking that uses fork() without exec*()).  Any leaks before
+    exec*() are not an issue.
+  */
+  window = NULL;
 
-      /*
-        Also prevent the call to thread_slot_destroy() for parent slot
-        (that does not exists in child) when child exits.  Not
-        async-signal-safe per POSIX, but OK with Glibc when value is
-        NULL.
-      */
-      POSIX(pthread_setspecific(thread_slot_key, NULL));
+  // Some other thread of the parent might have held it.
+  modules_lock = 0;
 
-      slot_offset = 0;
-    }
+  /*
+    The record index might have been in the middle of an update, it
+    is built anew (the copy of the parent is leaked).
+  */
+  record_index = (struct record_index) { 0 };
+
+  // The aggregator thread of the parent is not in the child.
+  aggregate_interval = 0;
+
+  if (slot_index)
+    thread_slot_forget();
 }
 
 
+static
 int
-kroki_stats_open(const char *filename)
+open_file(const char *filename, int flags)
 {
-  if (slot_offset)
+  if (slot_index)
     {
-      // Avoid using pthread_getspecific().
-      const struct _kroki_stats_module *module = _kroki_stats_module_head;
-      struct thread_slot *slot = (struct thread_slot *)
-        ((char *) module->name_refs + *module->thread_offset()
-         - offsetof(struct thread_slot, values));
-      thread_slot_destroy(slot);
-
-      /*
-        kroki_stats_atfork_child() resets 'slot_offset' and so must be
-        called after thread_slot_destroy().
-      */
-      kroki_stats_atfork_child();
+      thread_slot_destroy(NULL);
+      thread_slot_forget();
     }
 
   if (state)
     {
+      /*
+        Values of other threads may still be in the window, so it is
+        left mapped (and keeps the old file open).  Such threads do
+        not give back their indices either.
+      */
+      window = NULL;
       SYS(close(state->fd));
       SYS(munmap(state, sizeof(*state)));
       state = NULL;
     }
 
+  /*
+    Like the window, per-CPU offsets of the old file may still be in
+    use by other threads, so they are not freed.
+  */
+  spin_lock(&modules_lock);
+  ++file_generation;
+  _kroki_stats_cpu_mode = 0;
+  struct _kroki_stats_module *module = _kroki_stats_module_head;
+  for (; module; module = module->next)
+    {
+      module->segment = -1;
+      module->cpu_offsets = NULL;
+    }
+  spin_unlock(&modules_lock);
+
   if (! filename)
     return 0;
 
@@ -395,6 +2199,43 @@ kroki_stats_open(const char *filename)
   if (state == MAP_FAILED)
     goto state_err;
 
+  pthread_mutexattr_t attr;
+  POSIX(pthread_mutexattr_init(&attr));
+  POSIX(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED));
+  POSIX(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST));
+  POSIX(pthread_mutex_init(&state->lock, &attr));
+  POSIX(pthread_mutexattr_destroy(&attr));
+
+  state->fd = new_fd;
+
+  /*
+    On hugetlbfs the file is allocated and truncated in huge pages.
+    Elsewhere huge pages are transparent and only asked for, and the
+    file grows by whole huge pages, as tmpfs mounted with
+    huge=within_size uses them only for the part within the file
+    size.
+  */
+  struct statfs fs;
+  if (fstatfs(new_fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC)
+    {
+      state->page_mask = fs.f_bsize - 1;
+      state->hugetlb = 1;
+    }
+  else if ((flags & KROKI_STATS_HUGEPAGE) && hugepage_size)
+    {
+      state->page_mask = hugepage_size - 1;
+      state->hugepage = 1;
+    }
+  else
+    {
+      state->page_mask = page_mask;
+    }
+
+  // A file system that has no room for the header fails here.
+  res = extend_file(file_header_size());
+  if (res == -1)
+    goto mmap_err;
+
   /*
     rename() is the last operation that may fail so in the case of any
     error the old file is not affected.
@@ -406,7 +2247,16 @@ kroki_stats_open(const char *filename)
   SYS(close(old_fd));
   free(tempname);
 
-  state->fd = new_fd;
+#ifdef _KROKI_STATS_RSEQ
+  // Without the rseq area of Glibc the file is per-thread only.
+  if ((flags & KROKI_STATS_PERCPU) && __rseq_size > 0)
+    {
+      state->cpu_count = possible_cpus();
+      _kroki_stats_cpu_mode = 1;
+    }
+#else
+  (void) flags;
+#endif
 
   return 0;
 
@@ -434,6 +2284,35 @@ kroki_stats_open(const char *filename)
 }
 
 
+int
+kroki_stats_open(const char *filename)
+{
+  return kroki_stats_open_flags(filename, 0);
+}
+
+
+int
+kroki_stats_open_flags(const char *filename, int flags)
+{
+  int had_slot = (slot_index != 0);
+  unsigned int interval = aggregate_interval;
+
+  aggregator_join();
+
+  int res = open_file(filename, flags);
+
+  // In eager mode the calling thread may not go without a slot.
+  if (eager && had_slot)
+    _kroki_stats_thread_slot_create();
+
+  // The aggregator thread moves to the new file.
+  if (res == 0 && filename && interval)
+    (void) kroki_stats_aggregate(interval);
+
+  return res;
+}
+
+
 static __attribute__((__constructor__))
 void
 init(void)
@@ -443,6 +2322,23 @@ init(void)
 
   POSIX(pthread_key_create(&thread_slot_key, thread_slot_destroy));
 
+  timer_init();
+
+  FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+  if (fp)
+    {
+      if (fscanf(fp, "%zu", &hugepage_size) != 1)
+        hugepage_size = 0;
+      SYS(fclose(fp));
+    }
+
+  const char *reclaim = getenv("KROKI_STATS_RECLAIM_SEC");
+  if (reclaim)
+    {
+      reclaim_idle_sec = strtol(reclaim, NULL, 10);
+      SYS(unsetenv("KROKI_STATS_RECLAIM_SEC"));
+    }
+
   const char *filename = getenv("KROKI_STATS_FILE");
   if (filename)
     {
@@ -453,13 +2349,33 @@ init(void)
       */
       SYS(unsetenv("KROKI_STATS_FILE"));
 
+      int flags = 0;
+      const char *percpu = getenv("KROKI_STATS_PERCPU");
+      if (percpu && strcmp(percpu, "1") == 0)
+        flags |= KROKI_STATS_PERCPU;
+      SYS(unsetenv("KROKI_STATS_PERCPU"));
+      const char *hugepage = getenv("KROKI_STATS_HUGEPAGE");
+      if (hugepage && strcmp(hugepage, "1") == 0)
+        flags |= KROKI_STATS_HUGEPAGE;
+      SYS(unsetenv("KROKI_STATS_HUGEPAGE"));
+
       /*
         At this point it's possible that not every kroki/stats-blessed
-        module has linked itself into the module list, so we can't
-        call init_file() yet.
+        module has registered itself, so segments are appended later,
+        on the first stats() call.
       */
-      int res = kroki_stats_open(filename);
+      int res = kroki_stats_open_flags(filename, flags);
       if (res == -1)
         error("libkroki-stats: environment KROKI_STATS_FILE=%s: %m", filename);
+
+      const char *aggregate = getenv("KROKI_STATS_AGGREGATE_MS");
+      if (aggregate && res == 0)
+        {
+          unsigned int interval_ms = strtoul(aggregate, NULL, 10);
+          if (kroki_stats_aggregate(interval_ms) == -1)
+            error("libkroki-stats: environment"
+                  " KROKI_STATS_AGGREGATE_MS=%s: %m", aggregate);
+        }
+      SYS(unsetenv("KROKI_STATS_AGGREGATE_MS"));
     }
 }
@@ -0,0 +1,453 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "merge.h"
+#include <kroki/error.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <glob.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static
+size_t
+entry_hash(const char *name, uint8_t kind, uint32_t width)
+{
+  // FNV-1a.
+  size_t hash = 2166136261u;
+  for (; *name; ++name)
+    hash = (hash ^ (unsigned char) *name) * 16777619;
+  hash = (hash ^ kind) * 16777619;
+  return (hash ^ width) * 16777619;
+}
+
+
+static
+void
+grow_table(struct merge *m)
+{
+  free(m->table);
+  m->table_size = (m->table_size ? m->table_size * 2 : 1024);
+  m->table = MEM(calloc(m->table_size, sizeof(*m->table)));
+
+  const struct replay *image = &m->image;
+  for (uint32_t c = 0; c < image->count; c += m->widths[c])
+    {
+      size_t i = entry_hash(image->name_data + image->names[c],
+                            image->kinds[c], m->widths[c]);
+      while (m->table[i & (m->table_size - 1)])
+        ++i;
+      m->table[i & (m->table_size - 1)] = c + 1;
+    }
+}
+
+
+void
+merge_open(struct merge *m, char *const *patterns, int pattern_count,
+           int threads)
+{
+  memset(m, 0, sizeof(*m));
+  m->patterns = patterns;
+  m->pattern_count = pattern_count;
+  m->threads = threads;
+
+  struct replay *image = &m->image;
+  image->source = patterns[0];
+  image->timer_frequency = 1000000000;
+  image->fd = SYS(memfd_create("kroki-stats-merge", MFD_CLOEXEC));
+  snprintf(image->filename, sizeof(image->filename), "/proc/self/fd/%d",
+           image->fd);
+
+  grow_table(m);
+}
+
+
+static
+void
+free_source(struct merge_source *s)
+{
+  stats_reader_close(&s->reader);
+  free(s->next);
+  free(s->total);
+  free(s->timers);
+  free(s->columns);
+  free(s->filename);
+}
+
+
+void
+merge_close(struct merge *m)
+{
+  for (size_t i = 0; i < m->source_count; ++i)
+    free_source(&m->sources[i]);
+  free(m->sources);
+
+  for (size_t i = 0; i < m->segment_count; ++i)
+    {
+      free(m->segments[i].columns);
+      free(m->segments[i].data);
+    }
+  free(m->segments);
+
+  free(m->widths);
+  free(m->table);
+
+  struct replay *image = &m->image;
+  SYS(close(image->fd));
+  free(image->image);
+  free(image->infos);
+  free(image->values);
+  free(image->tids);
+  free(image->total);
+  free(image->name_data);
+  free(image->names);
+  free(image->kinds);
+}
+
+
+/*
+  First column of the entry, which is appended to the image if it is
+  not there yet.
+*/
+static
+uint32_t
+entry_column(struct merge *m, const char *name, uint8_t kind, uint32_t width)
+{
+  struct replay *image = &m->image;
+  size_t mask = m->table_size - 1;
+  size_t i = entry_hash(name, kind, width);
+  for (; m->table[i & mask]; ++i)
+    {
+      uint32_t c = m->table[i & mask] - 1;
+      if (image->kinds[c] == kind && m->widths[c] == width
+          && strcmp(image->name_data + image->names[c], name) == 0)
+        return c;
+    }
+
+  uint32_t c = image->count;
+  if (width > UINT32_MAX / sizeof(intptr_t) - c)
+    error("%s: too many values", image->source);
+  uint32_t count = c + width;
+  size_t len = strlen(name) + 1;
+  image->kinds = MEM(realloc(image->kinds, sizeof(*image->kinds) * count));
+  image->names = MEM(realloc(image->names, sizeof(*image->names) * count));
+  image->total = MEM(realloc(image->total, sizeof(*image->total) * count));
+  m->widths = MEM(realloc(m->widths, sizeof(*m->widths) * count));
+  image->name_data = MEM(realloc(image->name_data, image->name_size + len));
+  memcpy(image->name_data + image->name_size, name, len);
+  for (uint32_t j = c; j < count; ++j)
+    {
+      image->kinds[j] = kind;
+      image->names[j] = image->name_size;
+      m->widths[j] = width;
+    }
+  image->name_size += len;
+  image->count = count;
+  m->new_names = 1;
+
+  m->table[i & mask] = c + 1;
+  if (count * 2 > m->table_size)
+    grow_table(m);
+
+  return c;
+}
+
+
+/*
+  Columns of the values of segment 's' of the file.  Values named at
+  run time are left to map_source().
+*/
+static
+void
+map_segment(struct merge *m, const struct stats_reader *r, uint32_t s,
+            uint32_t *columns)
+{
+  const struct stats_reader_segment *segment = &r->segments[s];
+  size_t start = segment->offset + offsetof(struct stats_segment, data);
+  const char *data = (const char *) r->file + start;
+  size_t size = segment->retired - start;
+  for (size_t k = 0; k < m->segment_count; ++k)
+    {
+      const struct merge_segment *seen = &m->segments[k];
+      if (seen->size == size && memcmp(seen->data, data, size) == 0)
+        {
+          memcpy(columns, seen->columns,
+                 sizeof(*columns) * segment->value_count);
+          return;
+        }
+    }
+
+  uint32_t end = segment->first_value + segment->value_count;
+  for (uint32_t i = segment->first_value; i < end; )
+    {
+      uint32_t width = stats_reader_width(r, i);
+      const char *name = stats_reader_name(r, i);
+      uint32_t c = STATS_READER_NO_COLUMN;
+      if (*name && r->names[i] >= start && r->names[i] < segment->retired)
+        c = entry_column(m, name, r->kinds[i], width);
+      for (uint32_t j = 0; j < width; ++j)
+        columns[i - segment->first_value + j] =
+          (c == STATS_READER_NO_COLUMN ? c : c + j);
+      i += width;
+    }
+
+  m->segments = MEM(realloc(m->segments,
+                            sizeof(*m->segments) * (m->segment_count + 1)));
+  struct merge_segment *seen = &m->segments[m->segment_count++];
+  seen->size = size;
+  seen->data = MEM(malloc(size));
+  memcpy(seen->data, data, size);
+  seen->columns = MEM(malloc(sizeof(*columns) * segment->value_count));
+  memcpy(seen->columns, columns, sizeof(*columns) * segment->value_count);
+}
+
+
+static
+void
+map_source(struct merge *m, struct merge_source *s)
+{
+  const struct stats_reader *r = &s->reader;
+  uint32_t count = r->count;
+  s->columns = MEM(realloc(s->columns, sizeof(*s->columns) * count));
+  s->timers = MEM(realloc(s->timers, sizeof(*s->timers) * count));
+  s->total = MEM(realloc(s->total, sizeof(*s->total) * count));
+  s->next = MEM(realloc(s->next, sizeof(*s->next) * count));
+  s->timer_count = 0;
+
+  for (uint32_t g = 0; g < r->segment_count; ++g)
+    {
+      const struct stats_reader_segment *segment = &r->segments[g];
+      map_segment(m, r, g, s->columns + segment->first_value);
+
+      size_t start = segment->offset + offsetof(struct stats_segment, data);
+      uint32_t end = segment->first_value + segment->value_count;
+      for (uint32_t i = segment->first_value; i < end; )
+        {
+          uint32_t width = stats_reader_width(r, i);
+          const char *name = stats_reader_name(r, i);
+          if (*name && (r->names[i] < start || r->names[i] >= segment->retired))
+            {
+              uint32_t c = entry_column(m, name, r->kinds[i], width);
+              for (uint32_t j = 0; j < width; ++j)
+                s->columns[i + j] = c + j;
+            }
+          if (r->kinds[i] == _KROKI_STATS_KIND_TIMER
+              && s->columns[i] != STATS_READER_NO_COLUMN)
+            s->timers[s->timer_count++] = i + 1;
+          i += width;
+        }
+    }
+
+  s->generation = r->generation;
+}
+
+
+static
+void
+to_nsec(const struct merge_source *s, intptr_t *values)
+{
+  for (uint32_t t = 0; t < s->timer_count; ++t)
+    values[s->timers[t]] = stats_reader_nsec(&s->reader, values[s->timers[t]]);
+}
+
+
+static
+struct merge_source *
+find_source(struct merge *m, const char *filename)
+{
+  for (size_t i = 0; i < m->source_count; ++i)
+    {
+      if (strcmp(m->sources[i].filename, filename) == 0)
+        return &m->sources[i];
+    }
+
+  m->sources = MEM(realloc(m->sources,
+                           sizeof(*m->sources) * (m->source_count + 1)));
+  struct merge_source *s = &m->sources[m->source_count++];
+  memset(s, 0, sizeof(*s));
+  s->filename = MEM(strdup(filename));
+  stats_reader_init(&s->reader, s->filename, 0, 0);
+  s->reader.jobs = m->jobs;
+  s->reader.aggregated = m->aggregated;
+
+  return s;
+}
+
+
+/*
+  Expand the patterns and open the files that are new.  Files that
+  are gone are closed.  A pattern with wildcards yields only the files
+  it matches, a file name without them is kept as is, so that the file
+  is read once it exists.
+*/
+static
+void
+find_sources(struct merge *m)
+{
+  glob_t paths;
+  memset(&paths, 0, sizeof(paths));
+  for (int i = 0; i < m->pattern_count; ++i)
+    {
+      int flags = (i > 0 ? GLOB_APPEND : 0);
+      if (! strpbrk(m->patterns[i], "*?["))
+        flags |= GLOB_NOCHECK;
+      int res = glob(m->patterns[i], flags, NULL, &paths);
+      if (res == GLOB_NOSPACE)
+        error("%s: out of memory", m->patterns[i]);
+    }
+
+  for (size_t i = 0; i < m->source_count; ++i)
+    m->sources[i].found = 0;
+  for (size_t i = 0; i < paths.gl_pathc; ++i)
+    find_source(m, paths.gl_pathv[i])->found = 1;
+  globfree(&paths);
+
+  size_t n = 0;
+  for (size_t i = 0; i < m->source_count; ++i)
+    {
+      if (m->sources[i].found)
+        m->sources[n++] = m->sources[i];
+      else
+        free_source(&m->sources[i]);
+    }
+  m->source_count = n;
+}
+
+
+static
+void
+reset_values(const struct replay *image, intptr_t *values)
+{
+  for (uint32_t c = 0; c < image->count; ++c)
+    values[c] = stats_kind_initial_value(image->kinds[c]);
+}
+
+
+static
+void
+grow_slots(struct merge *m)
+{
+  struct replay *image = &m->image;
+  image->tids = MEM(realloc(image->tids,
+                            sizeof(*image->tids) * m->slot_capacity));
+  image->infos = MEM(realloc(image->infos,
+                             sizeof(*image->infos) * m->slot_capacity));
+  image->values = MEM(realloc(image->values,
+                              (sizeof(*image->values) * image->count
+                               * m->slot_capacity)));
+}
+
+
+/*
+  Slots of all the files, in file order.
+*/
+static
+void
+merge_slots(struct merge *m)
+{
+  struct replay *image = &m->image;
+  uint32_t count = image->count;
+  size_t slot_count = 0;
+
+  // The number of columns may have changed.
+  grow_slots(m);
+
+  for (size_t k = 0; k < m->source_count; ++k)
+    {
+      struct merge_source *s = &m->sources[k];
+      if (! s->active)
+        continue;
+
+      long index = -1;
+      while ((index = stats_reader_next_slot(&s->reader, index)) != -1)
+        {
+          long tid = stats_reader_read_slot(&s->reader, index, s->next);
+          if (tid <= 0)
+            continue;
+
+          if (slot_count == m->slot_capacity)
+            {
+              m->slot_capacity = (m->slot_capacity
+                                  ? m->slot_capacity * 2 : 64);
+              grow_slots(m);
+            }
+
+          intptr_t *values = image->values + (size_t) count * slot_count;
+          reset_values(image, values);
+          to_nsec(s, s->next);
+          stats_reader_reduce_columns(&s->reader, values, s->columns,
+                                      s->next);
+          image->tids[slot_count] = tid;
+          if (stats_reader_thread_info(&s->reader, index,
+                                       &image->infos[slot_count]) == -1)
+            memset(&image->infos[slot_count], 0, sizeof(*image->infos));
+          ++slot_count;
+        }
+    }
+  image->slot_count = slot_count;
+}
+
+
+void
+merge_update(struct merge *m)
+{
+  struct replay *image = &m->image;
+
+  find_sources(m);
+
+  for (size_t k = 0; k < m->source_count; ++k)
+    {
+      struct merge_source *s = &m->sources[k];
+      // A file that is not there or is being created is skipped.
+      s->active = (stats_reader_update(&s->reader) == 1);
+      if (s->active && (s->reader.generation != s->generation
+                        || ! s->columns))
+        map_source(m, s);
+    }
+
+  if (m->new_names)
+    {
+      replay_new_image(image);
+      m->new_names = 0;
+    }
+
+  reset_values(image, image->total);
+  for (size_t k = 0; k < m->source_count; ++k)
+    {
+      struct merge_source *s = &m->sources[k];
+      if (! s->active)
+        continue;
+
+      stats_reader_sum(&s->reader, &s->total, &s->next);
+      to_nsec(s, s->total);
+      stats_reader_reduce_columns(&s->reader, image->total, s->columns,
+                                  s->total);
+    }
+
+  image->slot_count = 0;
+  if (m->threads)
+    merge_slots(m);
+
+  replay_write_image(image);
+}
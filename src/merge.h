@@ -0,0 +1,116 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MERGE_H
+#define MERGE_H 1
+
+#include "stats_reader.h"
+#include "record.h"
+
+
+/*
+  Merge makes one stats file of the files of several processes
+  (prefork servers, several instances on a host): it writes an image
+  the way replay does, which stats_reader reads by the name in
+  'image.filename' as any other stats file.  Values of equal name,
+  kind and width are one value of the image, found through a hash
+  table of names, and the values of every file are reduced into the
+  image with stats_reader_reduce_columns().  Files of the same
+  executable have equal segments, so a segment is looked up in the
+  table only the first time its bytes are seen.  Timer ticks are
+  converted to nanoseconds, as every process calibrates its own
+  timer.
+
+  Files are given as names or glob(7) patterns, which are expanded on
+  every update, so that the files of new processes are picked up
+  (and those that are gone drop out of the totals).  With 'threads'
+  the image has the slots of all the files, otherwise only the
+  totals.
+*/
+struct merge_source
+{
+  char *filename;
+  struct stats_reader reader;
+  int found;
+  int active;
+
+  // Generation of the reader 'columns' are for.
+  unsigned int generation;
+  uint32_t *columns;
+  // Values of the file that are timer ticks.
+  uint32_t *timers;
+  uint32_t timer_count;
+
+  intptr_t *total;
+  intptr_t *next;
+};
+
+
+struct merge_segment
+{
+  char *data;
+  size_t size;
+  uint32_t *columns;
+};
+
+
+struct merge
+{
+  char *const *patterns;
+  int pattern_count;
+  int threads;
+  // Passed on to the readers of the files.
+  int jobs;
+  int aggregated;
+
+  struct merge_source *sources;
+  size_t source_count;
+
+  struct merge_segment *segments;
+  size_t segment_count;
+
+  // Column + 1 of the first value of an entry, or zero.
+  uint32_t *table;
+  size_t table_size;
+  uint32_t *widths;
+  int new_names;
+
+  size_t slot_capacity;
+
+  struct replay image;
+};
+
+
+void
+merge_open(struct merge *m, char *const *patterns, int pattern_count,
+           int threads);
+
+
+void
+merge_close(struct merge *m);
+
+
+/*
+  Read the files and write the image.
+*/
+void
+merge_update(struct merge *m);
+
+
+#endif  /* ! MERGE_H */
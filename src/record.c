@@ -0,0 +1,612 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "record.h"
+#include <kroki/error.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+
+static
+void
+put_varint(FILE *fp, uint64_t value)
+{
+  while (value >= 0x80)
+    {
+      putc((value & 0x7f) | 0x80, fp);
+      value >>= 7;
+    }
+  putc(value, fp);
+}
+
+
+static
+void
+put_svarint(FILE *fp, int64_t value)
+{
+  put_varint(fp, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+
+/*
+  Write the changes from 'prev' to 'values' and make 'prev' the
+  values.  Differences wrap around as the values do.
+*/
+static
+void
+put_changes(FILE *fp, uint32_t count, intptr_t *prev, const intptr_t *values)
+{
+  uint32_t changed = 0;
+  for (uint32_t i = 0; i < count; ++i)
+    changed += (values[i] != prev[i]);
+
+  put_varint(fp, changed);
+  long last = -1;
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      if (values[i] == prev[i])
+        continue;
+
+      put_varint(fp, i - last - 1);
+      put_svarint(fp, (intptr_t) ((uintptr_t) values[i] - (uintptr_t) prev[i]));
+      prev[i] = values[i];
+      last = i;
+    }
+}
+
+
+void
+record_open(struct recorder *rec, const char *filename)
+{
+  memset(rec, 0, sizeof(*rec));
+  rec->fp = fopen(filename, "w");
+  if (! rec->fp)
+    error("%s: %m", filename);
+
+  fputs(RECORD_MAGIC, rec->fp);
+}
+
+
+static
+void
+free_state(struct recorder *rec)
+{
+  free(rec->slot_values);
+  free(rec->new_tids);
+  free(rec->tids);
+  rec->slot_values = NULL;
+  rec->new_tids = NULL;
+  rec->tids = NULL;
+  rec->slot_count = 0;
+
+  free(rec->values);
+  free(rec->prev_total);
+  free(rec->next);
+  free(rec->total);
+}
+
+
+void
+record_close(struct recorder *rec)
+{
+  if (fclose(rec->fp) == EOF)
+    error("write: %m");
+  free_state(rec);
+}
+
+
+static
+void
+start_over(struct recorder *rec, const struct stats_reader *r)
+{
+  free_state(rec);
+
+  uint32_t count = r->count;
+  rec->count = count;
+  rec->total = MEM(malloc(sizeof(*rec->total) * count));
+  rec->next = MEM(malloc(sizeof(*rec->next) * count));
+  rec->prev_total = MEM(malloc(sizeof(*rec->prev_total) * count));
+  rec->values = MEM(malloc(sizeof(*rec->values) * count));
+  stats_reader_reset_total(r, rec->prev_total);
+
+  rec->generation = r->generation;
+  rec->have_names = 1;
+
+  FILE *fp = rec->fp;
+  putc('N', fp);
+  put_varint(fp, r->file->timer_frequency);
+  put_varint(fp, count);
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      putc(r->kinds[i], fp);
+      if (i > 0 && r->names[i] == r->names[i - 1])
+        {
+          put_varint(fp, 0);
+          continue;
+        }
+
+      const char *name = stats_reader_name(r, i);
+      size_t len = strlen(name);
+      put_varint(fp, len + 1);
+      fwrite(name, 1, len, fp);
+    }
+}
+
+
+static
+void
+grow_slots(struct recorder *rec, size_t slot_count)
+{
+  if (slot_count <= rec->slot_count)
+    return;
+
+  size_t new_count = slot_count + rec->slot_count;
+  rec->tids = MEM(realloc(rec->tids, sizeof(*rec->tids) * new_count));
+  rec->new_tids = MEM(realloc(rec->new_tids,
+                              sizeof(*rec->new_tids) * new_count));
+  rec->slot_values = MEM(realloc(rec->slot_values,
+                                 (sizeof(*rec->slot_values)
+                                  * rec->count * new_count)));
+  for (size_t i = rec->slot_count; i < new_count; ++i)
+    {
+      rec->tids[i] = 0;
+      rec->new_tids[i] = 0;
+    }
+  rec->slot_count = new_count;
+}
+
+
+void
+record_sample(struct recorder *rec, struct stats_reader *r,
+              const struct timespec *now)
+{
+  if (! rec->have_names)
+    rec->time = *now;
+  if (! rec->have_names || r->generation != rec->generation)
+    start_over(rec, r);
+
+  uint32_t count = rec->count;
+  stats_reader_sum(r, &rec->total, &rec->next);
+
+  // Number of changed slots goes before them.
+  char *buf;
+  size_t size;
+  FILE *slots = open_memstream(&buf, &size);
+  if (! slots)
+    error("open_memstream: %m");
+
+  size_t changed = 0;
+  long index = -1;
+  while ((index = stats_reader_next_slot(r, index)) != -1)
+    {
+      long tid = stats_reader_read_slot(r, index, rec->values);
+      if (tid <= 0)
+        continue;
+
+      grow_slots(rec, index + 1);
+      rec->new_tids[index] = tid;
+      intptr_t *prev = rec->slot_values + (size_t) count * index;
+      if (rec->tids[index] != tid)
+        stats_reader_reset_total(r, prev);
+      else if (memcmp(prev, rec->values, sizeof(*prev) * count) == 0)
+        continue;
+
+      put_varint(slots, index);
+      put_varint(slots, tid);
+      put_changes(slots, count, prev, rec->values);
+      ++changed;
+    }
+  SYS(fclose(slots));
+
+  FILE *fp = rec->fp;
+  putc('S', fp);
+  put_varint(fp, ((now->tv_sec - rec->time.tv_sec) * 1000000000
+                  + now->tv_nsec - rec->time.tv_nsec));
+  rec->time = *now;
+
+  put_changes(fp, count, rec->prev_total, rec->total);
+
+  size_t freed = 0;
+  for (size_t i = 0; i < rec->slot_count; ++i)
+    freed += (rec->tids[i] > 0 && rec->new_tids[i] <= 0);
+  put_varint(fp, freed);
+  for (size_t i = 0; i < rec->slot_count; ++i)
+    {
+      if (rec->tids[i] > 0 && rec->new_tids[i] <= 0)
+        put_varint(fp, i);
+    }
+
+  long *tids = rec->tids;
+  rec->tids = rec->new_tids;
+  rec->new_tids = tids;
+  memset(rec->new_tids, 0, sizeof(*rec->new_tids) * rec->slot_count);
+
+  put_varint(fp, changed);
+  fwrite(buf, 1, size, fp);
+  free(buf);
+
+  // A recording that is interrupted loses at most the last sample.
+  if (fflush(fp) == EOF)
+    error("write: %m");
+}
+
+
+static
+int
+get_varint(FILE *fp, uint64_t *value)
+{
+  uint64_t res = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+    {
+      int c = getc(fp);
+      if (c == EOF)
+        return -1;
+
+      res |= (uint64_t) (c & 0x7f) << shift;
+      if (! (c & 0x80))
+        {
+          *value = res;
+          return 0;
+        }
+    }
+
+  return -1;
+}
+
+
+static
+int
+get_svarint(FILE *fp, intptr_t *value)
+{
+  uint64_t v;
+  if (get_varint(fp, &v) == -1)
+    return -1;
+
+  *value = (intptr_t) ((v >> 1) ^ -(v & 1));
+
+  return 0;
+}
+
+
+static
+void
+invalid(const struct replay *p)
+{
+  error("%s: invalid recording", p->source);
+}
+
+
+static
+int
+get_changes(struct replay *p, intptr_t *values)
+{
+  uint64_t changed;
+  if (get_varint(p->fp, &changed) == -1)
+    return -1;
+
+  uint64_t i = -1;
+  while (changed--)
+    {
+      uint64_t gap;
+      intptr_t diff;
+      if (get_varint(p->fp, &gap) == -1
+          || get_svarint(p->fp, &diff) == -1)
+        return -1;
+
+      i += gap + 1;
+      if (i >= p->count)
+        invalid(p);
+      values[i] = (uintptr_t) values[i] + diff;
+    }
+
+  return 0;
+}
+
+
+void
+replay_open(struct replay *p, const char *filename)
+{
+  memset(p, 0, sizeof(*p));
+  p->source = filename;
+  p->fp = fopen(filename, "r");
+  if (! p->fp)
+    error("%s: %m", filename);
+
+  char magic[sizeof(RECORD_MAGIC)];
+  if (! fgets(magic, sizeof(magic), p->fp) || strcmp(magic, RECORD_MAGIC) != 0)
+    error("%s: not a recording", filename);
+
+  p->fd = SYS(memfd_create("kroki-stats-replay", MFD_CLOEXEC));
+  snprintf(p->filename, sizeof(p->filename), "/proc/self/fd/%d", p->fd);
+}
+
+
+void
+replay_close(struct replay *p)
+{
+  SYS(fclose(p->fp));
+  SYS(close(p->fd));
+  free(p->image);
+  free(p->values);
+  free(p->tids);
+  free(p->total);
+  free(p->name_data);
+  free(p->names);
+  free(p->kinds);
+}
+
+
+// Longer names are taken for garbage.
+#define NAME_MAX_SIZE  (1 << 16)
+
+
+static
+int
+read_names(struct replay *p)
+{
+  uint64_t frequency, count;
+  if (get_varint(p->fp, &frequency) == -1
+      || get_varint(p->fp, &count) == -1)
+    return -1;
+  if (count > UINT32_MAX / sizeof(intptr_t))
+    invalid(p);
+
+  p->timer_frequency = frequency;
+  p->count = count;
+  p->kinds = MEM(realloc(p->kinds, sizeof(*p->kinds) * count + 1));
+  p->names = MEM(realloc(p->names, sizeof(*p->names) * count + 1));
+  p->total = MEM(realloc(p->total, sizeof(*p->total) * count + 1));
+  p->name_size = 0;
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      int kind = getc(p->fp);
+      uint64_t len;
+      if (kind == EOF || get_varint(p->fp, &len) == -1)
+        return -1;
+
+      p->kinds[i] = kind;
+      p->total[i] = stats_kind_initial_value(kind);
+      if (len == 0)
+        {
+          if (i == 0)
+            invalid(p);
+          p->names[i] = p->names[i - 1];
+          continue;
+        }
+      if (len > NAME_MAX_SIZE)
+        invalid(p);
+
+      p->name_data = MEM(realloc(p->name_data, p->name_size + len));
+      if (fread(p->name_data + p->name_size, 1, len - 1, p->fp) != len - 1)
+        return -1;
+      p->name_data[p->name_size + len - 1] = '\0';
+      p->names[i] = p->name_size;
+      p->name_size += len;
+    }
+  p->slot_count = 0;
+
+  replay_new_image(p);
+
+  p->have_names = 1;
+  p->new_names = 1;
+
+  return 0;
+}
+
+
+void
+replay_new_image(struct replay *p)
+{
+  // Readers start over when the file is replaced.
+  int fd = SYS(memfd_create("kroki-stats-replay", MFD_CLOEXEC));
+  SYS(dup3(fd, p->fd, O_CLOEXEC));
+  SYS(close(fd));
+}
+
+
+static
+void
+grow_replay_slots(struct replay *p, size_t slot_count)
+{
+  if (slot_count <= p->slot_count)
+    return;
+
+  p->tids = MEM(realloc(p->tids, sizeof(*p->tids) * slot_count));
+  p->values = MEM(realloc(p->values,
+                          sizeof(*p->values) * p->count * slot_count));
+  for (size_t i = p->slot_count; i < slot_count; ++i)
+    p->tids[i] = 0;
+  p->slot_count = slot_count;
+}
+
+
+static
+size_t
+align_line(size_t size)
+{
+  return (size + 63) & ~(size_t) 63;
+}
+
+
+/*
+  The image has a single segment with all the values and the chunks
+  of the slots.  The retired block makes up for the difference
+  between the recorded totals and the sums of the slots.
+*/
+void
+replay_write_image(struct replay *p)
+{
+  uint32_t count = p->count;
+  size_t header_size = align_line(sizeof(struct stats_file));
+  size_t block_size = align_line(sizeof(struct thread_slot)
+                                 + sizeof(intptr_t) * count);
+  size_t names_start = (sizeof(uint32_t) + sizeof(uint8_t)) * count;
+  size_t retired_offset = align_line(offsetof(struct stats_segment, data)
+                                     + names_start + p->name_size);
+  size_t segment_size = retired_offset + block_size;
+  size_t info_size = (p->infos
+                      ? sizeof(struct stats_thread_info) * STATS_CHUNK_SLOTS
+                      : 0);
+  size_t block_offset = align_line(sizeof(struct stats_chunk) + info_size);
+  size_t chunk_size = block_offset + block_size * STATS_CHUNK_SLOTS;
+  size_t chunk_count = (p->slot_count + STATS_CHUNK_SLOTS - 1) / STATS_CHUNK_SLOTS;
+  size_t size = header_size + segment_size + chunk_size * chunk_count;
+  if (size > UINT32_MAX)
+    error("%s: too many values", p->source);
+
+  if (size > p->image_size)
+    {
+      p->image = MEM(realloc(p->image, size));
+      p->image_size = size;
+    }
+  char *image = p->image;
+  memset(image, 0, size);
+
+  struct stats_file *file = (struct stats_file *) image;
+  file->magic = STATS_FILE_MAGIC;
+  file->version = STATS_FILE_VERSION;
+  file->records_end = size;
+  file->record_offset = header_size;
+  file->slot_count = p->slot_count;
+  file->timer_frequency = p->timer_frequency;
+
+  struct stats_segment *segment =
+    (struct stats_segment *) (image + header_size);
+  segment->record.type = STATS_RECORD_SEGMENT;
+  segment->record.size = segment_size;
+  segment->value_count = count;
+  segment->block_size = block_size;
+  segment->retired_offset = retired_offset;
+  char *data = (char *) segment->data;
+  for (uint32_t i = 0; i < count; ++i)
+    segment->data[i] = names_start + p->names[i];
+  memcpy(data + sizeof(uint32_t) * count, p->kinds, count);
+  memcpy(data + names_start, p->name_data, p->name_size);
+
+  struct thread_slot *retired =
+    (struct thread_slot *) ((char *) segment + retired_offset);
+  memcpy(retired->values, p->total, sizeof(intptr_t) * count);
+
+  for (size_t c = 0; c < chunk_count; ++c)
+    {
+      char *record = image + header_size + segment_size + chunk_size * c;
+      struct stats_chunk *chunk = (struct stats_chunk *) record;
+      chunk->record.type = STATS_RECORD_CHUNK;
+      chunk->record.size = chunk_size;
+      chunk->first_index = c * STATS_CHUNK_SLOTS;
+      chunk->block_offset = block_offset;
+
+      for (size_t b = 0; b < STATS_CHUNK_SLOTS; ++b)
+        {
+          size_t index = c * STATS_CHUNK_SLOTS + b;
+          if (index >= p->slot_count || p->tids[index] <= 0)
+            continue;
+
+          if (p->infos)
+            memcpy((struct stats_thread_info *) (chunk + 1) + b,
+                   &p->infos[index], sizeof(*p->infos));
+
+          struct thread_slot *slot = (struct thread_slot *)
+            (record + block_offset + block_size * b);
+          const intptr_t *values = p->values + (size_t) count * index;
+          slot->tid_neg = -p->tids[index];
+          memcpy(slot->values, values, sizeof(intptr_t) * count);
+          for (uint32_t i = 0; i < count; ++i)
+            {
+              if (p->kinds[i] != _KROKI_STATS_KIND_MAX
+                  && p->kinds[i] != _KROKI_STATS_KIND_MIN)
+                retired->values[i] -= values[i];
+            }
+        }
+    }
+
+  SYS(ftruncate(p->fd, size));
+  if (SYS(pwrite(p->fd, image, size, 0)) != (ssize_t) size)
+    error("%s: short write", p->filename);
+}
+
+
+int
+replay_next(struct replay *p)
+{
+  p->new_names = 0;
+
+  int type;
+  while ((type = getc(p->fp)) == 'N')
+    {
+      if (read_names(p) == -1)
+        return 0;
+    }
+  if (type == EOF)
+    return 0;
+  if (type != 'S' || ! p->have_names)
+    invalid(p);
+
+  uint64_t elapsed, freed, changed;
+  if (get_varint(p->fp, &elapsed) == -1
+      || get_changes(p, p->total) == -1
+      || get_varint(p->fp, &freed) == -1)
+    return 0;
+
+  while (freed--)
+    {
+      uint64_t index;
+      if (get_varint(p->fp, &index) == -1)
+        return 0;
+      if (index >= p->slot_count)
+        invalid(p);
+      p->tids[index] = 0;
+    }
+
+  if (get_varint(p->fp, &changed) == -1)
+    return 0;
+  while (changed--)
+    {
+      uint64_t index, tid;
+      if (get_varint(p->fp, &index) == -1
+          || get_varint(p->fp, &tid) == -1)
+        return 0;
+      if (index >= UINT32_MAX || tid == 0 || tid > LONG_MAX)
+        invalid(p);
+
+      grow_replay_slots(p, index + 1);
+      intptr_t *values = p->values + (size_t) p->count * index;
+      if (p->tids[index] != (long) tid)
+        {
+          p->tids[index] = tid;
+          for (uint32_t i = 0; i < p->count; ++i)
+            values[i] = stats_kind_initial_value(p->kinds[i]);
+        }
+      if (get_changes(p, values) == -1)
+        return 0;
+    }
+
+  p->elapsed = elapsed;
+  p->nsec += elapsed;
+  replay_write_image(p);
+
+  return 1;
+}
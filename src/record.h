@@ -0,0 +1,160 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RECORD_H
+#define RECORD_H 1
+
+#include "stats_reader.h"
+#include <stdio.h>
+#include <time.h>
+
+
+/*
+  Recording ('kroki-stats --record') is RECORD_MAGIC followed by
+  records of a type byte and the data.  Integers are LEB128 varints,
+  signed ones zigzag-encoded:
+
+    'N' names: timer frequency, number of values, and for every value
+        its kind byte and the length of its name plus one followed by
+        the name, or zero when the value has the name of the previous
+        one (values of a histogram, a timer or an array).
+
+    'S' sample: nanoseconds since the previous sample, then changes
+        of the totals, then the number of freed slots and their
+        indices, then the number of changed slots, each as slot
+        index, TID and the changes of its values.
+
+  Changes are the number of changed values followed by, for every
+  one, the gap from the previous changed index (from -1 for the
+  first) minus one and the signed difference.  Values of a slot with
+  a new TID change from the initial values.  A names record starts
+  over, with all values at their initial values and no slots.  So a
+  sample costs only the values that changed.
+*/
+#define RECORD_MAGIC  "KROKI-STATS-RECORD-1\n"
+
+
+struct recorder
+{
+  FILE *fp;
+  int have_names;
+  unsigned int generation;
+  struct timespec time;
+
+  uint32_t count;
+  intptr_t *total;
+  intptr_t *next;
+  intptr_t *prev_total;
+  intptr_t *values;
+
+  // Values of every slot as of the previous sample.
+  size_t slot_count;
+  long *tids;
+  long *new_tids;
+  intptr_t *slot_values;
+};
+
+
+void
+record_open(struct recorder *rec, const char *filename);
+
+
+void
+record_close(struct recorder *rec);
+
+
+/*
+  Append a sample of the values 'r' was last updated to, taken at
+  CLOCK_MONOTONIC time 'now'.
+*/
+void
+record_sample(struct recorder *rec, struct stats_reader *r,
+              const struct timespec *now);
+
+
+/*
+  Replay turns the samples of a recording into a stats file image in
+  a memory file that stats_reader reads as any other stats file by
+  the name in 'filename'.  When a names record starts over, the image
+  is a new file by the same name.  'nsec' is the time of the sample
+  since the start of the recording, 'elapsed' since the previous
+  sample, and 'new_names' is set for the first sample after a names
+  record.  'infos', when set, are the identities of the slots.
+*/
+struct replay
+{
+  FILE *fp;
+  const char *source;
+  int fd;
+  char filename[32];
+
+  int have_names;
+  uint64_t timer_frequency;
+  uint32_t count;
+  uint8_t *kinds;
+  uint32_t *names;
+  char *name_data;
+  size_t name_size;
+
+  intptr_t *total;
+  size_t slot_count;
+  long *tids;
+  intptr_t *values;
+  struct stats_thread_info *infos;
+
+  char *image;
+  size_t image_size;
+
+  uint64_t nsec;
+  uint64_t elapsed;
+  int new_names;
+};
+
+
+void
+replay_open(struct replay *p, const char *filename);
+
+
+void
+replay_close(struct replay *p);
+
+
+/*
+  Read the next sample and update the image.  Returns zero at the
+  end of the recording (a sample cut short by the recorder being
+  killed is the end too).
+*/
+int
+replay_next(struct replay *p);
+
+
+/*
+  Write the image of the names, 'total' and the slots, which is also
+  how merge.c makes one file of several.  replay_new_image() makes
+  the next image a new file, for when the names change.
+*/
+void
+replay_write_image(struct replay *p);
+
+
+void
+replay_new_image(struct replay *p);
+
+
+#endif  /* ! RECORD_H */
@@ -20,36 +20,205 @@
 #ifndef STATS_FILE_H
 #define STATS_FILE_H 1
 
+#include "kroki/bits/stats-module.h"
 #include <stdint.h>
 
 
-struct thread_slot
+/*
+  Stats file is a header followed by records, which are appended as
+  needed: a segment holds the names of the values of the modules that
+  were registered by the time it was appended (modules loaded later
+  with dlopen() get a segment of their own), and a chunk holds the
+  values of STATS_CHUNK_SLOTS threads in a given segment.  Every
+  thread has an index, and its values in segment S are the block
+  with that index in a chunk of S.  A name record gives the name of
+  a value registered at run time with stats_lookup().  Records start
+  at cache line boundary and are never moved, only free chunks at the
+  end of the file may be cut off.
+*/
+#define STATS_CHUNK_SLOTS  32
+
+#define STATS_RECORD_SEGMENT  1
+#define STATS_RECORD_CHUNK  2
+#define STATS_RECORD_NAME  3
+
+#define STATS_TOTALS_BLOCKS  2
+
+/*
+  Stats file starts with STATS_FILE_MAGIC, STATS_FILE_VERSION changes
+  when the format does in a way older readers wouldn't understand.
+*/
+#define STATS_FILE_MAGIC  0x6b737466 /* "kstf" */
+#define STATS_FILE_VERSION  1
+
+
+struct stats_file
 {
-  union {
-    intptr_t tid_neg;           /* < 0 */
-    intptr_t next_free_offset;  /* >= 0 */
-  };
-  intptr_t values[];
+  uint32_t magic;         /* STATS_FILE_MAGIC  */
+  uint32_t version;       /* STATS_FILE_VERSION  */
+  uint32_t records_end;   /* End of the last record, bytes from the
+                             start of the file, zero until the file
+                             is initialized.  */
+  uint32_t record_offset; /* Start of the first record.  */
+  uint32_t slot_count;    /* Number of thread indices in use or free.
+                             Blocks beyond are being given back and
+                             should not be accessed.  */
+  uint32_t cpu_count;     /* Number of per-CPU blocks of every
+                             segment, zero unless the file was
+                             opened with KROKI_STATS_PERCPU.  */
+  intptr_t retired_seq;   /* >= 0, odd while being updated */
+  uint64_t timer_frequency; /* Ticks of stats_timer() per second.  */
+  uint64_t generation;    /* Set when the file is created, tells it
+                             from earlier files of the same name even
+                             if the inode number is reused.  */
+  uint32_t totals_seq;    /* Number of times the aggregator thread
+                             published totals, futex word.  */
+  uint32_t totals_interval; /* Interval of the aggregator thread in
+                             milliseconds, zero if it doesn't run.  */
+  uint64_t totals_nsec;   /* CLOCK_MONOTONIC of the last publish.  */
+  uint32_t cut_count;     /* Number of times records were cut off,
+                             set after records_end is: appended
+                             records may bring it back to where it
+                             was.  */
 };
 
 
-struct stats_file
+struct stats_record
 {
-  uint32_t value_count; /* Number of stats values.  */
-  uint32_t slot_size;   /* Size of thread_slot, multiple of cache line size.  */
-  uint32_t slot_offset; /* Offset of the first struct thread_slot,
-                           bytes from &data[0] */
+  uint32_t type;          /* STATS_RECORD_*  */
+  uint32_t size;          /* Size of the record, multiple of cache
+                             line size.  */
+};
+
+
+struct stats_segment
+{
+  struct stats_record record;
+  uint32_t value_count;   /* Number of stats values.  */
+  uint32_t block_size;    /* Size of thread_slot, multiple of cache
+                             line size.  */
+  uint32_t retired_offset; /* Offset of the retired block, bytes from
+                             the start of the record.  */
   /*
     data[] layout:
 
       uint32_t x count         - name offsets, bytes from &data[0]
+      uint8_t x count          - value kinds, _KROKI_STATS_KIND_*
       char x L x count         - name strings
-      struct thread_slot x T   - per thread slots, each structure
-                                 aligned to the next cache line
-                                 and occupies slot_size bytes
+
+    Values of a histogram (_KROKI_STATS_HIST_VALUES of them) all refer
+    to the same name, and so do values of an array (as many as there
+    are adjacent _KROKI_STATS_KIND_ARRAY values with that name).
+
+    The retired block holds the values of exited threads (but for
+    _KROKI_STATS_KIND_LAST values), so that totals do not decrease.
+    Folding a thread and freeing its blocks is done under
+    stats_file.retired_seq as a sequential lock, the reader that reads
+    retired_seq before and after summing up all blocks gets consistent
+    totals if the two are equal and even.
+
+    The retired block is followed by stats_file.cpu_count per-CPU
+    blocks, which stats_add() updates for the CPU it runs on.  Like
+    the retired block they belong to no thread and count only
+    towards totals.
+
+    Then there are STATS_TOTALS_BLOCKS blocks where the aggregator
+    thread publishes the totals of the segment, alternately, in
+    block stats_file.totals_seq % STATS_TOTALS_BLOCKS.  The 'tid_neg'
+    of a totals block is the sequence number of its totals, or zero
+    while they are being written.  Files of older versions have no
+    totals blocks.
   */
   uint32_t data[];
 };
 
 
+struct stats_chunk
+{
+  struct stats_record record;
+  uint32_t segment;       /* Index of the segment, in record order.  */
+  uint32_t first_index;   /* Index of the thread of the first block,
+                             multiple of STATS_CHUNK_SLOTS.  */
+  uint32_t block_offset;  /* Offset of the first block, bytes from
+                             the start of the record.  */
+  /*
+    In chunks of the first segment the header is followed by
+    STATS_CHUNK_SLOTS stats_thread_info, one for every index of the
+    chunk (older files have none, their block_offset is smaller).
+  */
+};
+
+
+/*
+  Identity of the thread that owns a given index, written when the
+  thread gets the index, so that readers may group threads without
+  looking into /proc.  'comm' is the name of the thread at that time,
+  'group' is set with stats_set_thread_group(), empty otherwise.
+  Both are NUL-terminated unless they are being written.
+*/
+#define STATS_THREAD_NAME_SIZE  16
+
+struct stats_thread_info
+{
+  int32_t pid;
+  char comm[STATS_THREAD_NAME_SIZE];
+  char group[STATS_THREAD_NAME_SIZE];
+};
+
+
+/*
+  Values of a segment that have an empty name in the segment are
+  not in use until a name record names them.
+*/
+struct stats_name
+{
+  struct stats_record record;
+  uint32_t segment;       /* Index of the segment, in record order.  */
+  uint32_t value;         /* Index of the value in the segment.  */
+  char name[];
+};
+
+
+/*
+  Thread block.  The thread owns its index while its block in the
+  first segment (which always exists) has negative tid_neg, the free
+  list of indices is linked through the blocks of the first segment.
+  Blocks of other segments are attached when the thread first uses
+  the modules of a segment, and are valid while their tid_neg is
+  equal to that of the first block.
+*/
+struct thread_slot
+{
+  union {
+    intptr_t tid_neg;           /* < 0 */
+    intptr_t next_free;         /* >= 0, index + 1 of the next free */
+  };
+  intptr_t batch_seq;           /* odd while a stats_batch is updated */
+  intptr_t values[];
+};
+
+
+/*
+  Initial value of a thread value of a given kind.  Maximum and
+  minimum start from the identity of respective reduction, so that
+  the value that was never updated may be told apart.
+*/
+static inline
+intptr_t
+stats_kind_initial_value(uint8_t kind)
+{
+  switch (kind)
+    {
+    case _KROKI_STATS_KIND_MAX:
+      return INTPTR_MIN;
+
+    case _KROKI_STATS_KIND_MIN:
+      return INTPTR_MAX;
+
+    default:
+      return 0;
+    }
+}
+
+
 #endif  /* ! STATS_FILE_H */
@@ -0,0 +1,1367 @@
+/*
+  Copyright (C) 2012-2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "stats_reader.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+void
+stats_reader_init(struct stats_reader *r, const char *filename,
+                  int merge, int sorted)
+{
+  memset(r, 0, sizeof(*r));
+  r->filename = filename;
+  r->merge = merge;
+  r->sorted = sorted;
+  r->fd = -1;
+}
+
+
+void
+stats_reader_close(struct stats_reader *r)
+{
+  // The reader may be in a library, errors here are of no use anyway.
+  if (r->file)
+    {
+      (void) munmap(r->file, r->size);
+      r->file = NULL;
+    }
+  if (r->fd != -1)
+    {
+      (void) close(r->fd);
+      r->fd = -1;
+    }
+  r->size = 0;
+  r->records_end = 0;
+  r->cut_count = 0;
+
+  for (uint32_t s = 0; s < r->segment_count; ++s)
+    {
+      free(r->segments[s].chunks);
+      free(r->segments[s].infos);
+    }
+  free(r->segments);
+  r->segments = NULL;
+  r->segment_count = 0;
+
+  free(r->kinds);
+  free(r->names);
+  r->kinds = NULL;
+  r->names = NULL;
+  r->count = 0;
+
+  free(r->extremum_values);
+  free(r->extremums);
+  free(r->column);
+  free(r->entries);
+  r->extremum_values = NULL;
+  r->extremums = NULL;
+  r->column = NULL;
+  r->entries = NULL;
+
+  free(r->chunk_totals);
+  free(r->slot_tids);
+  r->chunk_totals = NULL;
+  r->chunk_totals_size = 0;
+  r->slot_tids = NULL;
+  r->slot_tid_count = 0;
+}
+
+
+/*
+  Resize array at '*parray' to 'count' elements of 'size' bytes.
+  Returns -1 with errno set to ENOMEM if it can't, the array is then
+  left as is.
+*/
+static
+int
+resize(void *parray, size_t count, size_t size)
+{
+  void *array;
+  memcpy(&array, parray, sizeof(array));
+  array = realloc(array, (count ? count : 1) * size);
+  if (! array)
+    return -1;
+  memcpy(parray, &array, sizeof(array));
+
+  return 0;
+}
+
+
+static
+int
+entry_compare(const void *a, const void *b, void *arg)
+{
+  const struct stats_reader *r = arg;
+  uint32_t i = *(const uint32_t *) a;
+  uint32_t j = *(const uint32_t *) b;
+
+  int res = strcmp(stats_reader_name(r, i), stats_reader_name(r, j));
+  if (res == 0)
+    res = (int) r->kinds[i] - (int) r->kinds[j];
+  if (res == 0)
+    res = (i > j) - (i < j);
+
+  return res;
+}
+
+
+/*
+  Values named at run time are not in use until named, they have
+  empty names till then and are not listed.
+*/
+static
+void
+list_entries(struct stats_reader *r)
+{
+  r->entry_count = 0;
+  for (uint32_t i = 0; i < r->count; i += stats_reader_width(r, i))
+    {
+      if (*stats_reader_name(r, i))
+        r->entries[r->entry_count++] = i;
+    }
+}
+
+
+static
+int
+index_values(struct stats_reader *r)
+{
+  uint32_t count = r->count;
+  if (resize(&r->entries, count, sizeof(*r->entries)) == -1
+      || resize(&r->column, count, sizeof(*r->column)) == -1
+      || resize(&r->extremums, count, sizeof(*r->extremums)) == -1
+      || resize(&r->extremum_values, count,
+                sizeof(*r->extremum_values)) == -1)
+    return -1;
+  r->extremum_count = 0;
+
+  list_entries(r);
+
+  for (uint32_t s = 0; s < r->segment_count; ++s)
+    {
+      struct stats_reader_segment *segment = &r->segments[s];
+      segment->first_extremum = r->extremum_count;
+      uint32_t end = segment->first_value + segment->value_count;
+      for (uint32_t i = segment->first_value; i < end; ++i)
+        {
+          r->column[i] = i;
+          if (r->kinds[i] == _KROKI_STATS_KIND_MAX
+              || r->kinds[i] == _KROKI_STATS_KIND_MIN)
+            r->extremums[r->extremum_count++] = i;
+        }
+      segment->extremum_count = r->extremum_count - segment->first_extremum;
+    }
+
+  if (! r->sorted && ! r->merge)
+    return 0;
+
+  qsort_r(r->entries, r->entry_count, sizeof(*r->entries),
+          entry_compare, r);
+
+  if (r->merge && r->entry_count)
+    {
+      uint32_t first = r->entries[0];
+      for (uint32_t e = 1; e < r->entry_count; ++e)
+        {
+          uint32_t i = r->entries[e];
+          uint32_t width = stats_reader_width(r, i);
+          if (strcmp(stats_reader_name(r, i),
+                     stats_reader_name(r, first)) == 0
+              && r->kinds[i] == r->kinds[first]
+              && width == stats_reader_width(r, first))
+            {
+              for (uint32_t j = 0; j < width; ++j)
+                r->column[i + j] = first + j;
+            }
+          else
+            {
+              first = i;
+            }
+        }
+    }
+
+  if (! r->sorted)
+    {
+      // Restore file order.
+      list_entries(r);
+    }
+
+  return 0;
+}
+
+
+static
+int
+fail(struct stats_reader *r, const char *error)
+{
+  int saved_errno = (error ? EINVAL : errno);
+  r->error = (error ? error : strerror(saved_errno));
+  stats_reader_close(r);
+  errno = saved_errno;
+
+  return -1;
+}
+
+
+static
+int
+add_segment(struct stats_reader *r, uint32_t offset)
+{
+  const struct stats_segment *segment = (const struct stats_segment *)
+    ((const char *) r->file + offset);
+  uint32_t size = segment->record.size;
+  uint32_t count = segment->value_count;
+  size_t data_size = size - offsetof(struct stats_segment, data);
+  if (size < offsetof(struct stats_segment, data)
+      || data_size / (sizeof(uint32_t) + sizeof(uint8_t)) < count
+      || (segment->block_size
+          < sizeof(struct thread_slot) + sizeof(intptr_t) * count)
+      || segment->retired_offset > size
+      || ((size - segment->retired_offset) / segment->block_size
+          < 1 + (size_t) r->file->cpu_count))
+    return -1;
+
+  // Names are between the kinds and the retired block.
+  size_t names_start = (sizeof(uint32_t) + sizeof(uint8_t)) * count;
+  size_t names_end = (segment->retired_offset
+                      - offsetof(struct stats_segment, data));
+  const char *data = (const char *) segment->data;
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      uint32_t name = segment->data[i];
+      if (name < names_start || name >= names_end
+          || ! memchr(data + name, '\0', names_end - name))
+        return -1;
+    }
+
+  if (resize(&r->segments, r->segment_count + 1, sizeof(*r->segments)) == -1
+      || resize(&r->kinds, r->count + count, sizeof(*r->kinds)) == -1
+      || resize(&r->names, r->count + count, sizeof(*r->names)) == -1)
+    return -1;
+  r->segments[r->segment_count++] = (struct stats_reader_segment) {
+    .offset = offset,
+    .retired = offset + segment->retired_offset,
+    .value_count = count,
+    .block_size = segment->block_size,
+    .first_value = r->count
+  };
+  if ((size - segment->retired_offset) / segment->block_size
+      >= 1 + (size_t) r->file->cpu_count + STATS_TOTALS_BLOCKS)
+    r->segments[r->segment_count - 1].totals =
+      (offset + segment->retired_offset
+       + segment->block_size * (1 + r->file->cpu_count));
+
+  memcpy(r->kinds + r->count, data + sizeof(uint32_t) * count, count);
+  uint32_t base = (data - (const char *) r->file);
+  for (uint32_t i = 0; i < count; ++i)
+    r->names[r->count + i] = base + segment->data[i];
+  r->count += count;
+
+  return 0;
+}
+
+
+static
+int
+add_chunk(struct stats_reader *r, uint32_t offset, uint32_t segment_count)
+{
+  const struct stats_chunk *chunk = (const struct stats_chunk *)
+    ((const char *) r->file + offset);
+  uint32_t size = chunk->record.size;
+  if (size < sizeof(*chunk)
+      || chunk->segment >= segment_count
+      || chunk->first_index % STATS_CHUNK_SLOTS != 0
+      || chunk->block_offset < sizeof(*chunk)
+      || chunk->block_offset > size)
+    return -1;
+
+  struct stats_reader_segment *segment = &r->segments[chunk->segment];
+  if ((size - chunk->block_offset) / STATS_CHUNK_SLOTS < segment->block_size)
+    return -1;
+
+  uint32_t c = chunk->first_index / STATS_CHUNK_SLOTS;
+  if (c >= segment->chunk_count)
+    {
+      uint32_t chunk_count = (c + 1) * 2;
+      if (resize(&segment->chunks, chunk_count,
+                 sizeof(*segment->chunks)) == -1
+          || resize(&segment->infos, chunk_count,
+                    sizeof(*segment->infos)) == -1)
+        return -1;
+      memset(segment->chunks + segment->chunk_count, 0,
+             sizeof(*segment->chunks) * (chunk_count - segment->chunk_count));
+      memset(segment->infos + segment->chunk_count, 0,
+             sizeof(*segment->infos) * (chunk_count - segment->chunk_count));
+      segment->chunk_count = chunk_count;
+    }
+  segment->chunks[c] = offset + chunk->block_offset;
+  if (chunk->segment == 0
+      && (chunk->block_offset - sizeof(*chunk)
+          >= sizeof(struct stats_thread_info) * STATS_CHUNK_SLOTS))
+    segment->infos[c] = offset + sizeof(*chunk);
+
+  return 0;
+}
+
+
+static
+int
+add_name(struct stats_reader *r, uint32_t offset, uint32_t segment_count,
+         int *renamed)
+{
+  const struct stats_name *record = (const struct stats_name *)
+    ((const char *) r->file + offset);
+  uint32_t size = record->record.size;
+  if (size <= offsetof(struct stats_name, name)
+      || record->segment >= segment_count
+      || record->value >= r->segments[record->segment].value_count
+      || ! memchr(record->name, '\0', size - offsetof(struct stats_name, name)))
+    return -1;
+
+  uint32_t i = r->segments[record->segment].first_value + record->value;
+  uint32_t name = offset + offsetof(struct stats_name, name);
+  if (r->names[i] != name)
+    {
+      r->names[i] = name;
+      *renamed = 1;
+    }
+
+  return 0;
+}
+
+
+/*
+  Walk the records anew when there are new ones or some were cut off.
+  Records that are not mapped yet are picked up on the next update.
+*/
+static
+int
+index_records(struct stats_reader *r)
+{
+  // Records_end that is as new as cut_count, or newer.
+  uint32_t cut_count = __atomic_load_n(&r->file->cut_count, __ATOMIC_ACQUIRE);
+  uint32_t records_end = __atomic_load_n(&r->file->records_end,
+                                         __ATOMIC_ACQUIRE);
+  if (cut_count != r->cut_count)
+    {
+      // Records were cut off, and maybe appended up to the same end.
+      r->cut_count = cut_count;
+      r->records_end = 0;
+    }
+  if (records_end == r->records_end)
+    return 0;
+
+  // Set before records_end is.
+  if (r->file->magic != STATS_FILE_MAGIC
+      || r->file->version != STATS_FILE_VERSION)
+    return -1;
+
+  for (uint32_t s = 0; s < r->segment_count; ++s)
+    {
+      struct stats_reader_segment *segment = &r->segments[s];
+      memset(segment->chunks, 0,
+             sizeof(*segment->chunks) * segment->chunk_count);
+      memset(segment->infos, 0,
+             sizeof(*segment->infos) * segment->chunk_count);
+    }
+
+  uint32_t segment_count = r->segment_count;
+  int renamed = 0;
+  uint32_t s = 0;
+  size_t offset = r->file->record_offset;
+  if (offset < sizeof(struct stats_file) || offset > r->size)
+    return -1;
+  while (offset < records_end
+         && r->size - offset >= sizeof(struct stats_record))
+    {
+      const struct stats_record *record = (const struct stats_record *)
+        ((const char *) r->file + offset);
+      uint32_t size = record->size;
+      if (size < sizeof(*record) || size % sizeof(intptr_t) != 0)
+        return -1;
+      if (size > r->size - offset)
+        break;
+
+      switch (record->type)
+        {
+        case STATS_RECORD_SEGMENT:
+          if (s == r->segment_count)
+            {
+              if (add_segment(r, offset) == -1)
+                return -1;
+            }
+          else if (r->segments[s].offset != offset)
+            {
+              return -1;
+            }
+          ++s;
+          break;
+
+        case STATS_RECORD_CHUNK:
+          if (add_chunk(r, offset, s) == -1)
+            return -1;
+          break;
+
+        case STATS_RECORD_NAME:
+          if (add_name(r, offset, s, &renamed) == -1)
+            return -1;
+          break;
+
+        default:
+          return -1;
+        }
+
+      offset += size;
+    }
+  r->records_end = offset;
+
+  if (r->segment_count != segment_count || renamed)
+    {
+      if (index_values(r) == -1)
+        return -1;
+      ++r->generation;
+    }
+
+  return 0;
+}
+
+
+int
+stats_reader_update(struct stats_reader *r)
+{
+  struct stat fstats;
+
+  r->error = NULL;
+
+  if (r->fd != -1)
+    {
+      // Start over if the file was replaced.
+      int res = stat(r->filename, &fstats);
+      if (res == -1 || fstats.st_ino != r->ino)
+        stats_reader_close(r);
+    }
+
+  if (r->fd == -1)
+    {
+      r->fd = open(r->filename, O_RDONLY);
+      if (r->fd == -1)
+        return fail(r, NULL);
+    }
+
+  if (fstat(r->fd, &fstats) == -1)
+    return fail(r, NULL);
+
+  if (! S_ISREG(fstats.st_mode))
+    return fail(r, "not a regular file");
+
+  r->ino = fstats.st_ino;
+
+  if ((size_t) fstats.st_size != r->size || ! r->file)
+    {
+      if (r->file)
+        (void) munmap(r->file, r->size);
+      r->file = NULL;
+      r->size = fstats.st_size;
+
+      if (r->size == 0)
+        return 0;
+
+      if (r->size < sizeof(struct stats_file))
+        return fail(r, "invalid file format");
+
+      // Huge pages of hugetlbfs are not to be reserved for the reader.
+      void *file = mmap(NULL, r->size, PROT_READ, MAP_SHARED | MAP_NORESERVE,
+                        r->fd, 0);
+      if (file == MAP_FAILED)
+        return fail(r, NULL);
+      r->file = file;
+
+      // Chunks might have been cut off, walk the records again.
+      r->records_end = 0;
+    }
+
+  // Format errors leave errno as is.
+  errno = 0;
+  if (index_records(r) == -1)
+    return fail(r, (errno == ENOMEM ? NULL : "invalid file format"));
+
+  return (r->count ? 1 : 0);
+}
+
+
+static inline
+const struct thread_slot *
+segment_block(const struct stats_reader *r,
+              const struct stats_reader_segment *segment, long index)
+{
+  uint32_t c = index / STATS_CHUNK_SLOTS;
+  if (c >= segment->chunk_count || ! segment->chunks[c])
+    return NULL;
+
+  return (const struct thread_slot *)
+    ((const char *) r->file + segment->chunks[c]
+     + (size_t) segment->block_size * (index % STATS_CHUNK_SLOTS));
+}
+
+
+int
+stats_reader_thread_info(const struct stats_reader *r, long index,
+                         struct stats_thread_info *info)
+{
+  if (! r->segment_count)
+    return -1;
+
+  const struct stats_reader_segment *segment = &r->segments[0];
+  uint32_t c = index / STATS_CHUNK_SLOTS;
+  if (c >= segment->chunk_count || ! segment->infos[c])
+    return -1;
+
+  memcpy(info, ((const struct stats_thread_info *)
+                ((const char *) r->file + segment->infos[c])
+                + index % STATS_CHUNK_SLOTS), sizeof(*info));
+  info->comm[sizeof(info->comm) - 1] = '\0';
+  info->group[sizeof(info->group) - 1] = '\0';
+
+  return 0;
+}
+
+
+long
+stats_reader_next_slot(struct stats_reader *r, long index)
+{
+  if (! r->segment_count)
+    return -1;
+
+  if (index < 0)
+    {
+      r->data_start = 0;
+      r->data_end = 0;
+    }
+
+  const struct stats_reader_segment *segment = &r->segments[0];
+  uint32_t slot_count = __atomic_load_n(&r->file->slot_count,
+                                        __ATOMIC_ACQUIRE);
+  ++index;
+  while (index < slot_count)
+    {
+      const struct thread_slot *slot = segment_block(r, segment, index);
+      // Chunk that is not indexed yet.
+      if (! slot)
+        return -1;
+
+      size_t offset = (const char *) slot - (const char *) r->file;
+      if (offset < r->data_start || offset >= r->data_end)
+        {
+          off_t data = lseek(r->fd, offset, SEEK_DATA);
+          if (data == -1)
+            {
+              // ENXIO means there's no data past 'offset'.
+              if (errno == ENXIO)
+                return -1;
+
+              // Holes are not supported, the whole file is data.
+              r->data_start = 0;
+              r->data_end = r->size;
+            }
+          else
+            {
+              off_t hole = lseek(r->fd, data, SEEK_HOLE);
+              r->data_start = data;
+              r->data_end = (hole == -1 ? r->size : (size_t) hole);
+            }
+        }
+
+      if (offset >= r->data_start)
+        return index;
+
+      // Advance to the first block that starts in the data.
+      long next = index + ((r->data_start - offset + segment->block_size - 1)
+                           / segment->block_size);
+      long chunk_end = index - index % STATS_CHUNK_SLOTS + STATS_CHUNK_SLOTS;
+      index = (next < chunk_end ? next : chunk_end);
+    }
+
+  return -1;
+}
+
+
+/*
+  A thread keeps batch_seq odd while it updates values in a
+  stats_batch, and the values are consistent if batch_seq was even
+  and didn't change while they were read.  Batches are short, but
+  the thread may be preempted in the middle of one, so we yield once
+  in a while and don't wait forever.
+*/
+#define BATCH_ATTEMPTS  100
+#define BATCH_SPINS  10
+
+
+/*
+  Block of the thread in a given segment, or NULL if the thread
+  doesn't use the modules of the segment.
+*/
+static inline
+const struct thread_slot *
+thread_block(const struct stats_reader *r,
+             const struct stats_reader_segment *segment, long index,
+             intptr_t tid_neg)
+{
+  const struct thread_slot *block = segment_block(r, segment, index);
+  if (block && __atomic_load_n(&block->tid_neg, __ATOMIC_ACQUIRE) == tid_neg)
+    return block;
+
+  return NULL;
+}
+
+
+static
+void
+copy_values(const struct stats_reader *r, const struct thread_slot *slot,
+            long index, intptr_t *values)
+{
+  memcpy(values, slot->values, sizeof(intptr_t) * r->segments[0].value_count);
+
+  for (uint32_t s = 1; s < r->segment_count; ++s)
+    {
+      const struct stats_reader_segment *segment = &r->segments[s];
+      intptr_t *dst = values + segment->first_value;
+      const struct thread_slot *block =
+        thread_block(r, segment, index, slot->tid_neg);
+      if (block)
+        {
+          memcpy(dst, block->values, sizeof(intptr_t) * segment->value_count);
+        }
+      else
+        {
+          const uint8_t *kinds = r->kinds + segment->first_value;
+          for (uint32_t i = 0; i < segment->value_count; ++i)
+            dst[i] = stats_kind_initial_value(kinds[i]);
+        }
+    }
+}
+
+
+long
+stats_reader_read_slot(const struct stats_reader *r, long index,
+                       intptr_t *values)
+{
+  const struct thread_slot *slot = segment_block(r, &r->segments[0], index);
+  if (! slot)
+    return 0;
+
+  /*
+    We avoid processing values while they are being reset when
+    thread index is about to be reused.  As TIDs aren't reused
+    right away this works very much like sequential lock.
+  */
+  long tid = -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+  for (int attempt = 1; tid > 0; ++attempt)
+    {
+      intptr_t seq = __atomic_load_n(&slot->batch_seq, __ATOMIC_ACQUIRE);
+      if ((seq & 1) && attempt < BATCH_ATTEMPTS)
+        {
+          if (attempt % BATCH_SPINS == 0)
+            sched_yield();
+          tid = -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+          continue;
+        }
+
+      copy_values(r, slot, index, values);
+
+      // Emit compiler barrier and load-load memory barrier.
+      __atomic_signal_fence(__ATOMIC_ACQ_REL);
+      __atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+
+      long new_tid = -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+      if (tid == new_tid
+          && (__atomic_load_n(&slot->batch_seq, __ATOMIC_RELAXED) == seq
+              || attempt >= BATCH_ATTEMPTS))
+        break;
+
+      tid = new_tid;
+    }
+
+  return tid;
+}
+
+
+static
+void
+reduce_value(uint8_t kind, intptr_t *total, intptr_t value)
+{
+  switch (kind)
+    {
+    case _KROKI_STATS_KIND_MAX:
+      if (*total < value)
+        *total = value;
+      break;
+
+    case _KROKI_STATS_KIND_MIN:
+      if (*total > value)
+        *total = value;
+      break;
+
+    default:
+      *total += value;
+      break;
+    }
+}
+
+
+/*
+  Reduction kernel: dst[i] = a[i] + b[i] for every value.  GCC
+  vector extension makes it SIMD on any architecture that has one
+  (and plain scalar code otherwise) without -ftree-vectorize.  Values
+  in a thread slot are only pointer-aligned, hence the alignment of
+  vector type is lowered.  Maximums and minimums are fixed up by the
+  caller.
+*/
+typedef intptr_t vector_t
+__attribute__((__vector_size__(32), __aligned__(__SIZEOF_POINTER__),
+               __may_alias__));
+
+static
+void
+add_values(uint32_t count, intptr_t *dst,
+           const intptr_t *a, const intptr_t *b)
+{
+  const uint32_t step = sizeof(vector_t) / sizeof(intptr_t);
+  uint32_t i = 0;
+  for (; i + step <= count; i += step)
+    *(vector_t *) &dst[i] = (*(const vector_t *) &a[i]
+                             + *(const vector_t *) &b[i]);
+  for (; i < count; ++i)
+    dst[i] = a[i] + b[i];
+}
+
+
+/*
+  Reduce the values of a segment, 'dst' and 'total' hold the values
+  of all segments, 'values' those of the segment only.
+*/
+static
+void
+reduce_segment(struct stats_reader *r,
+               const struct stats_reader_segment *segment,
+               intptr_t *dst, const intptr_t *total, const intptr_t *values)
+{
+  uint32_t first = segment->first_value;
+  uint32_t end = segment->first_extremum + segment->extremum_count;
+  for (uint32_t k = segment->first_extremum; k < end; ++k)
+    {
+      uint32_t i = r->extremums[k];
+      r->extremum_values[k] = total[i];
+      reduce_value(r->kinds[i], &r->extremum_values[k], values[i - first]);
+    }
+
+  add_values(segment->value_count, dst + first, total + first, values);
+
+  for (uint32_t k = segment->first_extremum; k < end; ++k)
+    dst[r->extremums[k]] = r->extremum_values[k];
+}
+
+
+static
+void
+sum_values(struct stats_reader *r, const struct thread_slot *slot,
+           long index, intptr_t *dst, const intptr_t *total)
+{
+  reduce_segment(r, &r->segments[0], dst, total, slot->values);
+
+  for (uint32_t s = 1; s < r->segment_count; ++s)
+    {
+      const struct stats_reader_segment *segment = &r->segments[s];
+      const struct thread_slot *block =
+        thread_block(r, segment, index, slot->tid_neg);
+      if (block)
+        reduce_segment(r, segment, dst, total, block->values);
+      else if (dst != total)
+        memcpy(dst + segment->first_value, total + segment->first_value,
+               sizeof(intptr_t) * segment->value_count);
+    }
+}
+
+
+long
+stats_reader_sum_slot(struct stats_reader *r, long index,
+                      intptr_t **total, intptr_t **next)
+{
+  const struct thread_slot *slot = segment_block(r, &r->segments[0], index);
+  if (! slot)
+    return 0;
+
+  long tid = -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+  for (int attempt = 1; tid > 0; ++attempt)
+    {
+      intptr_t seq = __atomic_load_n(&slot->batch_seq, __ATOMIC_ACQUIRE);
+      if ((seq & 1) && attempt < BATCH_ATTEMPTS)
+        {
+          if (attempt % BATCH_SPINS == 0)
+            sched_yield();
+          tid = -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+          continue;
+        }
+
+      sum_values(r, slot, index, *next, *total);
+
+      // Emit compiler barrier and load-load memory barrier.
+      __atomic_signal_fence(__ATOMIC_ACQ_REL);
+      __atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+
+      long new_tid = -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE);
+      if (tid == new_tid
+          && (__atomic_load_n(&slot->batch_seq, __ATOMIC_RELAXED) == seq
+              || attempt >= BATCH_ATTEMPTS))
+        {
+          intptr_t *tmp = *total;
+          *total = *next;
+          *next = tmp;
+          break;
+        }
+
+      tid = new_tid;
+    }
+
+  return (tid > 0 ? tid : 0);
+}
+
+
+void
+stats_reader_reset_total(const struct stats_reader *r, intptr_t *total)
+{
+  for (uint32_t i = 0; i < r->count; ++i)
+    total[i] = stats_kind_initial_value(r->kinds[i]);
+}
+
+
+/*
+  Exiting threads normally don't keep retired blocks locked for long,
+  but we don't want to wait forever either.
+*/
+#define SUM_ATTEMPTS  100
+
+
+/*
+  Sum up the slots with indices in [begin, end).
+*/
+static
+void
+sum_slots(struct stats_reader *r, long begin, long end,
+          intptr_t **total, intptr_t **next)
+{
+  long index = begin - 1;
+  while ((index = stats_reader_next_slot(r, index)) != -1 && index < end)
+    stats_reader_sum_slot(r, index, total, next);
+}
+
+
+static inline
+intptr_t *
+chunk_total(const struct stats_reader *r, long c)
+{
+  return r->chunk_totals + (size_t) r->count * (2 + c);
+}
+
+
+/*
+  Sum up the slots of chunks [begin, end) into the partial totals of
+  the chunks, and remember the TID of every slot.  '*total' and
+  '*next' are scratch arrays.
+*/
+static
+void
+sum_chunks(struct stats_reader *r, long begin, long end,
+           intptr_t **total, intptr_t **next)
+{
+  memset(r->slot_tids + begin * STATS_CHUNK_SLOTS, 0,
+         sizeof(*r->slot_tids) * (end - begin) * STATS_CHUNK_SLOTS);
+
+  long index = stats_reader_next_slot(r, begin * STATS_CHUNK_SLOTS - 1);
+  for (long c = begin; c < end; ++c)
+    {
+      stats_reader_reset_total(r, *total);
+      long chunk_end = (c + 1) * STATS_CHUNK_SLOTS;
+      for (; index != -1 && index < chunk_end;
+           index = stats_reader_next_slot(r, index))
+        r->slot_tids[index] = stats_reader_sum_slot(r, index, total, next);
+      memcpy(chunk_total(r, c), *total, sizeof(intptr_t) * r->count);
+    }
+}
+
+
+/*
+  Sum up again the chunks that have a slot whose thread is not the
+  one that was summed up: it has exited (and its values may be in the
+  retired blocks), or it has exited and a new thread took the index.
+  Slots that were free are not checked, as they may be in a hole.
+*/
+static
+void
+sum_changed_chunks(struct stats_reader *r, long chunk_count)
+{
+  const struct stats_reader_segment *segment = &r->segments[0];
+  intptr_t *total = r->chunk_totals;
+  intptr_t *next = total + r->count;
+  for (long c = 0; c < chunk_count; ++c)
+    {
+      long index = c * STATS_CHUNK_SLOTS;
+      for (; index < (c + 1) * STATS_CHUNK_SLOTS; ++index)
+        {
+          long tid = r->slot_tids[index];
+          if (! tid)
+            continue;
+
+          const struct thread_slot *slot = segment_block(r, segment, index);
+          if (! slot
+              || -__atomic_load_n(&slot->tid_neg, __ATOMIC_ACQUIRE) != tid)
+            {
+              sum_chunks(r, c, c + 1, &total, &next);
+              break;
+            }
+        }
+    }
+}
+
+
+struct sum_job
+{
+  struct stats_reader reader;
+  long begin;
+  long end;
+  intptr_t *total;
+  intptr_t *next;
+  pthread_t thread;
+  int threaded;
+};
+
+
+static
+void *
+sum_job_run(void *arg)
+{
+  struct sum_job *job = arg;
+  sum_chunks(&job->reader, job->begin, job->end, &job->total, &job->next);
+
+  return NULL;
+}
+
+
+/*
+  Jobs scan with private copies of the reader, which share the index
+  of the file and the partial totals of the chunks but not the data
+  extent of stats_reader_next_slot() nor the scratch buffer of
+  reduce_segment().  The calling thread runs the first job, and the
+  jobs that can't have a thread of their own.  Without memory for
+  the jobs the scan is done by the calling thread alone.
+*/
+static
+void
+sum_jobs(struct stats_reader *r, long chunk_count)
+{
+  int jobs = (r->jobs < chunk_count ? r->jobs : chunk_count);
+  uint32_t count = r->count;
+  struct sum_job *job = NULL;
+  intptr_t *buffers = NULL;
+  if (jobs > 1)
+    {
+      job = calloc(jobs, sizeof(*job));
+      // Scratch and extremum values of every job.
+      buffers = malloc(sizeof(*buffers) * count * 3 * jobs);
+    }
+  if (! job || ! buffers)
+    {
+      free(buffers);
+      free(job);
+      intptr_t *total = r->chunk_totals;
+      intptr_t *next = total + count;
+      sum_chunks(r, 0, chunk_count, &total, &next);
+      return;
+    }
+
+  for (int j = 0; j < jobs; ++j)
+    {
+      job[j].reader = *r;
+      job[j].reader.data_start = 0;
+      job[j].reader.data_end = 0;
+      job[j].reader.extremum_values = buffers + count * (3 * j + 2);
+      job[j].begin = chunk_count * j / jobs;
+      job[j].end = chunk_count * (j + 1) / jobs;
+      job[j].total = buffers + count * 3 * j;
+      job[j].next = job[j].total + count;
+      if (j > 0)
+        job[j].threaded = (pthread_create(&job[j].thread, NULL,
+                                          sum_job_run, &job[j]) == 0);
+    }
+
+  for (int j = 0; j < jobs; ++j)
+    {
+      if (! job[j].threaded)
+        sum_job_run(&job[j]);
+    }
+  for (int j = 1; j < jobs; ++j)
+    {
+      if (job[j].threaded)
+        (void) pthread_join(job[j].thread, NULL);
+    }
+
+  free(buffers);
+  free(job);
+}
+
+
+/*
+  Buffers of stats_reader_sum() for 'chunk_count' chunks.  Returns -1
+  when out of memory.
+*/
+static
+int
+sum_buffers(struct stats_reader *r, long chunk_count)
+{
+  size_t size = (size_t) r->count * (2 + chunk_count);
+  if (size > r->chunk_totals_size)
+    {
+      if (resize(&r->chunk_totals, size, sizeof(*r->chunk_totals)) == -1)
+        return -1;
+      r->chunk_totals_size = size;
+    }
+
+  size_t slot_count = (size_t) chunk_count * STATS_CHUNK_SLOTS;
+  if (slot_count > r->slot_tid_count)
+    {
+      if (resize(&r->slot_tids, slot_count, sizeof(*r->slot_tids)) == -1)
+        return -1;
+      r->slot_tid_count = slot_count;
+    }
+
+  return 0;
+}
+
+
+/*
+  Reduce the retired and the per-CPU blocks of every segment into
+  'total'.  Returns the retired_seq they were read at, which is even
+  unless the writer is too slow.
+*/
+static
+intptr_t
+sum_retired(struct stats_reader *r, intptr_t *total)
+{
+  const struct stats_file *file = r->file;
+
+  for (int attempt = 1; ; ++attempt)
+    {
+      intptr_t seq = __atomic_load_n(&file->retired_seq, __ATOMIC_ACQUIRE);
+      if ((seq & 1) && attempt < SUM_ATTEMPTS)
+        {
+          sched_yield();
+          continue;
+        }
+
+      stats_reader_reset_total(r, total);
+      for (uint32_t s = 0; s < r->segment_count; ++s)
+        {
+          const struct stats_reader_segment *segment = &r->segments[s];
+          const struct thread_slot *retired = (const struct thread_slot *)
+            ((const char *) file + segment->retired);
+          reduce_segment(r, segment, total, total, retired->values);
+
+          // Per-CPU blocks follow the retired one.
+          for (uint32_t i = 1; i <= file->cpu_count; ++i)
+            {
+              const struct thread_slot *block = (const struct thread_slot *)
+                ((const char *) retired + (size_t) segment->block_size * i);
+              reduce_segment(r, segment, total, total, block->values);
+            }
+        }
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&file->retired_seq, __ATOMIC_RELAXED) == seq
+          || attempt >= SUM_ATTEMPTS)
+        return seq;
+    }
+}
+
+
+/*
+  Published totals are taken as long as the aggregator thread is
+  no more than a couple of intervals late.
+*/
+#define TOTALS_LATE_NSEC(interval_ms)  ((2 * (uint64_t) (interval_ms) + 10) \
+                                        * 1000000)
+
+
+// UINT64_MAX if the clock can't be read, so that totals are late.
+static
+uint64_t
+monotonic_nsec(void)
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    return UINT64_MAX;
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/*
+  Totals published by the aggregator thread of the application.
+  Returns 0, or -1 if there are none, they are late, or some segment
+  has none yet.
+*/
+static
+int
+read_totals(struct stats_reader *r, intptr_t *total)
+{
+  const struct stats_file *file = r->file;
+  uint32_t interval = __atomic_load_n(&file->totals_interval,
+                                      __ATOMIC_RELAXED);
+  if (! interval)
+    return -1;
+
+  uint32_t seq = __atomic_load_n(&file->totals_seq, __ATOMIC_ACQUIRE);
+  uint64_t published = __atomic_load_n(&file->totals_nsec, __ATOMIC_RELAXED);
+  if (monotonic_nsec() - published > TOTALS_LATE_NSEC(interval))
+    return -1;
+
+  stats_reader_reset_total(r, total);
+  for (uint32_t s = 0; s < r->segment_count; ++s)
+    {
+      const struct stats_reader_segment *segment = &r->segments[s];
+      if (! segment->totals)
+        return -1;
+
+      const struct thread_slot *block = (const struct thread_slot *)
+        ((const char *) file + segment->totals
+         + (size_t) segment->block_size * (seq % STATS_TOTALS_BLOCKS));
+      if (__atomic_load_n(&block->tid_neg, __ATOMIC_ACQUIRE) != seq)
+        return -1;
+
+      reduce_segment(r, segment, total, total, block->values);
+
+      // The block is written over two publishes later.
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&block->tid_neg, __ATOMIC_RELAXED) != seq)
+        return -1;
+    }
+
+  return 0;
+}
+
+
+int
+stats_reader_wait_totals(struct stats_reader *r, long timeout_ms)
+{
+  const struct stats_file *file = r->file;
+  if (! file || ! __atomic_load_n(&file->totals_interval, __ATOMIC_RELAXED))
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  uint32_t seq = __atomic_load_n(&file->totals_seq, __ATOMIC_ACQUIRE);
+  struct timespec timeout = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_nsec = timeout_ms % 1000 * 1000000
+  };
+  // The aggregator is in another process, the futex is not private.
+  long res = syscall(SYS_futex, &file->totals_seq, FUTEX_WAIT, seq,
+                     &timeout, NULL, 0);
+  if (res == -1 && errno != EAGAIN && errno != EINTR)
+    {
+      if (errno == ETIMEDOUT)
+        return 0;
+      return -1;
+    }
+
+  return 1;
+}
+
+
+/*
+  An exiting thread folds its values into the retired blocks and
+  frees its index under retired_seq.  The slots are summed up first,
+  and the retired blocks are read after them, so a thread that exits
+  in between would be counted twice: the chunks of the slots that
+  changed since are summed up again.  Only the retired blocks and the
+  slots are read again when some thread exits meanwhile, not the
+  values of all threads.
+*/
+void
+stats_reader_sum(struct stats_reader *r, intptr_t **total, intptr_t **next)
+{
+  const struct stats_file *file = r->file;
+
+  if (r->aggregated && read_totals(r, *total) == 0)
+    return;
+
+  uint32_t slot_count = __atomic_load_n(&file->slot_count, __ATOMIC_ACQUIRE);
+  long chunk_count = (slot_count + STATS_CHUNK_SLOTS - 1) / STATS_CHUNK_SLOTS;
+  if (sum_buffers(r, chunk_count) == -1)
+    {
+      // A thread that exits meanwhile may be counted twice then.
+      sum_retired(r, *total);
+      sum_slots(r, 0, slot_count, total, next);
+      return;
+    }
+
+  sum_jobs(r, chunk_count);
+
+  for (int attempt = 1; ; ++attempt)
+    {
+      intptr_t seq = sum_retired(r, *total);
+      sum_changed_chunks(r, chunk_count);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&file->retired_seq, __ATOMIC_RELAXED) == seq
+          || attempt >= SUM_ATTEMPTS)
+        break;
+    }
+
+  for (long c = 0; c < chunk_count; ++c)
+    stats_reader_reduce(r, *total, *total, chunk_total(r, c));
+}
+
+
+void
+stats_reader_reduce_columns(struct stats_reader *r, intptr_t *dst,
+                            const uint32_t *columns, const intptr_t *values)
+{
+  for (uint32_t k = 0; k < r->extremum_count; ++k)
+    {
+      uint32_t i = r->extremums[k];
+      if (columns[i] != STATS_READER_NO_COLUMN)
+        r->extremum_values[k] = dst[columns[i]];
+    }
+
+  // Values that go to adjacent columns are added up as a run.
+  uint32_t i = 0;
+  while (i < r->count)
+    {
+      if (columns[i] == STATS_READER_NO_COLUMN)
+        {
+          ++i;
+          continue;
+        }
+
+      uint32_t j = i + 1;
+      while (j < r->count && columns[j] == columns[i] + (j - i))
+        ++j;
+      intptr_t *run = dst + columns[i];
+      add_values(j - i, run, run, values + i);
+      i = j;
+    }
+
+  // Several values of the file may go to one column.
+  for (uint32_t k = 0; k < r->extremum_count; ++k)
+    {
+      uint32_t i = r->extremums[k];
+      if (columns[i] != STATS_READER_NO_COLUMN)
+        dst[columns[i]] = r->extremum_values[k];
+    }
+  for (uint32_t k = 0; k < r->extremum_count; ++k)
+    {
+      uint32_t i = r->extremums[k];
+      if (columns[i] != STATS_READER_NO_COLUMN)
+        reduce_value(r->kinds[i], &dst[columns[i]], values[i]);
+    }
+}
+
+
+void
+stats_reader_reduce(struct stats_reader *r, intptr_t *dst,
+                    const intptr_t *total, const intptr_t *values)
+{
+  for (uint32_t s = 0; s < r->segment_count; ++s)
+    {
+      const struct stats_reader_segment *segment = &r->segments[s];
+      reduce_segment(r, segment, dst, total, values + segment->first_value);
+    }
+}
+
+
+void
+stats_reader_merge(const struct stats_reader *r, intptr_t *values)
+{
+  if (! r->merge)
+    return;
+
+  for (uint32_t i = 0; i < r->count; ++i)
+    {
+      if (r->column[i] != i)
+        reduce_value(r->kinds[i], &values[r->column[i]], values[i]);
+    }
+}
+
+
+const struct stats_percentile stats_percentiles[] = {
+  { "p50", 0.5 },
+  { "p99", 0.99 },
+  { "p999", 0.999 },
+};
+
+const size_t stats_percentile_count =
+  sizeof(stats_percentiles) / sizeof(*stats_percentiles);
+
+
+static
+intptr_t
+hist_bucket_max(unsigned int bucket)
+{
+  // Inverse of _kroki_stats_hist_record() in kroki/stats.h.
+  if (bucket < 4)
+    return bucket;
+
+  unsigned int exp = bucket / 4 + 1;
+  return ((uintptr_t) (4 + bucket % 4 + 1) << (exp - 2)) - 1;
+}
+
+
+intptr_t
+stats_hist_percentile(const intptr_t *hist, double fraction)
+{
+  const intptr_t *buckets = hist + 2;
+  intptr_t total = 0;
+  for (unsigned int b = 0; b < _KROKI_STATS_HIST_BUCKETS; ++b)
+    total += buckets[b];
+
+  if (total <= 0)
+    return 0;
+
+  double rank = fraction * total;
+  unsigned int b = 0;
+  intptr_t seen = buckets[b];
+  while (seen < rank && b < _KROKI_STATS_HIST_BUCKETS - 1)
+    seen += buckets[++b];
+
+  return hist_bucket_max(b);
+}
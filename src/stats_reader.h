@@ -0,0 +1,337 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATS_READER_H
+#define STATS_READER_H 1
+
+#include "stats_file.h"
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+  Segment of the stats file as indexed by the reader.  Values of all
+  segments are read into a single array, where the values of the
+  segment start at 'first_value'.  'chunks' gives the offset of the
+  block of thread i * STATS_CHUNK_SLOTS, the first one in its chunk,
+  or zero if there's no such chunk, and 'infos' the offset of the
+  stats_thread_info of the chunk in the first segment, or zero if it
+  has none.  'totals' is the offset of the first totals block, zero
+  in files that have none.  Offsets are bytes from the start of the
+  file.
+*/
+struct stats_reader_segment
+{
+  uint32_t offset;
+  uint32_t retired;
+  uint32_t totals;
+  uint32_t value_count;
+  uint32_t block_size;
+  uint32_t first_value;
+  uint32_t first_extremum;
+  uint32_t extremum_count;
+  uint32_t *chunks;
+  uint32_t *infos;
+  uint32_t chunk_count;
+};
+
+
+/*
+  Reader keeps a stats file mapped between samples, remaps it when
+  the file grows and starts over when the file is replaced (the
+  application replaces stats file on restart).  Records are indexed
+  when the file gets new ones.
+
+  Values are read by entries: an entry is a single value, or all
+  values of a histogram, of a timer or of an array.  'entries' lists
+  the first value of every entry, in file order, or sorted by name
+  when 'sorted' is set.  With 'merge' values of entries with equal
+  name and kind are reduced into the first such entry, 'column' gives
+  the index of the value that a given value is reduced into.
+
+  'generation' changes every time the set of values changes (the
+  file is replaced, or a module loaded with dlopen() appends its
+  segment), so that the caller may drop whatever it keeps per value
+  or per slot.
+
+  'jobs' may be set after stats_reader_init() to the number of
+  threads stats_reader_sum() splits thread slots between, and
+  'aggregated' to take the totals the aggregator thread of the
+  application publishes instead, when it runs.
+*/
+struct stats_reader
+{
+  const char *filename;
+  int merge;
+  int sorted;
+  int jobs;
+  int aggregated;
+
+  int fd;
+  ino_t ino;
+  size_t size;
+  struct stats_file *file;
+  unsigned int generation;
+
+  // End of the records that were indexed, and cut_count of the file.
+  uint32_t records_end;
+  uint32_t cut_count;
+
+  struct stats_reader_segment *segments;
+  uint32_t segment_count;
+
+  uint32_t count;
+  uint8_t *kinds;
+  // Name offsets, bytes from the start of the file.
+  uint32_t *names;
+
+  // Data extent of the file that is being scanned.
+  size_t data_start;
+  size_t data_end;
+
+  uint32_t *entries;
+  uint32_t entry_count;
+  uint32_t *column;
+
+  // Values that are reduced other than by summation.
+  uint32_t *extremums;
+  intptr_t *extremum_values;
+  uint32_t extremum_count;
+
+  /*
+    Two scratch arrays followed by the partial totals of every chunk,
+    and the TID of every slot (zero if it was free), as of the last
+    scan of stats_reader_sum().
+  */
+  intptr_t *chunk_totals;
+  size_t chunk_totals_size;
+  long *slot_tids;
+  size_t slot_tid_count;
+
+  // Set when stats_reader_update() fails.
+  const char *error;
+};
+
+
+void
+stats_reader_init(struct stats_reader *r, const char *filename,
+                  int merge, int sorted);
+
+
+void
+stats_reader_close(struct stats_reader *r);
+
+
+/*
+  Open or update the mapping of the stats file.  Returns 1 when there
+  are values to read, 0 if there are none yet, or -1 with 'error' set
+  to the description of the failure (errno is preserved when the
+  failure comes from a system call, and is EINVAL otherwise).
+*/
+int
+stats_reader_update(struct stats_reader *r);
+
+
+static inline
+const char *
+stats_reader_name(const struct stats_reader *r, uint32_t i)
+{
+  return (const char *) r->file + r->names[i];
+}
+
+
+/*
+  Number of values in the entry that starts with value 'i'.  Values
+  of an array all refer to the same name.
+*/
+static inline
+uint32_t
+stats_reader_width(const struct stats_reader *r, uint32_t i)
+{
+  switch (r->kinds[i])
+    {
+    case _KROKI_STATS_KIND_HIST:
+      return _KROKI_STATS_HIST_VALUES;
+
+    case _KROKI_STATS_KIND_TIMER:
+      return _KROKI_STATS_TIMER_VALUES;
+
+    case _KROKI_STATS_KIND_ARRAY:
+      {
+        uint32_t j = i + 1;
+        while (j < r->count
+               && r->kinds[j] == _KROKI_STATS_KIND_ARRAY
+               && r->names[j] == r->names[i])
+          ++j;
+        return j - i;
+      }
+
+    default:
+      return 1;
+    }
+}
+
+
+/*
+  Convert ticks of a timer to nanoseconds.
+*/
+static inline
+intptr_t
+stats_reader_nsec(const struct stats_reader *r, intptr_t ticks)
+{
+  uint64_t frequency = r->file->timer_frequency;
+  if (frequency == 1000000000 || frequency == 0)
+    return ticks;
+  return (double) ticks * 1000000000 / frequency;
+}
+
+
+/*
+  Iterate over thread indices, starting with -1 and returning -1
+  after the last one.  Indices beyond 'slot_count' are being given
+  back and are not returned, nor are those whose block in the first
+  segment is in a hole (the storage of long free indices is given
+  back, and reading it would allocate it again).
+*/
+long
+stats_reader_next_slot(struct stats_reader *r, long index);
+
+
+/*
+  Copy the identity of the thread of a given index, which is only
+  meaningful while the index is not free.  Returns -1 if the file has
+  no identities.
+*/
+int
+stats_reader_thread_info(const struct stats_reader *r, long index,
+                         struct stats_thread_info *info);
+
+
+/*
+  Copy values of a thread.  Returns TID of the thread, or
+  non-positive value if the index is free.
+*/
+long
+stats_reader_read_slot(const struct stats_reader *r, long index,
+                       intptr_t *values);
+
+
+/*
+  Reduce thread values straight from the file into '*next', which
+  then replaces '*total' (unless the index is free).  Returns TID of
+  the thread, or zero if the index is free.
+*/
+long
+stats_reader_sum_slot(struct stats_reader *r, long index,
+                      intptr_t **total, intptr_t **next);
+
+
+void
+stats_reader_reset_total(const struct stats_reader *r, intptr_t *total);
+
+
+/*
+  Totals of all threads, including exited ones, into '*total'
+  ('*next' is a scratch buffer of the same size, the two may be
+  swapped).  Totals do not decrease between calls as long as the
+  file is not replaced.  With 'jobs' > 1 every job sums up a range
+  of whole chunks on a thread of its own.  Partial totals of chunks
+  are reduced in chunk order, so the result doesn't depend on which
+  job finishes first.  With 'aggregated' the totals may be up to
+  the interval of the aggregator thread old.
+*/
+void
+stats_reader_sum(struct stats_reader *r, intptr_t **total, intptr_t **next);
+
+
+/*
+  Wait for the aggregator thread to publish totals, at most
+  'timeout_ms'.  Returns 1 when there may be new totals, 0 on
+  timeout, or -1 with 'errno' set (ENOTSUP when there is no
+  aggregator thread).
+*/
+int
+stats_reader_wait_totals(struct stats_reader *r, long timeout_ms);
+
+
+/*
+  dst = total reduced with values.  'dst' may be the same as 'total'
+  but must not overlap with 'values'.
+*/
+void
+stats_reader_reduce(struct stats_reader *r, intptr_t *dst,
+                    const intptr_t *total, const intptr_t *values);
+
+
+/*
+  Reduce 'values' of the file into the columns 'dst' of another
+  array, value i into dst[columns[i]], unless it is
+  STATS_READER_NO_COLUMN.  Values of adjacent columns go through the
+  same kernel as stats_reader_reduce().
+*/
+#define STATS_READER_NO_COLUMN  UINT32_MAX
+
+void
+stats_reader_reduce_columns(struct stats_reader *r, intptr_t *dst,
+                            const uint32_t *columns, const intptr_t *values);
+
+
+/*
+  Reduce values of merged entries into the first such entry.
+*/
+void
+stats_reader_merge(const struct stats_reader *r, intptr_t *values);
+
+
+static inline
+int
+stats_value_is_set(uint8_t kind, intptr_t value)
+{
+  switch (kind)
+    {
+    case _KROKI_STATS_KIND_MAX:
+    case _KROKI_STATS_KIND_MIN:
+      return (value != stats_kind_initial_value(kind));
+
+    default:
+      return 1;
+    }
+}
+
+
+struct stats_percentile
+{
+  const char *suffix;
+  double fraction;
+};
+
+extern const struct stats_percentile stats_percentiles[];
+extern const size_t stats_percentile_count;
+
+
+/*
+  Upper bound of the first histogram bucket that covers requested
+  fraction of samples, zero for empty histogram.
+*/
+intptr_t
+stats_hist_percentile(const intptr_t *hist, double fraction);
+
+
+#endif  /* ! STATS_READER_H */
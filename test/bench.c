@@ -0,0 +1,490 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Hot path benchmark: ++stats(x) against a plain TLS counter, a
+  relaxed atomic on a private cache line and a contended atomic, for
+  1, 2, 4... up to the number of CPUs threads, then the same
+  ++stats(x) while another thread scans the stats file in a loop,
+  the cost of the first stats() call in a thread (with new and with
+  reused slot), and the throughput of summing up a large synthetic
+  stats file with 1, 2, 4... jobs.  Run with 'make benchmark'.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "../src/kroki/stats.h"
+#include "../src/stats_reader.h"
+#include "../src/record.h"
+#include <kroki/error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+
+// Iterations between the checks of 'stop'.
+#define CHUNK  1024
+
+#define CACHE_LINE  64
+
+
+/*
+  Compiler barrier makes every iteration load and store the counter,
+  as a single stats() in real code would.
+*/
+#define barrier()  __asm__ __volatile__("" : : : "memory")
+
+
+static long duration_ms = 200;
+static int stop;
+
+
+static
+double
+now_ns(void)
+{
+  struct timespec ts;
+  SYS(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static __thread intptr_t tls_counter;
+
+static intptr_t contended_counter __attribute__((__aligned__(CACHE_LINE)));
+
+
+struct worker
+{
+  intptr_t counter;
+  pthread_t thread;
+  long ops;
+  double ns;
+  uint64_t (*loop)(struct worker *);
+} __attribute__((__aligned__(CACHE_LINE)));
+
+
+#define BENCH_LOOP(name, op)                                            \
+  static                                                                \
+  uint64_t                                                              \
+  name(struct worker *w)                                                \
+  {                                                                     \
+    (void) w;                                                           \
+    uint64_t ops = 0;                                                   \
+    while (! __atomic_load_n(&stop, __ATOMIC_RELAXED))                  \
+      {                                                                 \
+        for (int i = 0; i < CHUNK; ++i)                                 \
+          {                                                             \
+            op;                                                         \
+            barrier();                                                  \
+          }                                                             \
+        ops += CHUNK;                                                   \
+      }                                                                 \
+    return ops;                                                         \
+  }
+
+BENCH_LOOP(loop_tls, ++tls_counter)
+BENCH_LOOP(loop_stats, ++stats(kroki.bench.counter))
+BENCH_LOOP(loop_atomic, __atomic_fetch_add(&w->counter, 1, __ATOMIC_RELAXED))
+BENCH_LOOP(loop_contended,
+           __atomic_fetch_add(&contended_counter, 1, __ATOMIC_RELAXED))
+
+
+static pthread_barrier_t start_barrier;
+
+
+static
+void *
+worker_run(void *arg)
+{
+  struct worker *w = arg;
+
+  // Keep slot creation out of the measurement.
+  stats(kroki.bench.counter) += 0;
+
+  pthread_barrier_wait(&start_barrier);
+  double start = now_ns();
+  w->ops = w->loop(w);
+  w->ns = now_ns() - start;
+
+  return NULL;
+}
+
+
+static const char *stats_filename;
+static long reader_scans;
+
+
+static
+void *
+reader_run(void *arg)
+{
+  (void) arg;
+
+  struct stats_reader reader;
+  stats_reader_init(&reader, stats_filename, 0, 0);
+
+  pthread_barrier_wait(&start_barrier);
+
+  long scans = 0;
+  while (! __atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+      if (stats_reader_update(&reader) != 1)
+        continue;
+
+      intptr_t total[reader.count];
+      intptr_t next[reader.count];
+      intptr_t *ptotal = total;
+      intptr_t *pnext = next;
+      stats_reader_sum(&reader, &ptotal, &pnext);
+      ++scans;
+    }
+  reader_scans = scans;
+
+  stats_reader_close(&reader);
+
+  return NULL;
+}
+
+
+static
+void
+run(const char *name, uint64_t (*loop)(struct worker *), int threads,
+    int with_reader)
+{
+  struct worker *workers;
+  POSIX(posix_memalign((void **) &workers, CACHE_LINE,
+                       sizeof(*workers) * threads));
+
+  POSIX(pthread_barrier_init(&start_barrier, NULL,
+                             threads + 1 + (with_reader ? 1 : 0)));
+  stop = 0;
+
+  for (int t = 0; t < threads; ++t)
+    {
+      workers[t] = (struct worker) { .loop = loop };
+      POSIX(pthread_create(&workers[t].thread, NULL, worker_run,
+                           &workers[t]));
+    }
+  pthread_t reader;
+  if (with_reader)
+    POSIX(pthread_create(&reader, NULL, reader_run, NULL));
+
+  pthread_barrier_wait(&start_barrier);
+  usleep(duration_ms * 1000);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+  long ops = 0;
+  double ns_per_op = 0;
+  for (int t = 0; t < threads; ++t)
+    {
+      POSIX(pthread_join(workers[t].thread, NULL));
+      ops += workers[t].ops;
+      ns_per_op += workers[t].ns / workers[t].ops;
+    }
+  if (with_reader)
+    POSIX(pthread_join(reader, NULL));
+
+  POSIX(pthread_barrier_destroy(&start_barrier));
+  free(workers);
+
+  printf("%-18s %7d %9.2f %11.1f", name, threads,
+         ns_per_op / threads, ops / (duration_ms * 1e3));
+  if (with_reader)
+    printf(" %9.0f", reader_scans / (duration_ms / 1e3));
+  printf("\n");
+}
+
+
+struct first_touch
+{
+  pthread_t thread;
+  double ns;
+};
+
+
+static
+void *
+first_touch_run(void *arg)
+{
+  struct first_touch *ft = arg;
+
+  pthread_barrier_wait(&start_barrier);
+  double start = now_ns();
+  ++stats(kroki.bench.first_touch);
+  ft->ns = now_ns() - start;
+
+  // Keep the slot until all threads got theirs.
+  pthread_barrier_wait(&start_barrier);
+
+  return NULL;
+}
+
+
+/*
+  Threads of the first round get new slots, threads of the second
+  round reuse slots freed by the first.
+*/
+static
+void
+run_first_touch(int threads)
+{
+  struct first_touch *fts = MEM(calloc(threads, sizeof(*fts)));
+
+  for (int round = 0; round < 2; ++round)
+    {
+      POSIX(pthread_barrier_init(&start_barrier, NULL, threads + 1));
+      for (int t = 0; t < threads; ++t)
+        POSIX(pthread_create(&fts[t].thread, NULL, first_touch_run,
+                             &fts[t]));
+      pthread_barrier_wait(&start_barrier);
+      pthread_barrier_wait(&start_barrier);
+
+      double sum = 0, max = 0;
+      for (int t = 0; t < threads; ++t)
+        {
+          POSIX(pthread_join(fts[t].thread, NULL));
+          sum += fts[t].ns;
+          if (max < fts[t].ns)
+            max = fts[t].ns;
+        }
+      POSIX(pthread_barrier_destroy(&start_barrier));
+
+      printf("%-18s %7d %9.2f %9.2f\n",
+             (round == 0 ? "first_touch_new" : "first_touch_reuse"),
+             threads, sum / threads / 1e3, max / 1e3);
+    }
+
+  free(fts);
+}
+
+
+#define SCAN_VALUES  256
+
+
+static
+size_t
+align_line(size_t size)
+{
+  return (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+}
+
+
+/*
+  Write a stats file of about 'size' bytes: a segment of SCAN_VALUES
+  counters followed by as many chunks of live threads as fit, value
+  i of every thread being i + 1.  The file is the same on every run,
+  and the totals are known.  The image is made the way 'kroki-stats
+  --replay' makes it.  Returns the number of threads.
+*/
+static
+uint32_t
+make_scan_file(const char *filename, size_t size)
+{
+  struct replay image = {
+    .source = filename,
+    .timer_frequency = 1000000000,
+    .count = SCAN_VALUES
+  };
+  image.fd = SYS(open(filename, O_RDWR | O_TRUNC));
+  snprintf(image.filename, sizeof(image.filename), "%s", filename);
+
+  image.kinds = MEM(malloc(sizeof(*image.kinds) * SCAN_VALUES));
+  image.names = MEM(malloc(sizeof(*image.names) * SCAN_VALUES));
+  image.name_data = MEM(malloc(sizeof("kroki.bench.scan4294967295")
+                               * SCAN_VALUES));
+  for (uint32_t i = 0; i < SCAN_VALUES; ++i)
+    {
+      image.kinds[i] = _KROKI_STATS_KIND_SUM;
+      image.names[i] = image.name_size;
+      image.name_size += sprintf(image.name_data + image.name_size,
+                                 "kroki.bench.scan%u", i) + 1;
+    }
+
+  // The header and the segment take about a chunk.
+  size_t block_size = align_line(sizeof(struct thread_slot)
+                                 + sizeof(intptr_t) * SCAN_VALUES);
+  size_t chunk_size = (align_line(sizeof(struct stats_chunk))
+                       + block_size * STATS_CHUNK_SLOTS);
+  if (size > UINT32_MAX)
+    size = UINT32_MAX;
+  size_t chunk_count = 1;
+  if (size > chunk_size * 2)
+    chunk_count = size / chunk_size - 1;
+  uint32_t threads = chunk_count * STATS_CHUNK_SLOTS;
+
+  image.slot_count = threads;
+  image.tids = MEM(malloc(sizeof(*image.tids) * threads));
+  image.values = MEM(malloc(sizeof(*image.values) * SCAN_VALUES * threads));
+  image.total = MEM(malloc(sizeof(*image.total) * SCAN_VALUES));
+  for (uint32_t t = 0; t < threads; ++t)
+    {
+      image.tids[t] = t + 1;
+      for (uint32_t i = 0; i < SCAN_VALUES; ++i)
+        image.values[(size_t) SCAN_VALUES * t + i] = i + 1;
+    }
+  for (uint32_t i = 0; i < SCAN_VALUES; ++i)
+    image.total[i] = (intptr_t) threads * (i + 1);
+
+  replay_write_image(&image);
+
+  SYS(close(image.fd));
+  free(image.image);
+  free(image.total);
+  free(image.values);
+  free(image.tids);
+  free(image.name_data);
+  free(image.names);
+  free(image.kinds);
+
+  return threads;
+}
+
+
+static
+void
+run_scan(const char *filename, uint32_t threads, int jobs)
+{
+  struct stats_reader reader;
+  stats_reader_init(&reader, filename, 0, 0);
+  reader.jobs = jobs;
+  if (stats_reader_update(&reader) != 1)
+    error("%s: %s", filename, (reader.error ? reader.error : "no values"));
+
+  intptr_t *total = MEM(malloc(sizeof(*total) * reader.count));
+  intptr_t *next = MEM(malloc(sizeof(*next) * reader.count));
+
+  // The first scan faults the file in.
+  stats_reader_sum(&reader, &total, &next);
+
+  long scans = 0;
+  double start = now_ns();
+  double ns;
+  do
+    {
+      stats_reader_sum(&reader, &total, &next);
+      ++scans;
+      ns = now_ns() - start;
+    }
+  while (ns < duration_ms * 1e6);
+
+  for (uint32_t i = 0; i < reader.count; ++i)
+    {
+      if (total[i] != (intptr_t) threads * (i + 1))
+        error("scan with %d jobs: wrong total of value %u", jobs, i);
+    }
+
+  double bytes = (double) threads * reader.segments[0].block_size * scans;
+  printf("%-18s %7d %9.2f %9.2f\n", "scan", jobs, ns / scans / 1e6,
+         bytes / ns);
+
+  free(next);
+  free(total);
+  stats_reader_close(&reader);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  int max_threads = SYS(sysconf(_SC_NPROCESSORS_ONLN));
+  long scan_mb = 256;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:t:s:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'd':
+          duration_ms = atol(optarg);
+          break;
+
+        case 't':
+          max_threads = atoi(optarg);
+          break;
+
+        case 's':
+          scan_mb = atol(optarg);
+          break;
+
+        default:
+          fprintf(stderr, "Usage: %s [-d MS] [-t MAXTHREADS] [-s SCANMB]\n",
+                  argv[0]);
+          exit(EXIT_FAILURE);
+        }
+    }
+  if (duration_ms <= 0 || max_threads <= 0 || scan_mb <= 0)
+    error("invalid arguments");
+
+  char filename[] = "/tmp/kroki-stats.bench.XXXXXX";
+  SYS(close(SYS(mkstemp(filename))));
+  if (stats_open(filename) == -1)
+    error("%s: %m", filename);
+  stats_filename = filename;
+
+  // Main thread does the first stats() call in the process.
+  stats(kroki.bench.counter) += 0;
+
+  // Before any thread exits, so that the first round gets new slots.
+  printf("%-18s %7s %9s %9s\n", "benchmark", "threads", "us/avg", "us/max");
+  run_first_touch(max_threads);
+
+  printf("\n%-18s %7s %9s %11s %9s\n",
+         "benchmark", "threads", "ns/op", "Mops/s", "scans/s");
+  for (int threads = 1; ; threads *= 2)
+    {
+      if (threads > max_threads)
+        threads = max_threads;
+
+      run("tls", loop_tls, threads, 0);
+      run("stats", loop_stats, threads, 0);
+      run("atomic_relaxed", loop_atomic, threads, 0);
+      run("atomic_contended", loop_contended, threads, 0);
+      run("stats_with_reader", loop_stats, threads, 1);
+
+      if (threads == max_threads)
+        break;
+    }
+
+  SYS(unlink(filename));
+
+  char scan_filename[] = "/tmp/kroki-stats.scan.XXXXXX";
+  SYS(close(SYS(mkstemp(scan_filename))));
+  uint32_t scan_threads = make_scan_file(scan_filename, scan_mb << 20);
+
+  printf("\n%-18s %7s %9s %9s\n", "benchmark", "jobs", "ms/scan", "GB/s");
+  for (int jobs = 1; ; jobs *= 2)
+    {
+      if (jobs > max_threads)
+        jobs = max_threads;
+
+      run_scan(scan_filename, scan_threads, jobs);
+
+      if (jobs == max_threads)
+        break;
+    }
+
+  SYS(unlink(scan_filename));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/*
+  Copyright (C) 2012 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A burst of threads that all have their values at once, then exit.
+  On SIGUSR1 the program waits for their slots to stay idle past
+  KROKI_STATS_RECLAIM_SEC (given again as the argument, the library
+  takes it out of the environment) and starts one more thread, which
+  gives the storage back on its start and exit.
+*/
+
+#include "../src/kroki/stats.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define THREADS  256
+
+
+static pthread_barrier_t barrier;
+
+
+static
+void *
+burst_thread(void *arg)
+{
+  // A page of values, so that the storage of every slot is visible.
+  ++stats_array(kroki.burst.page, 512)[0];
+  ++stats(kroki.burst.count);
+  pthread_barrier_wait(&barrier);
+
+  return arg;
+}
+
+
+static
+void *
+late_thread(void *arg)
+{
+  ++stats(kroki.burst.late);
+
+  return arg;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  alarm(60);
+
+  unsigned int idle_sec = (argc > 1 ? atoi(argv[1]) : 1);
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+    return EXIT_FAILURE;
+
+  pthread_t threads[THREADS];
+  pthread_barrier_init(&barrier, NULL, THREADS);
+  for (int i = 0; i < THREADS; ++i)
+    {
+      if (pthread_create(&threads[i], NULL, burst_thread, NULL) != 0)
+        return EXIT_FAILURE;
+    }
+  for (int i = 0; i < THREADS; ++i)
+    {
+      if (pthread_join(threads[i], NULL) != 0)
+        return EXIT_FAILURE;
+    }
+
+  int sig;
+  if (sigwait(&set, &sig) != 0)
+    return EXIT_FAILURE;
+
+  /*
+    The check when the thread gets its values cuts the free chunks
+    off, the one when it exits truncates the file.
+  */
+  sleep(idle_sec + 1);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, late_thread, NULL) != 0
+      || pthread_join(thread, NULL) != 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
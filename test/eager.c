@@ -0,0 +1,75 @@
+/*
+  Copyright (C) 2012 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Threads of an eager module: one started with pthread_create() has
+  its values right away, one started with thrd_create() counts into
+  the scratch area until its first stats_batch.
+*/
+
+#define KROKI_STATS_EAGER 1
+#include "../src/kroki/stats.h"
+#include <pthread.h>
+#include <threads.h>
+#include <stdlib.h>
+
+
+static
+void *
+pthread_thread(void *arg)
+{
+  ++stats(kroki.eager.pthread);
+
+  return arg;
+}
+
+
+static
+int
+thrd_thread(void *arg)
+{
+  (void) arg;
+
+  ++stats(kroki.eager.scratch);
+  stats_batch
+    ++stats(kroki.eager.batch);
+  ++stats(kroki.eager.thrd);
+
+  return 0;
+}
+
+
+int
+main(void)
+{
+  stats_thread_init();
+  ++stats(kroki.eager.main);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pthread_thread, NULL) != 0
+      || pthread_join(thread, NULL) != 0)
+    return EXIT_FAILURE;
+
+  thrd_t thrd;
+  if (thrd_create(&thrd, thrd_thread, NULL) != thrd_success
+      || thrd_join(thrd, NULL) != thrd_success)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
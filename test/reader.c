@@ -0,0 +1,87 @@
+/*
+  Copyright (C) 2013 Tomash Brechko.  All rights reserved.
+
+  This file is part of kroki/stats.
+
+  Kroki/stats is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Kroki/stats is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with kroki/stats.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Take two snapshots of STATSFILE with libkroki-stats-reader and
+  output the totals of the second one and their changes since the
+  first one, as 'NAME TOTAL CHANGE' lines.
+*/
+
+#include "../src/kroki/stats-reader.h"
+#include <kroki/error.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+
+static
+void
+alloc_snapshot(struct kroki_stats_reader *r, struct kroki_stats_snapshot *s)
+{
+  uint32_t count = kroki_stats_reader_value_count(r);
+  s->slot_capacity = kroki_stats_reader_slot_count(r);
+  s->total = MEM(realloc(s->total, sizeof(*s->total) * count));
+  s->tids = MEM(realloc(s->tids, sizeof(*s->tids) * (s->slot_capacity + 1)));
+  s->values = MEM(realloc(s->values, (sizeof(*s->values) * count
+                                      * (s->slot_capacity + 1))));
+}
+
+
+static
+void
+take_snapshot(struct kroki_stats_reader *r, struct kroki_stats_snapshot *s)
+{
+  do
+    {
+      if (kroki_stats_reader_update(r) != 1)
+        error("no values: %m");
+      alloc_snapshot(r, s);
+    }
+  while (kroki_stats_reader_snapshot(r, s) == -1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 2)
+    error("Usage: %s STATSFILE", argv[0]);
+
+  struct kroki_stats_reader *r = MEM(kroki_stats_reader_open(argv[1]));
+  struct kroki_stats_snapshot prev = { 0 }, next = { 0 }, delta = { 0 };
+
+  take_snapshot(r, &prev);
+  usleep(200000);
+  take_snapshot(r, &next);
+  alloc_snapshot(r, &delta);
+  SYS(kroki_stats_snapshot_diff(r, &delta, &prev, &next));
+
+  for (uint32_t i = 0; i < next.value_count;
+       i += kroki_stats_reader_width(r, i))
+    {
+      const char *name = kroki_stats_reader_name(r, i);
+      if (*name)
+        printf("%s %ld %ld\n", name, (long) next.total[i],
+               (long) delta.total[i]);
+    }
+
+  kroki_stats_reader_close(r);
+
+  return EXIT_SUCCESS;
+}
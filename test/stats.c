@@ -18,6 +18,8 @@
 */
 
 #include "../src/kroki/stats.h"
+#include <dlfcn.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
@@ -27,17 +29,86 @@
 #define OMP(a)  PRAGMA(omp a)
 
 
+static stats_handle_t lookup_handle;
+
+
+static
+void *
+exiting_thread(void *arg)
+{
+  stats_h(lookup_handle) += 2;
+  ++stats_array(kroki.stats.array, 4)[2];
+  stats_add(kroki.stats.added, 5);
+  stats_min(kroki.stats.min, (intptr_t) arg);
+  // Last values of exited threads are left out of the totals.
+  stats_set(kroki.stats.last, 9);
+
+  stats_timer(kroki.stats.timer)
+    {
+      struct timespec timeout = {
+        .tv_sec = 0,
+        .tv_nsec = 1000000
+      };
+      nanosleep(&timeout, NULL);
+    }
+
+  stats_batch
+    {
+      stats(kroki.stats.exited) += 7;
+      stats_batch
+        ++stats(kroki.stats.batches);
+    }
+
+  return arg;
+}
+
+
 int
 main(void)
 {
   alarm(60);
 
+  lookup_handle = stats_lookup("kroki.stats.lookup");
+  if (! lookup_handle || stats_lookup("kroki.stats.lookup") != lookup_handle)
+    return EXIT_FAILURE;
+
+  // Values of exited threads should stay in the totals.
+  for (int i = 0; i < 3; ++i)
+    {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, exiting_thread,
+                         (void *) (intptr_t) (5 - i)) != 0
+          || pthread_join(thread, NULL) != 0)
+        return EXIT_FAILURE;
+    }
+
+  stats_min(kroki.stats.min, 4);
+  stats_set(kroki.stats.last_main, 11);
+
+  // Every load of the module gets a segment that outlives dlclose().
+  for (int i = 0; i < 2; ++i)
+    {
+      void *module = dlopen(MODULE_PATH, RTLD_NOW);
+      if (! module)
+        return EXIT_FAILURE;
+      void (*increment)(void) =
+        (void (*)(void)) dlsym(module, "module_increment");
+      if (! increment)
+        return EXIT_FAILURE;
+      increment();
+      if (dlclose(module) != 0)
+        return EXIT_FAILURE;
+    }
+
   OMP(parallel)
   {
+    stats_set_thread_group("omp");
+
     unsigned int seed = time(NULL) + omp_get_thread_num();
     long total_nsec = 0;
     while (1)
       {
+        ++stats_hot(kroki.stats.iterations_hot);
         ++stats(kroki.stats.iterations);
 
         int r = rand_r(&seed);
@@ -49,6 +120,9 @@ main(void)
         nanosleep(&timeout, NULL);
         total_nsec += nsec;
 
+        stats_hist(kroki.stats.usec, nsec / 1000);
+        stats_max(kroki.stats.max_nsec, nsec);
+
         if (total_nsec >= 1000000000)
           {
             total_nsec = 0;
@@ -4,7 +4,9 @@ set -o errexit -o nounset -o noclobber
 
 
 STATS_FILE=/tmp/kroki-stats.test.$$
-EXPECT=$[$(getconf _NPROCESSORS_ONLN) * 3]
+# Every OpenMP thread updates these five values.
+PER_THREAD='kroki\.stats\.\(iterations\(_hot\)\?\|max_nsec\|updates\|nsec\)'
+EXPECT=$[$(getconf _NPROCESSORS_ONLN) * 5]
 
 KROKI_STATS_FILE=$STATS_FILE ./stats &
 
@@ -12,13 +14,78 @@ for ((i = 0; i < 50; ++i)); do
     kill -0 %1
     if [ -e $STATS_FILE ]; then
         MATCHES=$(../src/kroki-stats $STATS_FILE \
-                  | grep -c '^\[[0-9]\+\] kroki\..*: [^0]' || :)
+                  | grep -c "^\[[0-9]\+\] $PER_THREAD: [^0]" || :)
         test $MATCHES -eq $EXPECT && break || :
     fi
     sleep 0.2
 done
 ../src/kroki-stats $STATS_FILE
 test $MATCHES -eq $EXPECT
+../src/kroki-stats $STATS_FILE | grep -q '^\[\*\] kroki\.stats\.usec\.p50: [1-9]'
+../src/kroki-stats $STATS_FILE | grep -q '^\[\*\] kroki\.stats\.max_nsec: [1-9]'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.iterations: [1-9]'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.exited: 21$'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.batches: 3$'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.lookup: 6$'
+test "$(../src/kroki-stats --sum $STATS_FILE | grep 'kroki\.stats\.array')" \
+    = '[*] kroki.stats.array[2]: 3'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.timer\.count: 3$'
+../src/kroki-stats --sum $STATS_FILE \
+    | awk '/^\[\*\] kroki\.stats\.timer\.nsec: / { n = $3 }
+           END { exit !(n >= 3000000 && n < 3000000000) }'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.added: 15$'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.min: 3$'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.last: 0$'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.last_main: 11$'
+# The module was loaded twice, both segments stay after dlclose().
+test "$(../src/kroki-stats --layout $STATS_FILE \
+            | grep -c '^segment [1-9]: 1 values')" -eq 2
+test "$(../src/kroki-stats --sum $STATS_FILE | grep 'kroki\.stats\.module')" \
+    = "$(printf '[*] kroki.stats.module: 1\n[*] kroki.stats.module: 1')"
+../src/kroki-stats --sum --merge $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.module: 2$'
+test "$(../src/kroki-stats --by-group $STATS_FILE \
+            | grep -c '^\[omp\] kroki\.stats\.iterations: [1-9]')" -eq 1
+../src/kroki-stats --sum --jobs=4 $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.exited: 21$'
+../src/kroki-stats --sum $STATS_FILE "$STATS_FILE*" \
+    | grep -q '^\[\*\] kroki\.stats\.exited: 21$'
+./reader $STATS_FILE | grep -q '^kroki\.stats\.exited 21 0$'
+./reader $STATS_FILE | grep -q '^kroki\.stats\.iterations [1-9][0-9]* [0-9]\+$'
+../src/kroki-stats --layout $STATS_FILE | sed -n 2p \
+    | grep -q '^ *16  line 0  value kroki\.stats\.iterations_hot$'
+../src/kroki-stats --format=columnar $STATS_FILE \
+    | grep -q '^tid.*\<kroki\.stats\.iterations\>'
+timeout 1 ../src/kroki-stats --sum --interval=400 $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.iterations: [0-9]'
+timeout 1 ../src/kroki-stats --record=$STATS_FILE.rec --interval=50 \
+    $STATS_FILE || :
+../src/kroki-stats --replay --sum $STATS_FILE.rec \
+    | grep -q '^\[\*\] kroki\.stats\.iterations: [0-9]'
+../src/kroki-stats --diff=0,1 --sum $STATS_FILE.rec \
+    | grep -q '^\[\*\] kroki\.stats\.exited: 0$'
+rm $STATS_FILE.rec
+
+if command -v curl >/dev/null; then
+    ../src/kroki-stats-exporter --listen=unix:$STATS_FILE.sock $STATS_FILE &
+    for ((i = 0; i < 50; ++i)); do
+        test -S $STATS_FILE.sock && break || sleep 0.1
+    done
+    curl -s --unix-socket $STATS_FILE.sock http://localhost/metrics \
+        | grep -q '^kroki_stats_iterations [1-9]' || RC=$?
+    kill %2
+    rm $STATS_FILE.sock
+    test ${RC:-0} -eq 0
+fi
 
 kill -0 %1
 # kill && wait should be in one shell command.
@@ -26,3 +93,68 @@ kill -TERM %1 && wait %1 2>/dev/null || RC=$?
 test $[RC - 128] -eq $(kill -l TERM)
 
 rm $STATS_FILE
+
+# Per-CPU file: stats_add() values are in the per-CPU blocks.  The
+# aggregator thread publishes them along with the rest.
+KROKI_STATS_FILE=$STATS_FILE KROKI_STATS_PERCPU=1 KROKI_STATS_AGGREGATE_MS=50 \
+    ./stats &
+for ((i = 0; i < 50; ++i)); do
+    kill -0 %1
+    ../src/kroki-stats --sum $STATS_FILE 2>/dev/null \
+        | grep -q '^\[\*\] kroki\.stats\.added: 15$' && break || :
+    sleep 0.2
+done
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.added: 15$'
+../src/kroki-stats --sum --aggregated $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.stats\.exited: 21$'
+kill -TERM %1 && wait %1 2>/dev/null || :
+
+rm $STATS_FILE
+
+# Eager module: a thread of thrd_create() counts into the scratch area
+# until stats_batch gives it its values.
+KROKI_STATS_FILE=$STATS_FILE ./eager
+test "$(../src/kroki-stats --sum $STATS_FILE)" \
+    = "$(printf '[*] kroki.eager.%s\n' \
+                'pthread: 1' 'scratch: 0' 'batch: 1' 'thrd: 1' 'main: 1')"
+
+rm $STATS_FILE
+
+# Storage of the slots of a burst of threads is given back once they
+# stay unused, and the file is still read after that.
+KROKI_STATS_FILE=$STATS_FILE KROKI_STATS_RECLAIM_SEC=1 ./burst 1 &
+for ((i = 0; i < 50; ++i)); do
+    kill -0 %1
+    ../src/kroki-stats --sum $STATS_FILE 2>/dev/null \
+        | grep -q '^\[\*\] kroki\.burst\.count: 256$' && break || :
+    sleep 0.2
+done
+BLOCKS=$(stat -c %b $STATS_FILE)
+kill -USR1 %1 && wait %1
+test $(stat -c %b $STATS_FILE) -lt $BLOCKS
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.burst\.count: 256$'
+../src/kroki-stats --sum $STATS_FILE \
+    | grep -q '^\[\*\] kroki\.burst\.late: 1$'
+
+rm $STATS_FILE
+
+# Files on tmpfs with transparent huge pages, and on hugetlbfs when it
+# is mounted and has free huge pages.
+DIRS=/dev/shm
+HUGETLBFS=$(awk '$3 == "hugetlbfs" { print $2; exit }' /proc/mounts)
+if [ -n "$HUGETLBFS" ] && [ -w "$HUGETLBFS" ] \
+       && [ $(awk '/^HugePages_Free:/ { print $2 }' /proc/meminfo) -gt 0 ]
+then
+    DIRS="$DIRS $HUGETLBFS"
+fi
+for DIR in $DIRS; do
+    [ -d $DIR ] && [ -w $DIR ] || continue
+    HUGE_FILE=$DIR/kroki-stats.test.$$
+    KROKI_STATS_FILE=$HUGE_FILE KROKI_STATS_HUGEPAGE=1 ./eager
+    test "$(../src/kroki-stats --sum $HUGE_FILE)" \
+        = "$(printf '[*] kroki.eager.%s\n' \
+                    'pthread: 1' 'scratch: 0' 'batch: 1' 'thrd: 1' 'main: 1')"
+    rm $HUGE_FILE
+done
@@ -0,0 +1 @@
+m4_define([VERSION_STRING], [0.0-48_gf82d96d_dirty])